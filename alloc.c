@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+
+#include "alloc.h"
+#include "macros.h"
+#include "maps.h"
+
+#define SUPERPAGE_SIZE (2 * 1024 * 1024)
+#define PREFAULT_CHUNK_SIZE (1024 * 1024)
+
+static mach_vm_size_t round_up(mach_vm_size_t size, mach_vm_size_t multiple) {
+	return (size + multiple - 1) / multiple * multiple;
+}
+
+static bool get_faults(task_t task, integer_t *faults) {
+	task_events_info_data_t info;
+	mach_msg_type_number_t count = TASK_EVENTS_INFO_COUNT;
+	if(task_info(task, TASK_EVENTS_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) {
+		return false;
+	}
+
+	*faults = info.faults;
+	return true;
+}
+
+static unsigned int resident_pages(task_t task, mach_vm_address_t address) {
+	mach_vm_size_t size;
+	natural_t depth = 0;
+	vm_region_submap_info_data_64_t info;
+	mach_msg_type_number_t count = VM_REGION_SUBMAP_INFO_COUNT_64;
+	if(mach_vm_region_recurse(task, &address, &size, &depth, (vm_region_recurse_info_t)&info, &count) != KERN_SUCCESS) {
+		return 0;
+	}
+
+	return info.pages_resident;
+}
+
+// Writes zeroes over the whole range so every page is resident before the
+// child first touches it
+static bool prefault(task_t task, mach_vm_address_t address, mach_vm_size_t size) {
+	size_t chunk_size = size < PREFAULT_CHUNK_SIZE? size: PREFAULT_CHUNK_SIZE;
+	void *zeroes = calloc(1, chunk_size);
+
+	for(mach_vm_size_t offset = 0; offset < size; offset += chunk_size) {
+		mach_vm_size_t len = size - offset < chunk_size? size - offset: chunk_size;
+		KERN_TRY("mach_vm_write", mach_vm_write(task, address + offset, (vm_offset_t)zeroes, len), {
+			free(zeroes);
+			return false;
+		});
+	}
+
+	free(zeroes);
+	return true;
+}
+
+static bool wire(task_t task, mach_vm_address_t address, mach_vm_size_t size) {
+	mach_port_t host_priv;
+	KERN_TRY("host_get_host_priv_port", host_get_host_priv_port(mach_host_self(), &host_priv), {
+		puts("Locking memory requires running as root.");
+		return false;
+	});
+
+	KERN_TRY("mach_vm_wire", mach_vm_wire(host_priv, task, address, size, VM_PROT_READ | VM_PROT_WRITE), {
+		return false;
+	});
+
+	return true;
+}
+
+bool alloc_parse_option(char *str, alloc_options_t *options) {
+	if(strcmp(str, "huge") == 0) {
+		options->page_size = ALLOC_PAGES_2M;
+	} else if(strcmp(str, "huge1g") == 0) {
+		options->page_size = ALLOC_PAGES_1G;
+	} else if(strcmp(str, "prefault") == 0) {
+		options->prefault = true;
+	} else if(strcmp(str, "lock") == 0) {
+		options->lock = true;
+	} else if(strncmp(str, "align=", 6) == 0) {
+		char *endptr;
+		options->align = strtoull(str + 6, &endptr, 0);
+		// Only powers of two can be expressed as an address mask
+		if(*endptr != '\0' || options->align == 0 || (options->align & (options->align - 1)) != 0) {
+			return false;
+		}
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+// Allocates memory in the child, size is rounded up to the page size used
+bool alloc_memory(task_t task, mach_vm_size_t *_size, alloc_options_t *options, mach_vm_address_t *address) {
+	mach_vm_size_t size = *_size;
+	alloc_page_size page_size = options->page_size;
+
+	if(page_size == ALLOC_PAGES_1G) {
+		puts("1 GiB pages are not supported on OS X, using 2 MiB pages.");
+		page_size = ALLOC_PAGES_2M;
+	}
+
+	mach_vm_size_t align = options->align? options->align: vm_page_size;
+	kern_return_t ret = KERN_FAILURE;
+
+	if(page_size == ALLOC_PAGES_2M) {
+		mach_vm_size_t super_size = round_up(size, SUPERPAGE_SIZE);
+		mach_vm_size_t mask = (align > SUPERPAGE_SIZE? align: SUPERPAGE_SIZE) - 1;
+		ret = mach_vm_map(task, address, super_size, mask, VM_FLAGS_ANYWHERE | VM_FLAGS_SUPERPAGE_SIZE_2MB, MEMORY_OBJECT_NULL, 0, false, VM_PROT_DEFAULT, VM_PROT_ALL, VM_INHERIT_DEFAULT);
+		if(ret == KERN_SUCCESS) {
+			size = super_size;
+		} else {
+			printf("2 MiB pages are not available (%s), using 4 KiB pages.\n", mach_error_string(ret));
+			page_size = ALLOC_PAGES_DEFAULT;
+		}
+	}
+
+	if(page_size == ALLOC_PAGES_DEFAULT) {
+		size = round_up(size, vm_page_size);
+		KERN_TRY("mach_vm_map", mach_vm_map(task, address, size, align - 1, VM_FLAGS_ANYWHERE, MEMORY_OBJECT_NULL, 0, false, VM_PROT_DEFAULT, VM_PROT_ALL, VM_INHERIT_DEFAULT), {
+			return false;
+		});
+	}
+
+	maps_note(*address, size, "alloc");
+	*_size = size;
+
+	bool report = options->page_size != ALLOC_PAGES_DEFAULT || options->prefault || options->lock || options->align;
+	if(!report) {
+		return true;
+	}
+
+	integer_t faults_before = 0;
+	integer_t faults_after = 0;
+	bool have_faults = get_faults(task, &faults_before);
+
+	bool locked = false;
+	if(options->lock) {
+		locked = wire(task, *address, size);
+	}
+
+	// Superpages are always resident and wiring faults everything in
+	if(options->prefault && page_size == ALLOC_PAGES_DEFAULT && !locked) {
+		prefault(task, *address, size);
+	}
+
+	have_faults = have_faults && get_faults(task, &faults_after);
+
+	mach_vm_size_t pages = size / (page_size == ALLOC_PAGES_2M? SUPERPAGE_SIZE: vm_page_size);
+	printf("Backing: %llu x %s pages%s, %u/%llu pages resident", pages, page_size == ALLOC_PAGES_2M? "2 MiB": "4 KiB", locked? " (locked)": "", resident_pages(task, *address), size / vm_page_size);
+	if(have_faults && (options->prefault || locked)) {
+		printf(", %d faults while populating", faults_after - faults_before);
+	}
+	puts("");
+
+	return true;
+}
+
+// Named allocations are carved out of one region that is reserved on first
+// use, so they don't cost a system call and pack densely into few pages
+#define HEAP_SIZE (256 * 1024 * 1024)
+#define HEAP_DEFAULT_ALIGN 16
+
+static named_alloc_t *names;
+static size_t name_count;
+
+static mach_vm_address_t heap;
+static mach_vm_size_t heap_used;
+
+bool alloc_valid_name(const char *name) {
+	if(!isalpha(name[0]) && name[0] != '_') {
+		return false;
+	}
+
+	for(const char *c = name; *c; c++) {
+		if(!isalnum(*c) && *c != '_') {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void alloc_set_name(const char *name, mach_vm_address_t address, mach_vm_size_t size) {
+	for(size_t i = 0; i < name_count; i++) {
+		if(strcmp(names[i].name, name) == 0) {
+			names[i].address = address;
+			names[i].size = size;
+			return;
+		}
+	}
+
+	names = realloc(names, (name_count + 1) * sizeof(*names));
+	names[name_count++] = (named_alloc_t){
+		.name = strdup(name),
+		.address = address,
+		.size = size,
+	};
+}
+
+bool alloc_lookup(const char *name, size_t name_len, mach_vm_address_t *address) {
+	for(size_t i = 0; i < name_count; i++) {
+		if(strlen(names[i].name) == name_len && strncmp(names[i].name, name, name_len) == 0) {
+			*address = names[i].address;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void alloc_list(void) {
+	for(size_t i = 0; i < name_count; i++) {
+		printf("$%s = 0x%llx (%llu bytes)\n", names[i].name, names[i].address, names[i].size);
+	}
+}
+
+const named_alloc_t *alloc_names(size_t *count) {
+	*count = name_count;
+	return names;
+}
+
+bool alloc_named(task_t task, const char *name, mach_vm_size_t size, mach_vm_size_t align, mach_vm_address_t *address) {
+	if(align == 0) {
+		align = HEAP_DEFAULT_ALIGN;
+	}
+
+	if((align & (align - 1)) != 0 || align > vm_page_size) {
+		puts("The alignment must be a power of two no larger than the page size.");
+		return false;
+	}
+
+	if(!heap) {
+		// Pages of the reservation are only backed once they are touched
+		KERN_TRY("mach_vm_allocate", mach_vm_allocate(task, &heap, HEAP_SIZE, VM_FLAGS_ANYWHERE), {
+			heap = 0;
+			return false;
+		});
+		maps_note(heap, HEAP_SIZE, "heap");
+		maps_note_used(heap, 0);
+	}
+
+	mach_vm_size_t offset = round_up(heap_used, align);
+	if(size > HEAP_SIZE || offset > HEAP_SIZE - size) {
+		printf("The heap for named allocations is full (%d MiB).\n", HEAP_SIZE / 1024 / 1024);
+		return false;
+	}
+
+	heap_used = offset + size;
+	maps_note_used(heap, heap_used);
+	*address = heap + offset;
+
+	alloc_set_name(name, *address, size);
+	return true;
+}
+
+// Forgets the names and the heap, for when the child's memory was reset
+void alloc_reset(void) {
+	for(size_t i = 0; i < name_count; i++) {
+		free(names[i].name);
+	}
+	free(names);
+	names = NULL;
+	name_count = 0;
+
+	heap = 0;
+	heap_used = 0;
+}
+
+// Replaces every $name of a named allocation in an assembly snippet with its
+// address. In at&t syntax the address is used as an immediate.
+char *alloc_substitute(const char *str, bool att_syntax) {
+	size_t len = strlen(str);
+	size_t capacity = len + 1;
+	char *result = malloc(capacity);
+	size_t j = 0;
+
+	for(size_t i = 0; i < len;) {
+		size_t name_len = 0;
+		if(str[i] == '$') {
+			while(isalnum(str[i + 1 + name_len]) || str[i + 1 + name_len] == '_') {
+				name_len++;
+			}
+		}
+
+		mach_vm_address_t address;
+		if(name_len > 0 && !isdigit(str[i + 1]) && alloc_lookup(str + i + 1, name_len, &address)) {
+			char number[32];
+			int number_len = snprintf(number, sizeof(number), "%s0x%llx", att_syntax? "$": "", address);
+
+			capacity += number_len;
+			result = realloc(result, capacity);
+			memcpy(result + j, number, number_len);
+			j += number_len;
+			i += 1 + name_len;
+		} else {
+			result[j++] = str[i++];
+		}
+	}
+
+	result[j] = '\0';
+	return result;
+}
@@ -0,0 +1,29 @@
+typedef enum {
+	ALLOC_PAGES_DEFAULT,
+	ALLOC_PAGES_2M,
+	ALLOC_PAGES_1G,
+} alloc_page_size;
+
+typedef struct {
+	alloc_page_size page_size;
+	bool prefault;
+	bool lock;
+	mach_vm_size_t align;
+} alloc_options_t;
+
+typedef struct {
+	char *name;
+	mach_vm_address_t address;
+	mach_vm_size_t size;
+} named_alloc_t;
+
+bool alloc_parse_option(char *str, alloc_options_t *options);
+bool alloc_memory(task_t task, mach_vm_size_t *size, alloc_options_t *options, mach_vm_address_t *address);
+bool alloc_valid_name(const char *name);
+void alloc_set_name(const char *name, mach_vm_address_t address, mach_vm_size_t size);
+bool alloc_lookup(const char *name, size_t name_len, mach_vm_address_t *address);
+void alloc_list(void);
+const named_alloc_t *alloc_names(size_t *count);
+void alloc_reset(void);
+bool alloc_named(task_t task, const char *name, mach_vm_size_t size, mach_vm_size_t align, mach_vm_address_t *address);
+char *alloc_substitute(const char *str, bool att_syntax);
@@ -0,0 +1,81 @@
+typedef union {
+	uint32_t eflags;
+	uint64_t rflags;
+	struct __attribute__((packed)) {
+		uint8_t CF    :1;
+		uint8_t _res1 :1;
+		uint8_t PF    :1;
+		uint8_t _res2 :1;
+		uint8_t AF    :1;
+		uint8_t _res3 :1;
+		uint8_t ZF    :1;
+		uint8_t SF    :1;
+		uint8_t TF    :1;
+		uint8_t IF    :1;
+		uint8_t DF    :1;
+		uint8_t OF    :1;
+		uint8_t IOPL  :2;
+		uint8_t NT    :1;
+		uint8_t _res4 :1;
+
+		uint8_t RF    :1;
+		uint8_t VM    :1;
+		uint8_t AC    :1;
+		uint8_t VIF   :1;
+		uint8_t VIP   :1;
+		uint8_t ID    :1;
+
+		uint16_t _res5 :10;
+
+		uint32_t _res6 :32;
+	};
+} x86_flags_t;
+
+#if defined(__i386__)
+
+#define BITS 32
+#define ARCH_NAME "i386"
+
+#define ts ts32
+#define fs fs32
+#define ds ds32
+
+typedef uint32_t gpr_register_t;
+#define REGISTER_FORMAT_DEC "%" PRIu32
+#define REGISTER_FORMAT_HEX "%" PRIX32
+#define REGISTER_FORMAT_HEX_PADDED "%08" PRIX32
+
+#define pc_register __eip
+#define flags_register __eflags
+
+#define IF32(X, Y) X
+
+#elif defined(__x86_64__)
+
+#define BITS 64
+#define ARCH_NAME "x86_64"
+
+#define ts ts64
+#define fs fs64
+#define ds ds64
+
+typedef uint64_t gpr_register_t;
+#define REGISTER_FORMAT_DEC "%" PRIu64
+#define REGISTER_FORMAT_HEX "%" PRIX64
+#define REGISTER_FORMAT_HEX_PADDED "%016" PRIX64
+
+#define pc_register __rip
+#define flags_register __rflags
+
+#define IF32(X, Y) Y
+
+#else
+#error Unsupported architecture
+#endif
+
+typedef union {
+	_STRUCT_XMM_REG bytes;
+	double doubles[2];
+	float floats[4];
+	uint64_t ints[2];
+} xmm_value_t;
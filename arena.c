@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+
+#include "arena.h"
+#include "dis.h"
+#include "macros.h"
+#include "maps.h"
+#include "watch.h"
+
+#define ARENA_CHUNK_SIZE 0x10000
+#define INT3 0xCC
+
+// Room for an instruction to grow when it is reassembled at another address
+#define ARENA_SLACK 16
+
+typedef struct {
+	mach_vm_address_t start;
+	mach_vm_address_t end;
+	// Code below this address may be the target of a branch and is never reused
+	mach_vm_address_t pin;
+} arena_chunk_t;
+
+static arena_chunk_t *chunks;
+static size_t chunk_count;
+
+static bool fill_int3(task_t task, mach_vm_address_t address, mach_vm_size_t size) {
+	unsigned char *buf = malloc(size);
+	memset(buf, INT3, size);
+	kern_return_t ret = KERN_CALL("mach_vm_write", mach_vm_write(task, address, (vm_offset_t)buf, size));
+	free(buf);
+	dis_invalidate(address, size);
+	watch_touch(address, size);
+	return ret == KERN_SUCCESS;
+}
+
+// Maps a new chunk filled with int3, directly after the last one if possible
+static arena_chunk_t *grow(task_t task, mach_vm_size_t min_size) {
+	mach_vm_size_t size = ARENA_CHUNK_SIZE;
+	while(size < min_size) {
+		size *= 2;
+	}
+
+	mach_vm_address_t address = 0;
+	bool contiguous = false;
+	if(chunk_count > 0) {
+		address = chunks[chunk_count - 1].end;
+		contiguous = KERN_CALL("mach_vm_allocate", mach_vm_allocate(task, &address, size, VM_FLAGS_FIXED)) == KERN_SUCCESS;
+	}
+
+	if(!contiguous) {
+		KERN_TRY("mach_vm_allocate", mach_vm_allocate(task, &address, size, VM_FLAGS_ANYWHERE), {
+			return NULL;
+		});
+	}
+
+	KERN_TRY("mach_vm_protect", mach_vm_protect(task, address, size, false, VM_PROT_ALL), {
+		mach_vm_deallocate(task, address, size);
+		return NULL;
+	});
+
+	if(!fill_int3(task, address, size)) {
+		mach_vm_deallocate(task, address, size);
+		return NULL;
+	}
+
+	maps_note(address, size, "code");
+
+	if(contiguous) {
+		chunks[chunk_count - 1].end += size;
+	} else {
+		chunks = realloc(chunks, (chunk_count + 1) * sizeof(*chunks));
+		chunks[chunk_count++] = (arena_chunk_t){
+			.start = address,
+			.end = address + size,
+			.pin = address,
+		};
+	}
+
+	return &chunks[chunk_count - 1];
+}
+
+mach_vm_address_t arena_init(task_t task) {
+	arena_chunk_t *chunk = grow(task, ARENA_CHUNK_SIZE);
+	if(!chunk) {
+		exit(KERN_FAILURE);
+	}
+
+	return chunk->start;
+}
+
+// Forgets every chunk but the first, which is back to how arena_init left it
+void arena_reset(void) {
+	if(chunk_count > 0) {
+		chunk_count = 1;
+		chunks[0].end = chunks[0].start + ARENA_CHUNK_SIZE;
+		chunks[0].pin = chunks[0].start;
+	}
+	dis_invalidate(0, SIZE_MAX);
+}
+
+static arena_chunk_t *find_chunk(mach_vm_address_t address) {
+	for(size_t i = 0; i < chunk_count; i++) {
+		if(chunks[i].start <= address && address < chunks[i].end) {
+			return &chunks[i];
+		}
+	}
+
+	return NULL;
+}
+
+bool arena_contains(mach_vm_address_t address) {
+	return find_chunk(address) != NULL;
+}
+
+// Returns the address a snippet of len bytes, plus its int3, should be
+// written at. This is pc unless the snippet doesn't fit in the chunk, in
+// which case straight-line code recycles the unpinned part of the chunk and
+// anything else goes to a new chunk.
+mach_vm_address_t arena_reserve(task_t task, mach_vm_address_t pc, size_t len, bool straight_line) {
+	arena_chunk_t *chunk = find_chunk(pc);
+	if(!chunk || pc + len + 1 <= chunk->end) {
+		// Outside of the arena the user is on their own
+		return pc;
+	}
+
+	size_t needed = len + 1 + ARENA_SLACK;
+
+	if(straight_line && chunk->pin < pc && chunk->pin + needed <= chunk->end) {
+		if(fill_int3(task, chunk->pin, chunk->end - chunk->pin)) {
+			return chunk->pin;
+		}
+	}
+
+	size_t chunk_index = chunk - chunks;
+	size_t old_count = chunk_count;
+	mach_vm_address_t old_end = chunks[chunk_count - 1].end;
+
+	if(!grow(task, needed)) {
+		return pc;
+	}
+
+	if(chunk_count == old_count) {
+		// The last chunk was extended in place, if that is the chunk of pc
+		// the snippet can simply continue at pc
+		return chunk_index == chunk_count - 1? pc: old_end;
+	}
+
+	return chunks[chunk_count - 1].start;
+}
+
+// Writes a snippet followed by an int3 with a single write
+void arena_write(task_t task, mach_vm_address_t address, const unsigned char *code, size_t len, bool straight_line) {
+	unsigned char *buf = malloc(len + 1);
+	memcpy(buf, code, len);
+	buf[len] = INT3;
+
+	KERN_FAIL("mach_vm_write", mach_vm_write(task, address, (vm_offset_t)buf, len + 1));
+	free(buf);
+	dis_invalidate(address, len + 1);
+	watch_touch(address, len + 1);
+
+	arena_chunk_t *chunk = find_chunk(address);
+	if(chunk && !straight_line && chunk->pin < address + len + 1) {
+		chunk->pin = address + len + 1;
+	}
+}
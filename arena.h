@@ -0,0 +1,5 @@
+mach_vm_address_t arena_init(task_t task);
+void arena_reset(void);
+bool arena_contains(mach_vm_address_t address);
+mach_vm_address_t arena_reserve(task_t task, mach_vm_address_t pc, size_t len, bool straight_line);
+void arena_write(task_t task, mach_vm_address_t address, const unsigned char *code, size_t len, bool straight_line);
@@ -6,139 +6,73 @@
 #include <sys/param.h>
 #include <mach/mach.h>
 #include <mach/mach_vm.h>
-#include <pthread.h>
-#include <setjmp.h>
 #include <editline/readline.h>
 #include <ctype.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <mach/mach_time.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 
 #include "taskport_auth.h"
 
-#include "assemble.h"
-#include "colors.h"
-#include "utils.h"
-
+#include "arch.h"
+#include "macros.h"
 #include "registers.h"
 #include "float_registers.h"
 #include "status_flags.h"
 
-extern boolean_t mach_exc_server(mach_msg_header_t *InHeadP, mach_msg_header_t *OutHeadP);
-
-typedef union {
-	uint32_t eflags;
-	uint64_t rflags;
-	struct __attribute__((packed)) {
-		uint8_t CF    :1;
-		uint8_t _res1 :1;
-		uint8_t PF    :1;
-		uint8_t _res2 :1;
-		uint8_t AF    :1;
-		uint8_t _res3 :1;
-		uint8_t ZF    :1;
-		uint8_t SF    :1;
-		uint8_t TF    :1;
-		uint8_t IF    :1;
-		uint8_t DF    :1;
-		uint8_t OF    :1;
-		uint8_t IOPL  :2;
-		uint8_t NT    :1;
-		uint8_t _res4 :1;
-
-		uint8_t RF    :1;
-		uint8_t VM    :1;
-		uint8_t AC    :1;
-		uint8_t VIF   :1;
-		uint8_t VIP   :1;
-		uint8_t ID    :1;
-
-		uint16_t _res5 :10;
-
-		uint32_t _res6 :32;
-	};
-} x86_flags_t;
-
-#if defined(__i386__)
-
-#define BITS 32
-#define ARCH_NAME "i386"
-
-#define ts ts32
-#define fs fs32
-
-typedef uint32_t gpr_register_t;
-#define REGISTER_FORMAT_DEC "%" PRIu32
-#define REGISTER_FORMAT_HEX "%" PRIX32
-#define REGISTER_FORMAT_HEX_PADDED "%08" PRIX32
-
-#define pc_register __eip
-#define flags_register __eflags
-
-#define IF32(X, Y) X
-
-#elif defined(__x86_64__)
-
-#define BITS 64
-#define ARCH_NAME "x86_64"
-
-#define ts ts64
-#define fs fs64
-
-typedef uint64_t gpr_register_t;
-#define REGISTER_FORMAT_DEC "%" PRIu64
-#define REGISTER_FORMAT_HEX "%" PRIX64
-#define REGISTER_FORMAT_HEX_PADDED "%016" PRIX64
-
-#define pc_register __rip
-#define flags_register __rflags
-
-#define IF32(X, Y) Y
-
-#else
-#error Unsupported architecture
-#endif
-
-#define ISGRAPH(c) (((unsigned char)c) <= 127 && isgraph(c))
-
-typedef union {
-	_STRUCT_XMM_REG bytes;
-	double doubles[2];
-	float floats[4];
-	uint64_t ints[2];
-} xmm_value_t;
-
-pthread_mutex_t mutex;
-
-#define MEMORY_SIZE 0x10000
-#define INT3 0xCC
-
-#define ELEMENTS(x) (sizeof(x) / sizeof(*x))
-
-#define LIST(x, ...)     x,
-#define STR_LIST(x, ...) #x,
-#define LIST2(x, y, ...) y,
+#include "alloc.h"
+#include "arena.h"
+#include "assemble.h"
+#include "bench.h"
+#include "block.h"
+#include "colors.h"
+#include "daemon.h"
+#include "dis.h"
+#include "event.h"
+#include "expr.h"
+#include "find.h"
+#include "fuzz.h"
+#include "harness.h"
+#include "history.h"
+#include "hwwatch.h"
+#include "maps.h"
+#include "peer.h"
+#include "record.h"
+#include "reset.h"
+#include "state.h"
+#include "stats.h"
+#include "until.h"
+#include "utils.h"
+#include "watch.h"
 
-#define STD_FAIL(s, x) do { \
-	int ret = (x); \
-	if(ret != 0) { \
-		perror(s "()"); \
-		exit(ret); \
-	} \
-} while(false)
+extern boolean_t mach_exc_server(mach_msg_header_t *InHeadP, mach_msg_header_t *OutHeadP);
 
-#define KERN_FAIL(s, x) do { \
-	kern_return_t ret = (x); \
-	if(ret != KERN_SUCCESS) { \
-		printf(s "() failed: %s\n", mach_error_string(ret)); \
-		exit(ret); \
-	} \
-} while(false)
+// Set once the child stops, by the exception handler or an interrupt
+bool child_stopped = false;
 
-#define KERN_TRY(s, x, f) if(true) { \
-	kern_return_t ret = (x); \
-	if(ret != KERN_SUCCESS) { \
-		printf(s "() failed: %s\n", mach_error_string(ret)); \
-		f \
-	} \
-} else do {} while(0)
+typedef enum {
+	STOP_BREAKPOINT,
+	STOP_DEBUG,
+	STOP_INTERRUPT,
+	STOP_CONDITION,
+	STOP_FAULT,
+} stop_reason_t;
+
+// Why the child stopped the last time, set together with child_stopped
+stop_reason_t stop_reason;
+
+// The exception that made the child stop with STOP_FAULT
+struct {
+	exception_type_t exception;
+	mach_exception_data_type_t code;
+	mach_exception_data_type_t subcode;
+	thread_act_t thread;
+} fault;
+
+// While set the child is single stepped and stops once it is true
+expr_t *break_condition;
 
 void get_thread_state(thread_act_t thread, x86_thread_state_t *state) {
 	mach_msg_type_number_t stateCount = x86_THREAD_STATE_COUNT;
@@ -171,9 +105,26 @@ void set_pc(thread_act_t thread, gpr_register_t pc_value) {
 	set_thread_state(thread, &state);
 }
 
-void write_int3(task_t task, mach_vm_address_t address) {
-	unsigned char int3 = INT3;
-	KERN_FAIL("mach_vm_write", mach_vm_write(task, address, (vm_offset_t)&int3, sizeof(int3)));
+// Sets or clears the trap flag so the child traps after every instruction
+void set_single_step(thread_act_t thread, bool enabled) {
+	x86_thread_state_t state;
+	get_thread_state(thread, &state);
+	x86_flags_t *flags = (x86_flags_t *)&state.uts.ts.flags_register;
+	if(flags->TF != enabled) {
+		flags->TF = enabled;
+		set_thread_state(thread, &state);
+	}
+}
+
+// Evaluates the break condition after a single step, runs in the exception
+// handler thread so the child only stops when the condition is true
+bool break_condition_met(task_t task, thread_act_t thread) {
+	x86_thread_state_t state;
+	get_thread_state(thread, &state);
+
+	uint64_t result;
+	// A condition that can't be evaluated stops the child as well
+	return !expr_eval(break_condition, task, &state, &result) || result;
 }
 
 void setup_child(task_t task, thread_act_t *_thread, mach_vm_address_t *_memory) {
@@ -189,26 +140,45 @@ void setup_child(task_t task, thread_act_t *_thread, mach_vm_address_t *_memory)
 	thread_act_t thread = thread_list[0];
 	*_thread = thread;
 
-	mach_vm_address_t memory;
-	KERN_FAIL("mach_vm_allocate", mach_vm_allocate(task, &memory, MEMORY_SIZE, VM_FLAGS_ANYWHERE));
+	// The arena is filled with int3 so the child traps right away
+	mach_vm_address_t memory = arena_init(task);
 	*_memory = memory;
 
-	KERN_FAIL("mach_vm_protect", mach_vm_protect(task, memory, MEMORY_SIZE, 0, VM_PROT_ALL));
+	set_pc(thread, memory);
+}
 
-	write_int3(task, memory);
+// Puts the child back to how it was right after setup_child and forgets
+// everything that referred to its old memory
+bool reset_child(task_t task, thread_act_t thread) {
+	if(!reset_restore(task, thread)) {
+		return false;
+	}
 
-	set_pc(thread, memory);
+	arena_reset();
+	alloc_reset();
+	block_forget_labels();
+	until_clear();
+	watch_clear();
+	hwwatch_clear(thread);
+	harness_reset();
+	expr_free(break_condition);
+	break_condition = NULL;
+	return true;
 }
 
-// Start of the exception handler thread
-void *exception_handler_main(void *arg) {
-	mach_port_t exception_port = (mach_port_t)arg;
-	if(mach_msg_server(mach_exc_server, 2048, exception_port, MACH_MSG_TIMEOUT_NONE) != MACH_MSG_SUCCESS) {
-		puts("error: mach_msg_server()");
+// The exception port has a message, the child waits until it is answered
+void exception_event(void *context, intptr_t data) {
+	mach_port_t exception_port = (mach_port_t)(uintptr_t)context;
+	if(mach_msg_server_once(mach_exc_server, 2048, exception_port, MACH_MSG_TIMEOUT_NONE) != MACH_MSG_SUCCESS) {
+		puts("error: mach_msg_server_once()");
 		exit(1);
 	}
+}
 
-	return NULL;
+// Handles events until the child stops
+void wait_for_stop(void) {
+	event_run_until(&child_stopped);
+	child_stopped = false;
 }
 
 kern_return_t  catch_mach_exception_raise_state(mach_port_t __unused exception_port, exception_type_t __unused exception, exception_data_t __unused code, mach_msg_type_number_t __unused code_count, int * __unused flavor, thread_state_t __unused in_state, mach_msg_type_number_t __unused in_state_count, thread_state_t __unused out_state, mach_msg_type_number_t * __unused out_state_count) {
@@ -220,11 +190,47 @@ kern_return_t  catch_mach_exception_raise_state_identity(mach_port_t __unused ex
 }
 
 // Called when an exception is caught from the child, e.g. SIGTRAP
-kern_return_t catch_mach_exception_raise(mach_port_t __unused exception_port, mach_port_t thread, mach_port_t __unused task, exception_type_t exception, exception_data_t __unused code, mach_msg_type_number_t __unused code_count) {
-	if(exception == EXC_BREAKPOINT) {
+kern_return_t catch_mach_exception_raise(mach_port_t __unused exception_port, mach_port_t thread, mach_port_t __unused task, exception_type_t exception, mach_exception_data_t code, mach_msg_type_number_t code_count) {
+	if(exception == EXC_BAD_ACCESS && code_count >= 2 && watch_fault(task, code[1])) {
+		// A write to a watched page, the instruction is retried when we return
+		return KERN_SUCCESS;
+	} else if(exception == EXC_BREAKPOINT) {
+		KERN_FAIL("task_suspend", task_suspend(task));
+		if(code_count >= 1 && code[0] == EXC_I386_SGL) {
+			// Debug exception from a hardware watchpoint or a single step, pc
+			// is already correct
+			bool watched = hwwatch_triggered(thread);
+			// Stepped past an execute watchpoint, which is armed again
+			if(hwwatch_stepped(thread) && !watched && !break_condition) {
+				set_single_step(thread, false);
+				KERN_FAIL("task_resume", task_resume(task));
+				return KERN_SUCCESS;
+			}
+
+			if(break_condition && !watched) {
+				if(!break_condition_met(task, thread)) {
+					KERN_FAIL("task_resume", task_resume(task));
+					return KERN_SUCCESS;
+				}
+				stop_reason = STOP_CONDITION;
+			} else {
+				stop_reason = STOP_DEBUG;
+			}
+		} else {
+			set_pc(thread, get_pc(thread) - 1);
+			stop_reason = STOP_BREAKPOINT;
+		}
+		child_stopped = true;
+		return KERN_SUCCESS;
+	} else if(exception == EXC_BAD_ACCESS || exception == EXC_BAD_INSTRUCTION || exception == EXC_ARITHMETIC) {
+		// The child stays at the faulting instruction until the step is undone
 		KERN_FAIL("task_suspend", task_suspend(task));
-		set_pc(thread, get_pc(thread) - 1);
-		pthread_mutex_unlock(&mutex);
+		fault.exception = exception;
+		fault.code = code_count >= 1? code[0]: 0;
+		fault.subcode = code_count >= 2? code[1]: 0;
+		fault.thread = thread;
+		stop_reason = STOP_FAULT;
+		child_stopped = true;
 		return KERN_SUCCESS;
 	} else {
 		return KERN_FAILURE;
@@ -235,10 +241,11 @@ void setup_exception_handler(task_t task) {
 	mach_port_t exception_port;
 	KERN_FAIL("mach_port_allocate", mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &exception_port));
 	KERN_FAIL("mach_port_insert_right", mach_port_insert_right(mach_task_self(), exception_port, exception_port, MACH_MSG_TYPE_MAKE_SEND));
-	KERN_FAIL("task_set_exception_port", task_set_exception_ports(task, EXC_MASK_BREAKPOINT, exception_port, (exception_behavior_t)(EXCEPTION_DEFAULT | MACH_EXCEPTION_CODES), MACHINE_THREAD_STATE));
+	KERN_FAIL("task_set_exception_port", task_set_exception_ports(task, EXC_MASK_BREAKPOINT | EXC_MASK_BAD_ACCESS | EXC_MASK_BAD_INSTRUCTION | EXC_MASK_ARITHMETIC, exception_port, (exception_behavior_t)(EXCEPTION_DEFAULT | MACH_EXCEPTION_CODES), MACHINE_THREAD_STATE));
 
-	pthread_t exception_handler_thread;
-	STD_FAIL("pthread_create", pthread_create(&exception_handler_thread, NULL, exception_handler_main, (void *)(uintptr_t)exception_port));
+	if(!event_watch_port(exception_port, exception_event, (void *)(uintptr_t)exception_port)) {
+		exit(1);
+	}
 }
 
 #define FOREACH_TYPE(X) \
@@ -355,18 +362,85 @@ bool get_number(char *str, gpr_register_t *val) {
 	return *endptr == '\0';
 }
 
-bool get_value(char *str, x86_thread_state_t *state, gpr_register_t *val) {
+// Evaluates a number or an expression of registers, $names and memory
+bool get_value(task_t task, char *str, x86_thread_state_t *state, gpr_register_t *val) {
 	if(get_number(str, val)) {
 		return true;
 	}
 
-	gpr_register_t *gpr = get_gpr_pointer(str, state);
-	if(gpr) {
-		*val = *gpr;
-		return true;
+	const char *error;
+	expr_t *expr = expr_compile(str, &error);
+	if(!expr) {
+		printf("Invalid expression: %s\n", error);
+		return false;
 	}
 
-	return false;
+	uint64_t result;
+	bool valid = expr_eval(expr, task, state, &result);
+	expr_free(expr);
+
+	if(!valid) {
+		puts("Failed to evaluate expression (invalid memory access or division by zero).");
+		return false;
+	}
+
+	*val = result;
+	return true;
+}
+
+// Undoes the splitting of the arguments from start to the end of the line
+char *rejoin_args(char *start, char *line_end) {
+	for(char *c = start; c < line_end; c++) {
+		if(*c == '\0') {
+			*c = ' ';
+		}
+	}
+
+	return start;
+}
+
+// Parses a search pattern: "string", 0x-prefixed pointer-sized value or hexpairs
+// Returns the rest of the string after the pattern or NULL if it is invalid
+char *parse_pattern(char *str, unsigned char **pattern, size_t *pattern_len) {
+	char *rest;
+	if(str[0] == '"') {
+		char *end = strrchr(str + 1, '"');
+		if(!end || end == str + 1) {
+			return NULL;
+		}
+
+		*pattern_len = end - (str + 1);
+		*pattern = malloc(*pattern_len);
+		memcpy(*pattern, str + 1, *pattern_len);
+
+		rest = end + 1;
+	} else {
+		rest = str;
+		char *token = strsep(&rest, " ");
+
+		gpr_register_t value;
+		if(strncmp(token, "0x", 2) == 0 && get_number(token, &value)) {
+			*pattern_len = sizeof(value);
+			*pattern = malloc(*pattern_len);
+			memcpy(*pattern, &value, *pattern_len);
+		} else {
+			*pattern = hex2bytes(token, pattern_len, false);
+			if(!*pattern || *pattern_len == 0) {
+				free(*pattern);
+				return NULL;
+			}
+		}
+
+		if(!rest) {
+			rest = token + strlen(token);
+		}
+	}
+
+	while(*rest == ' ') {
+		rest++;
+	}
+
+	return rest;
 }
 
 size_t count_tokens(char *str, char *seperators) {
@@ -381,180 +455,1251 @@ size_t count_tokens(char *str, char *seperators) {
 
 char *histfile;
 bool waiting_for_input = false;
-jmp_buf prompt_jmp_buf;
 
 int syntax_type = 0; // 0 = intel, 1 = at&t
 
-void read_input(task_t task, thread_act_t thread, x86_thread_state_t *state, x86_float_state_t *float_state) {
-	static char *line = NULL;
-	while(true) {
-		if(line) {
-			free(line);
-		}
+// Lines of a script given with -c, used instead of the prompt
+bool one_shot = false;
+char *script = NULL;
 
-		waiting_for_input = true;
-		setjmp(prompt_jmp_buf);
+// Set by --record and --replay
+bool recording = false;
+bool replaying = false;
 
-		line = readline("> ");
+void setup_readline(void);
 
-		waiting_for_input = false;
+// The prompt that is shown and the line that was entered at it
+const char *line_prompt;
+char *entered_line;
+bool line_entered = false;
 
-		if(!line) {
-			exit(0);
-		}
+// Called by editline once a line is complete, with NULL at the end of input
+void line_handler(char *line) {
+	rl_callback_handler_remove();
+	entered_line = line;
+	line_entered = true;
+}
 
-		if(line[0] == '\0') {
-			continue;
-		}
+void stdin_event(void *context, intptr_t data) {
+	rl_callback_read_char();
+}
 
-		add_history(line);
-		write_history(histfile);
+// Shows the prompt again with an empty line, e.g. after ^C
+void restart_line(void) {
+	rl_callback_handler_remove();
+	rl_callback_handler_install(line_prompt, line_handler);
+}
 
-#define FOREACH_CMD(X) \
-	X(set) \
-	X(read) \
-	X(write) \
-	X(writestr) \
-	X(alloc) \
-	X(regs) \
-	X(show) \
-	X(syntax)
-		typedef enum {
-			FOREACH_CMD(LIST)
-		} cmds;
-		static char *cmd_names[] = {
-			FOREACH_CMD(STR_LIST)
-		};
+// readline that keeps handling events while the line is typed
+char *event_readline(const char *str) {
+	line_prompt = str;
+	line_entered = false;
+	rl_callback_handler_install(str, line_handler);
+	if(!event_watch_fd(STDIN_FILENO, stdin_event, NULL)) {
+		exit(1);
+	}
 
-		static char *help[] = {
-			"Usage: .set register value\n"
-			"Changes the value of a register\n"
-			"\n"
-			"  register - register name (GPR, FPR or status)\n"
-			"  value    - hex if GPR or FPR, 0 or 1 if status",
+	event_run_until(&line_entered);
+	event_unwatch_fd(STDIN_FILENO);
+	return entered_line;
+}
 
-			"Usage: .read address [len]\n"
-			"Displays a hexdump of memory starting at address\n"
-			"\n"
-			"  address - an integer or a register name\n"
-			"  len     - the amount of bytes to read",
+char *read_line(const char *str) {
+	if(one_shot) {
+		char *line = strsep(&script, "\n");
+		return line? strdup(line): NULL;
+	}
 
-			"Usage: .write address hexpairs\n"
-			"Writes hexpairs to a destination address\n"
-			"\n"
-			"  address  - an integer or a register name\n"
-			"  hexpairs - pairs of hexadecimal numbers",
+	// History and readline are only set up once they are needed
+	static bool readline_ready = false;
+	if(!readline_ready) {
+		setup_readline();
+		readline_ready = true;
+	}
 
-			"Usage: .writestr address string\n"
-			"Writes an ascii string to a destination address\n"
-			"\n"
-			"  address - an integer or a register name\n"
-			"  string  - an ascii string",
+	char *line = event_readline(str);
+	if(line && line[0] != '\0') {
+		add_history(line);
+		history_append(line);
+	}
+	return line;
+}
 
-			"Usage: .alloc len\n"
-			"Allocates some memory and returns the address\n"
-			"\n"
-			"  len - the amount of bytes to allocate",
+char *prompt(const char *str) {
+	if(replaying) {
+		return replay_line();
+	}
 
-			"Usage: .regs\n"
-			"Displays the values of the registers currently toggled on",
+	char *line = read_line(str);
+	if(recording && line) {
+		record_line(line);
+	}
+	return line;
+}
 
-			"Usage: .show [gpr|status|fpr_hex|fpr_double]\n"
-			"Toggles which types of registers are shown\n"
-			"\n"
-			"  gpr        - General purpose registers (rax, rsp, rip, ...)\n"
-			"  status     - Status registers (CF, ZF, ...)\n"
-			"  fpr_hex    - Floating point registers shown in hex (xmm0, xmm1, ...)\n"
-			"  fpr_double - Floating point registers shown as doubles",
+// Whether more input is already waiting, e.g. the rest of a paste
+bool input_pending(void) {
+	if(replaying) {
+		return replay_pending();
+	}
+	if(one_shot) {
+		return false;
+	}
 
-			"Usage: .syntax [att|intel]\n"
-			"Changes the assembly syntax to intel or at&t\n"
-		};
+	struct pollfd fd = {
+		.fd = STDIN_FILENO,
+		.events = POLLIN,
+	};
+	bool pending = poll(&fd, 1, 0) > 0;
+	if(recording && pending) {
+		record_pending();
+	}
+	return pending;
+}
 
-		ssize_t cmd = -1;
-		if(line[0] == '?' || line[0] == '.') {
-			for(size_t i = 0; i != ELEMENTS(cmd_names); i++) {
-				size_t len = strlen(cmd_names[i]);
-				if(strncmp(cmd_names[i], line + 1, len) == 0 && (line[len + 1] == '\0' || line[len + 1] == ' ')) {
-					cmd = i;
-					break;
-				}
-			}
+// Joins lines into one snippet. With a terminator lines are read until it is
+// entered, otherwise for as long as input is pending.
+char *read_block(char *block, const char *terminator) {
+	size_t len = block? strlen(block): 0;
+
+	while(terminator || input_pending()) {
+		waiting_for_input = true;
+		char *line = prompt("... ");
+		waiting_for_input = false;
+
+		if(!line || (terminator && strcmp(line, terminator) == 0)) {
+			free(line);
+			break;
 		}
 
-		if(line[0] == '?') {
-			if(cmd != -1) {
-				puts(help[cmd]);
-				continue;
+		size_t line_len = strlen(line);
+		if(line_len != 0) {
+			block = realloc(block, len + line_len + 3);
+			if(len != 0) {
+				memcpy(block + len, "; ", 2);
+				len += 2;
 			}
+			memcpy(block + len, line, line_len + 1);
+			len += line_len;
+		}
+		free(line);
+	}
 
-			puts("Valid input:\n"
-			       "  Help:\n"
-			       "    ?      - show this help\n"
-				   "    ?[cmd] - show help for a command\n"
-				   "\n"
-				   "  Commands:\n"
-				   "    .set      - change value of register\n"
-				   "    .read     - read from memory\n"
-				   "    .write    - write hex to memory\n"
-				   "    .writestr - write string to memory\n"
-				   "    .alloc    - allocate memory\n"
-				   "    .regs     - show the contents of the registers\n"
-				   "    .show     - toggle shown register types\n"
-				   "    .syntax   - change the assembly syntax to intel or at&t\n"
-				   "\n"
-				   "Any other input will be interpreted as " ARCH_NAME " assembly"
-			);
-		} else if(line[0] == '.') {
-			size_t args = count_tokens(line, " ") - 1;
+	return block;
+}
 
-			char *p = line + 1;
-			char *cmd_name = strsep(&p, " ");
-			char *arg1 = strsep(&p, " ");
-			char *arg2 = strsep(&p, " ");
+// Assembles a snippet at pc, or elsewhere in the arena if it doesn't fit, and
+// writes it to the child. Returns whether the child can be resumed.
+bool write_snippet(task_t task, thread_act_t thread, x86_thread_state_t *state, char *line) {
+	unsigned char *assembly;
+	size_t asm_len;
+	mach_vm_address_t pc = state->uts.ts.pc_register;
+	char *code = alloc_substitute(line, syntax_type);
+	bool instrumented = until_instrument(&code, syntax_type);
+	uint64_t start = stats_now();
+	if(!block_assemble(code, BITS, pc, &assembly, &asm_len, syntax_type)) {
+		puts("Failed to assemble instruction.");
+		free(code);
+		return false;
+	}
 
-			switch(cmd) {
-				case set: {
-					if(args != 2) {
-						puts(help[cmd]);
-						continue;
-					}
+	start = stats_add(PHASE_assemble, start);
+
+	bool straight_line = is_straight_line(code);
+
+	// Move to another part of the arena if the snippet doesn't fit at pc. At
+	// the new address it may assemble longer, e.g. a rel8 branch that needs a
+	// rel32, so it is placed again until it fits where it was assembled.
+	mach_vm_address_t address = pc;
+	mach_vm_address_t placed;
+	while((placed = arena_reserve(task, address, asm_len, straight_line)) != address) {
+		address = placed;
+		free(assembly);
+		start = stats_now();
+		if(!block_assemble(code, BITS, address, &assembly, &asm_len, syntax_type)) {
+			puts("Failed to assemble instruction.");
+			free(code);
+			return false;
+		}
+		start = stats_add(PHASE_assemble, start);
+	}
 
-					size_t len = strlen(arg2);
-					if(len == 1) {
-						char c = arg2[0];
-						if(c == '0' || c == '1') {
-							x86_flags_t *flags = (x86_flags_t *)&state->uts.ts.flags_register;
-							bool matched = false;
-#define X(f) do { \
-	if(strcmp(arg1, #f) == 0) { \
-		flags->f = c - '0'; \
-		matched = true; \
-	} \
-} while(false)
-	FOREACH_STATUS_FLAG(X)
-#undef X
+	if(address != pc) {
+		state->uts.ts.pc_register = address;
+		set_thread_state(thread, state);
+	}
 
-							if(matched) {
-								continue;
-							}
-						}
-					}
+	arena_write(task, address, assembly, asm_len, straight_line);
+	stats_add(PHASE_write, start);
+	block_commit_labels();
+	if(instrumented) {
+		until_placed(address, address + asm_len);
+	}
+	// A snippet that branches may reach system calls in earlier code
+	if(!straight_line || maps_may_change(assembly, asm_len)) {
+		watch_compare_next();
+		maps_invalidate();
+	}
+	free(assembly);
+	free(code);
+	return true;
+}
 
-					size_t size;
-					unsigned char *data = hex2bytes(arg2, &size, true);
-					if(!data) {
-						puts(help[cmd]);
-						continue;
-					}
+// Explains why the child faulted, with the faulting instruction
+void report_fault(task_t task, mach_vm_address_t pc) {
+	printf(KRED);
+	if(fault.exception == EXC_BAD_ACCESS && fault.code == EXC_I386_GPFLT) {
+		printf("General protection fault");
+	} else if(fault.exception == EXC_BAD_ACCESS) {
+		printf("Bad access to 0x%llx (%s)", (mach_vm_address_t)fault.subcode, mach_error_string(fault.code));
+	} else if(fault.exception == EXC_BAD_INSTRUCTION) {
+		printf("Invalid instruction");
+	} else if(fault.code == EXC_I386_DIV) {
+		printf("Division error");
+	} else if(fault.code == EXC_I386_INTO) {
+		printf("Overflow");
+	} else if(fault.code == EXC_I386_EXTERR) {
+		printf("x87 floating point error");
+	} else if(fault.code == EXC_I386_SSEEXTERR) {
+		printf("SSE floating point error");
+	} else {
+		printf("Arithmetic exception %lld", (long long)fault.code);
+	}
+	printf(RESET " at 0x%llx", pc);
 
-					size_t expected_size;
-					gpr_register_t *gpr = get_gpr_pointer(arg1, state);
-					xmm_value_t *xmm;
-					if(gpr) {
-						expected_size = sizeof(*gpr);
-					} else {
-						xmm = get_fpr_pointer(arg1, float_state);
+	char insn[128];
+	if(dis_describe(task, pc, syntax_type, insn, sizeof(insn))) {
+		printf(": %s", insn);
+	}
+	puts("");
+}
+
+// Runs the armed lanes of the harness with a single resume, lane 0 on thread
+// and the others on threads of their own, and puts the registers back
+// afterwards. A vector that faults ends its lane early, unless keep_going is
+// set: then the fault is recorded for the vector and its lane moves on to the
+// next one. Returns whether every lane ran all its vectors.
+bool run_harness(task_t task, thread_act_t thread, const mach_vm_address_t *entries, size_t lanes, bool keep_going) {
+	x86_thread_state_t saved;
+	x86_float_state_t saved_float;
+	get_thread_state(thread, &saved);
+	get_float_state(thread, &saved_float);
+
+	// The threads start suspended and run once the child is resumed
+	thread_act_t threads[HARNESS_MAX_LANES] = {thread};
+	x86_thread_state_t state = saved;
+	((x86_flags_t *)&state.uts.ts.flags_register)->TF = false;
+	for(size_t lane = 0; lane < lanes; lane++) {
+		state.uts.ts.pc_register = entries[lane];
+		if(lane == 0) {
+			set_thread_state(thread, &state);
+			continue;
+		}
+		KERN_FAIL("thread_create", thread_create(task, &threads[lane]));
+		set_thread_state(threads[lane], &state);
+		KERN_FAIL("thread_resume", thread_resume(threads[lane]));
+	}
+
+	bool ok = true;
+	bool thread_suspended = false;
+	uint64_t start = stats_now();
+	while(true) {
+		KERN_FAIL("task_resume", task_resume(task));
+		wait_for_stop();
+		if(stop_reason != STOP_FAULT) {
+			break;
+		}
+
+		size_t lane = 0;
+		while(lane < lanes - 1 && threads[lane] != fault.thread) {
+			lane++;
+		}
+		if(keep_going) {
+			mach_vm_address_t resume;
+			if(harness_skip(lane, fault.exception, &resume)) {
+				set_pc(fault.thread, resume);
+				continue;
+			}
+		} else {
+			report_fault(task, get_pc(fault.thread));
+			printf("Vector %zu faulted.\n", harness_next(lane));
+			ok = false;
+		}
+
+		// The other lanes keep going, the last one to finish stops the child
+		if(harness_abandon(lane)) {
+			break;
+		}
+		KERN_FAIL("thread_suspend", thread_suspend(fault.thread));
+		thread_suspended |= fault.thread == thread;
+	}
+	stats_add(PHASE_run, start);
+	// The lanes ran without the pages being write-protected
+	watch_touch_all();
+
+	for(size_t lane = 0; lane < lanes; lane++) {
+		if(ok && !harness_finished(lane)) {
+			printf("Stopped at vector %zu.\n", harness_next(lane));
+			ok = false;
+		}
+		if(lane != 0) {
+			KERN_CALL("thread_terminate", thread_terminate(threads[lane]));
+			mach_port_deallocate(mach_task_self(), threads[lane]);
+		}
+	}
+
+	if(thread_suspended) {
+		KERN_FAIL("thread_resume", thread_resume(thread));
+	}
+	set_thread_state(thread, &saved);
+	set_float_state(thread, &saved_float);
+	return ok;
+}
+
+#define MAX_BATCH_VECTORS 0x100000
+
+// Runs a snippet over the vectors of "reg=value,value,... -- snippet".
+// Vector i takes the ith value of every list, a single value is used for
+// every vector and the other registers come from the current state.
+bool run_batch(task_t task, thread_act_t thread, x86_thread_state_t *state, char *str) {
+	char *code = strstr(str, "--");
+	if(!code) {
+		return false;
+	}
+	*code = '\0';
+	code += 2;
+	while(*code == ' ') {
+		code++;
+	}
+
+	int columns[HARNESS_WORDS];
+	gpr_register_t *values[HARNESS_WORDS];
+	size_t value_counts[HARNESS_WORDS];
+	size_t column_count = 0;
+	size_t count = 1;
+
+	bool valid = code[0] != '\0';
+	for(char *assignment; valid && (assignment = strsep(&str, " "));) {
+		if(assignment[0] == '\0') {
+			continue;
+		}
+
+		char *name = strsep(&assignment, "=");
+		int index = harness_register_index(name);
+		if(!assignment || index == -1 || column_count == HARNESS_WORDS) {
+			valid = false;
+			break;
+		}
+
+		size_t n = count_tokens(assignment, ",");
+		values[column_count] = malloc(n * sizeof(gpr_register_t));
+		columns[column_count] = index;
+		value_counts[column_count] = n;
+		column_count++;
+
+		for(size_t i = 0; valid && i < n; i++) {
+			valid = get_value(task, strsep(&assignment, ","), state, &values[column_count - 1][i]);
+		}
+
+		if(n != 1 && count != 1 && n != count) {
+			puts("Every list must have the same length.");
+			valid = false;
+		} else if(n != 1) {
+			count = n;
+		}
+	}
+
+	if(valid && count > MAX_BATCH_VECTORS) {
+		printf("At most %d vectors are run at once.\n", MAX_BATCH_VECTORS);
+		valid = false;
+	}
+
+	bool prepared = false;
+	if(valid) {
+		char *snippet = alloc_substitute(code, syntax_type);
+		prepared = harness_prepare(task, snippet, syntax_type, count, 1, 0);
+		free(snippet);
+	}
+
+	if(prepared) {
+		harness_vector_t *inputs = harness_inputs();
+		for(size_t i = 0; i < count; i++) {
+			harness_vector_from_state(state, 0, &inputs[i]);
+			for(size_t c = 0; c < column_count; c++) {
+				inputs[i].words[columns[c]] = values[c][value_counts[c] == 1? 0: i];
+			}
+			// A trap flag would stop the child after every instruction
+			inputs[i].words[HARNESS_FLAGS] &= ~(gpr_register_t)0x100;
+		}
+
+		mach_vm_address_t entry;
+		harness_arm(0, count, 1, 0, &entry);
+		run_harness(task, thread, &entry, 1, false);
+		harness_print_table(harness_next(0), columns, column_count);
+	}
+
+	for(size_t c = 0; c < column_count; c++) {
+		free(values[c]);
+	}
+
+	// A snippet that failed to assemble already said so
+	return valid;
+}
+
+#define MAX_TABLE_VECTORS 4096
+#define SWEEP_CHUNK_VECTORS 0x4000
+
+// A swept register, its values are lo, lo + step, ... up to hi
+typedef struct {
+	int index;
+	gpr_register_t lo;
+	gpr_register_t step;
+	// The number of values minus one, so a full range fits
+	gpr_register_t span;
+	gpr_register_t next;
+} sweep_range_t;
+
+// Parses lo..hi[:step]
+bool parse_range(task_t task, char *str, x86_thread_state_t *state, sweep_range_t *range) {
+	char *hi = strstr(str, "..");
+	if(!hi) {
+		return false;
+	}
+	*hi = '\0';
+	hi += 2;
+	char *step = hi;
+	strsep(&step, ":");
+
+	gpr_register_t hi_value;
+	range->step = 1;
+	if(!get_value(task, str, state, &range->lo) || !get_value(task, hi, state, &hi_value) || (step && !get_value(task, step, state, &range->step))) {
+		return false;
+	}
+	if(range->step == 0 || hi_value < range->lo) {
+		puts("A range needs lo <= hi and a step above 0.");
+		return false;
+	}
+
+	range->span = (hi_value - range->lo) / range->step;
+	range->next = 0;
+	return true;
+}
+
+// Runs a snippet over a grid or a random sample of the ranges of
+// "[threads=n] [random=n] [csv=file|bin=file] reg=lo..hi[:step] ... -- snippet"
+// and prints the outputs or writes them to a file
+bool run_sweep(task_t task, thread_act_t thread, x86_thread_state_t *state, char *str) {
+	char *code = strstr(str, "--");
+	if(!code) {
+		return false;
+	}
+	*code = '\0';
+	code += 2;
+	while(*code == ' ') {
+		code++;
+	}
+
+	sweep_range_t ranges[HARNESS_WORDS];
+	int columns[HARNESS_WORDS];
+	size_t range_count = 0;
+	long lanes = MIN(sysconf(_SC_NPROCESSORS_ONLN), HARNESS_MAX_LANES);
+	gpr_register_t samples = 0;
+	char *path = NULL;
+	bool binary = false;
+
+	bool valid = code[0] != '\0';
+	for(char *option; valid && (option = strsep(&str, " "));) {
+		if(option[0] == '\0') {
+			continue;
+		}
+
+		char *name = strsep(&option, "=");
+		int index = harness_register_index(name);
+		if(!option) {
+			valid = false;
+		} else if(strcmp(name, "threads") == 0) {
+			lanes = strtol(option, NULL, 0);
+		} else if(strcmp(name, "random") == 0) {
+			valid = get_value(task, option, state, &samples) && samples != 0;
+		} else if(strcmp(name, "csv") == 0 || strcmp(name, "bin") == 0) {
+			path = option;
+			binary = name[0] == 'b';
+		} else if(index != -1 && range_count < HARNESS_WORDS) {
+			ranges[range_count].index = index;
+			columns[range_count] = index;
+			valid = parse_range(task, option, state, &ranges[range_count++]);
+		} else {
+			valid = false;
+		}
+	}
+
+	if(!valid || range_count == 0) {
+		return false;
+	}
+	if(lanes < 1 || lanes > HARNESS_MAX_LANES) {
+		printf("Use 1 to %d threads.\n", HARNESS_MAX_LANES);
+		return true;
+	}
+
+	// Every combination of the ranges, unless it is sampled
+	uint64_t total = samples;
+	if(!samples) {
+		total = 1;
+		for(size_t r = 0; r < range_count; r++) {
+			uint64_t values = (uint64_t)ranges[r].span + 1;
+			if(values == 0 || total > UINT64_MAX / values) {
+				puts("The grid is too large, sample it with random=n.");
+				return true;
+			}
+			total *= values;
+		}
+	}
+
+	if(!path && total > MAX_TABLE_VECTORS) {
+		printf("Write more than %d vectors to a file with csv= or bin=.\n", MAX_TABLE_VECTORS);
+		return true;
+	}
+
+	FILE *file = NULL;
+	if(path) {
+		file = fopen(path, binary? "wb": "w");
+		if(!file) {
+			perror("fopen");
+			return true;
+		}
+		harness_write_header(file, binary, columns, range_count);
+	}
+
+	size_t chunk = MIN(total, SWEEP_CHUNK_VECTORS * (uint64_t)lanes);
+	char *snippet = alloc_substitute(code, syntax_type);
+	bool ok = harness_prepare(task, snippet, syntax_type, chunk, lanes, 0);
+	free(snippet);
+
+	uint64_t start = bench_now();
+	uint64_t done = 0;
+	harness_vector_t *inputs = harness_inputs();
+	while(ok && done < total) {
+		size_t count = MIN(total - done, chunk);
+		for(size_t i = 0; i < count; i++) {
+			// Every lane has a stack of its own, the split is the same as
+			// harness_arm's
+			harness_vector_from_state(state, i / ((count + lanes - 1) / lanes), &inputs[i]);
+			for(size_t r = 0; r < range_count; r++) {
+				sweep_range_t *range = &ranges[r];
+				gpr_register_t offset = range->next;
+				if(samples) {
+					uint64_t sample;
+					arc4random_buf(&sample, sizeof(sample));
+					offset = range->span == (gpr_register_t)-1? sample: sample % ((uint64_t)range->span + 1);
+				}
+				inputs[i].words[range->index] = range->lo + offset * range->step;
+			}
+			// A trap flag would stop the child after every instruction
+			inputs[i].words[HARNESS_FLAGS] &= ~(gpr_register_t)0x100;
+
+			// The last register changes fastest
+			for(ssize_t r = range_count - 1; !samples && r >= 0; r--) {
+				if(ranges[r].next++ != ranges[r].span) {
+					break;
+				}
+				ranges[r].next = 0;
+			}
+		}
+
+		mach_vm_address_t entries[HARNESS_MAX_LANES];
+		size_t used = harness_arm(0, count, lanes, 0, entries);
+		ok = run_harness(task, thread, entries, used, true);
+		if(!ok) {
+			break;
+		}
+
+		if(file && !harness_write_rows(file, binary, 0, count, columns, range_count)) {
+			perror("fwrite");
+			ok = false;
+		} else if(!file) {
+			harness_print_table(count, columns, range_count);
+		}
+		done += count;
+	}
+
+	if(file) {
+		fclose(file);
+		double seconds = (bench_now() - start) / 1e9;
+		printf("Wrote %llu of %llu vectors to %s in %.2f s (%.0f vectors/s)\n", (unsigned long long)done, (unsigned long long)total, path, seconds, done / seconds);
+	}
+	return true;
+}
+
+#define EQUIV_VECTORS 0x100000
+#define MAX_EQUIV_MEMORY 0x1000
+
+// The status flags that are compared unless others are given
+#define EQUIV_FLAGS 0xCD5
+
+// Values at the edges of signed and unsigned arithmetic, cut to the word
+// size in 32 bit
+static const uint64_t edge_values[] = {
+	0, 1, 2, 0x7F, 0x80, 0xFF, 0x100, 0x7FFF, 0x8000, 0xFFFF, 0x10000,
+	0x7FFFFFFF, 0x80000000, 0xFFFFFFFF, 0x100000000ULL,
+	0x7FFFFFFFFFFFFFFFULL, 0x8000000000000000ULL, 0xFFFFFFFFFFFFFFFEULL, 0xFFFFFFFFFFFFFFFFULL,
+};
+
+// What .equiv compares and where the memory of every vector is
+typedef struct {
+	bool live[HARNESS_WORDS];
+	gpr_register_t flags;
+	int memory_register;
+	size_t memory_size;
+	size_t slot;
+	unsigned char *memory;
+	mach_vm_address_t memory_address;
+} equiv_t;
+
+// A random input, a quarter of them are edge cases
+gpr_register_t equiv_value(void) {
+	if(arc4random_uniform(4) == 0) {
+		return edge_values[arc4random_uniform(ELEMENTS(edge_values))];
+	}
+
+	uint64_t value;
+	arc4random_buf(&value, sizeof(value));
+	return value;
+}
+
+// Sets a live-out register or flag from its name
+bool equiv_live(equiv_t *equiv, const char *name) {
+	int index = harness_register_index(name);
+	if(index == HARNESS_FLAGS) {
+		equiv->flags |= EQUIV_FLAGS;
+		return true;
+	} else if(index != -1) {
+		equiv->live[index] = true;
+		return true;
+	}
+
+#define X(f) do { \
+	if(strcasecmp(name, #f) == 0) { \
+		x86_flags_t flags = {0}; \
+		flags.f = 1; \
+		equiv->flags |= flags.rflags; \
+		return true; \
+	} \
+} while(false)
+	FOREACH_STATUS_FLAG(X)
+#undef X
+
+	return false;
+}
+
+// The first snippet runs as program 0 of the harness and the second as
+// program 1, so both are assembled only once
+bool equiv_prepare(task_t task, char *code, size_t count, size_t lanes, int program) {
+	char *snippet = alloc_substitute(code, syntax_type);
+	bool ok = harness_prepare(task, snippet, syntax_type, count, lanes, program);
+	free(snippet);
+	return ok;
+}
+
+// Runs a program over the count vectors in the harness, on as many lanes.
+// Vectors that fault are recorded and compared like outputs.
+bool equiv_run(task_t task, thread_act_t thread, int program, size_t count, size_t lanes) {
+	mach_vm_address_t entries[HARNESS_MAX_LANES];
+	size_t used = harness_arm(0, count, lanes, program, entries);
+	return run_harness(task, thread, entries, used, true);
+}
+
+// Shows the inputs of a vector and which snippet faulted on it, or every
+// live-out that differs between the outputs of the two snippets
+void equiv_report(const equiv_t *equiv, size_t index, const harness_vector_t *input, const harness_vector_t *first, const harness_vector_t *second, exception_type_t first_fault, exception_type_t second_fault, const unsigned char *first_memory, const unsigned char *second_memory) {
+	printf(KRED "The snippets differ" RESET " for vector %zu with the inputs\n", index);
+	int shown = 0;
+	for(int r = HARNESS_WORDS - 1; r >= 0; r--) {
+		const char *name = harness_register_name(r);
+		if(name && r != HARNESS_SP) {
+			printf("  %6s: 0x" REGISTER_FORMAT_HEX_PADDED "%s", name, input->words[r], ++shown % 4 == 0? "\n": "");
+		}
+	}
+	if(shown % 4 != 0) {
+		puts("");
+	}
+
+	if(first_fault != second_fault) {
+		printf("%8s: %s vs %s\n", "fault", first_fault? harness_fault_name(first_fault): "none", second_fault? harness_fault_name(second_fault): "none");
+		return;
+	}
+
+	for(int r = HARNESS_WORDS - 1; r >= 0; r--) {
+		if(equiv->live[r] && first->words[r] != second->words[r]) {
+			printf("%8s: 0x" REGISTER_FORMAT_HEX_PADDED " vs 0x" REGISTER_FORMAT_HEX_PADDED "\n", harness_register_name(r), first->words[r], second->words[r]);
+		}
+	}
+
+	x86_flags_t first_flags = {.rflags = first->words[HARNESS_FLAGS]};
+	x86_flags_t second_flags = {.rflags = second->words[HARNESS_FLAGS]};
+	x86_flags_t live_flags = {.rflags = equiv->flags};
+#define X(f) do { \
+	if(live_flags.f && first_flags.f != second_flags.f) { \
+		printf("%8s: %d vs %d\n", #f, first_flags.f, second_flags.f); \
+	} \
+} while(false)
+	FOREACH_STATUS_FLAG(X)
+#undef X
+
+	for(size_t i = 0; i < equiv->memory_size; i++) {
+		if(first_memory[i] != second_memory[i]) {
+			printf("%8s: 0x%02x vs 0x%02x at %s+0x%zx\n", "memory", first_memory[i], second_memory[i], harness_register_name(equiv->memory_register), i);
+			break;
+		}
+	}
+}
+
+// Runs two snippets over the same random and edge case inputs of
+// "[count=n] [threads=n] [live=reg,flag,...] [mem=reg:size] -- first -- second"
+// and compares their live-out registers, flags and memory
+bool run_equiv(task_t task, thread_act_t thread, x86_thread_state_t *state, char *str) {
+	char *first = strstr(str, "--");
+	char *second = first? strstr(first + 2, "--"): NULL;
+	if(!second) {
+		return false;
+	}
+	*first = '\0';
+	*second = '\0';
+	first += 2;
+	second += 2;
+	while(*first == ' ') {
+		first++;
+	}
+	while(*second == ' ') {
+		second++;
+	}
+
+	equiv_t equiv = {.memory_register = -1};
+	gpr_register_t total = EQUIV_VECTORS;
+	long lanes = MIN(sysconf(_SC_NPROCESSORS_ONLN), HARNESS_MAX_LANES);
+	bool live_given = false;
+
+	bool valid = first[0] != '\0' && second[0] != '\0';
+	for(char *option; valid && (option = strsep(&str, " "));) {
+		if(option[0] == '\0') {
+			continue;
+		}
+
+		char *name = strsep(&option, "=");
+		if(!option) {
+			valid = false;
+		} else if(strcmp(name, "count") == 0) {
+			valid = get_value(task, option, state, &total) && total != 0;
+		} else if(strcmp(name, "threads") == 0) {
+			lanes = strtol(option, NULL, 0);
+		} else if(strcmp(name, "live") == 0) {
+			live_given = true;
+			for(char *live; valid && (live = strsep(&option, ","));) {
+				valid = equiv_live(&equiv, live);
+			}
+		} else if(strcmp(name, "mem") == 0) {
+			char *register_name = strsep(&option, ":");
+			gpr_register_t size;
+			equiv.memory_register = harness_register_index(register_name);
+			valid = option && equiv.memory_register != -1 && equiv.memory_register != HARNESS_SP && equiv.memory_register != HARNESS_FLAGS && get_value(task, option, state, &size) && size != 0 && size <= MAX_EQUIV_MEMORY;
+			equiv.memory_size = size;
+		} else {
+			valid = false;
+		}
+	}
+
+	if(!valid) {
+		return false;
+	}
+	if(lanes < 1 || lanes > HARNESS_MAX_LANES) {
+		printf("Use 1 to %d threads.\n", HARNESS_MAX_LANES);
+		return true;
+	}
+
+	// Every register and flag unless told otherwise
+	if(!live_given) {
+		for(int r = 0; r < HARNESS_WORDS; r++) {
+			equiv.live[r] = harness_register_name(r) && r != HARNESS_FLAGS;
+		}
+		equiv.flags = EQUIV_FLAGS;
+	}
+
+	size_t chunk = MIN(total, SWEEP_CHUNK_VECTORS * (uint64_t)lanes);
+	harness_vector_t *expected = malloc(chunk * sizeof(harness_vector_t));
+	exception_type_t *expected_faults = malloc(chunk * sizeof(exception_type_t));
+	unsigned char *initial_memory = NULL;
+	unsigned char *expected_memory = NULL;
+	if(equiv.memory_size) {
+		// Every vector has its own memory, aligned for vector loads
+		equiv.slot = (equiv.memory_size + 63) & ~(size_t)63;
+		equiv.memory = harness_memory(task, chunk * equiv.slot, &equiv.memory_address);
+		initial_memory = malloc(chunk * equiv.slot);
+		expected_memory = malloc(chunk * equiv.slot);
+		valid = equiv.memory != NULL;
+	}
+	// Makes room for the inputs of every chunk
+	valid = valid && equiv_prepare(task, first, chunk, lanes, 0) && equiv_prepare(task, second, chunk, lanes, 1);
+
+	uint64_t start = bench_now();
+	uint64_t done = 0;
+	bool differ = false;
+	while(valid && !differ && done < total) {
+		size_t count = MIN(total - done, chunk);
+		harness_vector_t *inputs = harness_inputs();
+		for(size_t i = 0; i < count; i++) {
+			harness_vector_from_state(state, i / ((count + lanes - 1) / lanes), &inputs[i]);
+			for(int r = 0; r < HARNESS_WORDS; r++) {
+				if(harness_register_name(r) && r != HARNESS_SP && r != HARNESS_FLAGS) {
+					inputs[i].words[r] = equiv_value();
+				}
+			}
+			// Random status flags, with the direction flag clear as the ABI
+			// wants it
+			inputs[i].words[HARNESS_FLAGS] = (equiv_value() & (EQUIV_FLAGS & ~0x400)) | 0x202;
+			if(equiv.memory_size) {
+				inputs[i].words[equiv.memory_register] = equiv.memory_address + i * equiv.slot;
+			}
+		}
+		if(equiv.memory_size) {
+			arc4random_buf(equiv.memory, count * equiv.slot);
+			memcpy(initial_memory, equiv.memory, count * equiv.slot);
+		}
+
+		if(!equiv_run(task, thread, 0, count, lanes)) {
+			break;
+		}
+		for(size_t i = 0; i < count; i++) {
+			expected[i] = *harness_output(i);
+			expected_faults[i] = harness_fault(i);
+		}
+		if(equiv.memory_size) {
+			memcpy(expected_memory, equiv.memory, count * equiv.slot);
+			memcpy(equiv.memory, initial_memory, count * equiv.slot);
+		}
+
+		if(!equiv_run(task, thread, 1, count, lanes)) {
+			break;
+		}
+
+		for(size_t i = 0; !differ && i < count; i++) {
+			const harness_vector_t *output = harness_output(i);
+			exception_type_t fault = harness_fault(i);
+			// Snippets that fault the same way agree, whatever they left behind
+			differ = expected_faults[i] != fault;
+			if(!fault) {
+				differ = differ || ((expected[i].words[HARNESS_FLAGS] ^ output->words[HARNESS_FLAGS]) & equiv.flags) != 0;
+				for(int r = 0; !differ && r < HARNESS_WORDS; r++) {
+					differ = equiv.live[r] && expected[i].words[r] != output->words[r];
+				}
+				if(!differ && equiv.memory_size) {
+					differ = memcmp(expected_memory + i * equiv.slot, equiv.memory + i * equiv.slot, equiv.memory_size) != 0;
+				}
+			}
+
+			if(differ) {
+				equiv_report(&equiv, done + i, &inputs[i], &expected[i], output, expected_faults[i], fault, expected_memory + i * equiv.slot, equiv.memory + i * equiv.slot);
+			}
+		}
+		done += count;
+	}
+
+	if(!differ && done == total) {
+		double seconds = (bench_now() - start) / 1e9;
+		printf(KGRN "The snippets agree" RESET " on %llu vectors (%.2f s, %.0f vectors/s)\n", (unsigned long long)done, seconds, done / seconds);
+	}
+
+	free(expected);
+	free(expected_faults);
+	free(initial_memory);
+	free(expected_memory);
+	return true;
+}
+
+void read_input(task_t task, thread_act_t thread, x86_thread_state_t *state, x86_float_state_t *float_state) {
+	static char *line = NULL;
+	while(true) {
+		if(line) {
+			free(line);
+		}
+
+		waiting_for_input = true;
+		line = prompt("> ");
+
+		waiting_for_input = false;
+
+		if(!line) {
+			// A script of the daemon ran to its end
+			daemon_reply(0);
+			exit(0);
+		}
+
+		if(line[0] == '\0') {
+			continue;
+		}
+
+// A command whose name is taken by a variable has a second name for the enum
+#define CMD_LIST(x, ...) CMD_LIST_(x, ##__VA_ARGS__, x)
+#define CMD_LIST_(x, y, ...) y,
+#define FOREACH_CMD(X) \
+	X(set) \
+	X(read) \
+	X(write) \
+	X(writestr) \
+	X(alloc) \
+	X(regs) \
+	X(show) \
+	X(syntax) \
+	X(bits) \
+	X(find) \
+	X(maps) \
+	X(watch) \
+	X(hwwatch) \
+	X(cond) \
+	X(until) \
+	X(run) \
+	X(block) \
+	X(labels) \
+	X(dis) \
+	X(stats) \
+	X(reset) \
+	X(state, state_cmd) \
+	X(batch) \
+	X(sweep) \
+	X(equiv) \
+	X(cont)
+		typedef enum {
+			FOREACH_CMD(CMD_LIST)
+		} cmds;
+		static char *cmd_names[] = {
+			FOREACH_CMD(STR_LIST)
+		};
+
+		static char *help[] = {
+			"Usage: .set register value\n"
+			"Changes the value of a register\n"
+			"\n"
+			"  register - register name (GPR, FPR or status)\n"
+			"  value    - hex if GPR or FPR, 0 or 1 if status\n"
+			"\n"
+			"A GPR can also be set to an expression, e.g. .set rax rsp+0x10",
+
+			"Usage: .read address [len]\n"
+			"Displays a hexdump of memory starting at address\n"
+			"\n"
+			"  address - an integer or an expression\n"
+			"  len     - the amount of bytes to read\n"
+			"\n"
+			"Expressions combine numbers, registers, status flags, $names and\n"
+			"[address] for a pointer-sized memory read with C operators, without\n"
+			"spaces, e.g. .read [rsp+8]-0x10",
+
+			"Usage: .write address hexpairs\n"
+			"Writes hexpairs to a destination address\n"
+			"\n"
+			"  address  - an integer or an expression\n"
+			"  hexpairs - pairs of hexadecimal numbers",
+
+			"Usage: .writestr address string\n"
+			"Writes an ascii string to a destination address\n"
+			"\n"
+			"  address - an integer or an expression\n"
+			"  string  - an ascii string",
+
+			"Usage: .alloc len [huge|huge1g] [prefault] [lock] [align=n]\n"
+			"       .alloc name len [align]\n"
+			"Allocates some memory and returns the address\n"
+			"\n"
+			"  len      - the amount of bytes to allocate\n"
+			"  name     - name of an allocation from the heap, usable as $name\n"
+			"  align    - alignment of a named allocation, 16 by default\n"
+			"  huge     - back the memory with 2 MiB pages\n"
+			"  huge1g   - back the memory with 1 GiB pages (falls back to 2 MiB)\n"
+			"  prefault - make every page resident before returning\n"
+			"  lock     - wire the memory so it can't be paged out (requires root)\n"
+			"  align=n  - align the address to n, a power of two\n"
+			"\n"
+			"The address of the last unnamed allocation is available as $alloc.\n"
+			"Without arguments the named allocations are listed",
+
+			"Usage: .regs\n"
+			"Displays the values of the registers currently toggled on",
+
+			"Usage: .show [gpr|status|fpr_hex|fpr_double]\n"
+			"Toggles which types of registers are shown\n"
+			"\n"
+			"  gpr        - General purpose registers (rax, rsp, rip, ...)\n"
+			"  status     - Status registers (CF, ZF, ...)\n"
+			"  fpr_hex    - Floating point registers shown in hex (xmm0, xmm1, ...)\n"
+			"  fpr_double - Floating point registers shown as doubles",
+
+			"Usage: .syntax [att|intel]\n"
+			"Changes the assembly syntax to intel or at&t\n",
+
+			"Usage: .bits [32|64]\n"
+			"Switches to a child of the other architecture\n"
+			"\n"
+			"The other architecture is started on first use and both keep their\n"
+			"state, so switching back and forth continues where each left off.",
+
+			"Usage: .find pattern [address [len]]\n"
+			"Searches the memory of the child for a pattern\n"
+			"\n"
+			"  pattern - \"string\", 0x-prefixed pointer-sized value or hexpairs\n"
+			"  address - an integer or an expression to start searching at\n"
+			"  len     - the amount of bytes to search",
+
+			"Usage: .maps\n"
+			"Lists the memory regions of the child and the allocations made by asm_repl",
+
+			"Usage: .watch [address len|clear]\n"
+			"Shows the bytes of a memory range that changed after each step\n"
+			"\n"
+			"  address - an integer or an expression\n"
+			"  len     - the amount of bytes to watch\n"
+			"  clear   - remove all watches\n"
+			"\n"
+			"Without arguments the current watches are listed",
+
+			"Usage: .hwwatch [address len [w|rw|x]|clear]\n"
+			"Stops the child when a memory location is accessed, using the debug registers\n"
+			"\n"
+			"  address - an integer or an expression\n"
+			"  len     - 1, 2, 4" IF32("", " or 8") ", the address must be aligned to it\n"
+			"  w       - stop on writes (default)\n"
+			"  rw      - stop on reads and writes\n"
+			"  x       - stop when the instruction at address is executed\n"
+			"  clear   - remove all hardware watchpoints\n"
+			"\n"
+			"Without arguments the current hardware watchpoints are listed",
+
+			"Usage: .cond [condition|clear]\n"
+			"Single steps the child until a condition is true\n"
+			"\n"
+			"  condition - an expression, e.g. rax==0x10 or [rsp+8]>rcx\n"
+			"  clear     - remove the condition\n"
+			"\n"
+			"The condition is compiled once and evaluated after every instruction.\n"
+			"Without arguments the current condition is shown",
+
+			"Usage: .until [[@label] condition|clear]\n"
+			"Runs the loops of the next snippet natively until a condition is true\n"
+			"\n"
+			"  label     - check at this label instead of before branches back to\n"
+			"              earlier labels of the snippet\n"
+			"  condition - an expression without division or the pc, e.g. rcx==0\n"
+			"  clear     - remove the pending condition\n"
+			"\n"
+			"A check that only traps once the condition is true is assembled into the\n"
+			"next snippet with a loop. The child then stops at the end of the snippet.\n"
+			"Without arguments the pending condition is shown",
+
+			"Usage: .run [@label] iterations\n"
+			"Runs the loops of the next snippet natively for a number of iterations\n"
+			"\n"
+			"  label      - count at this label instead of before branches back to\n"
+			"               earlier labels of the snippet\n"
+			"  iterations - the amount of times the loop runs before the child stops\n"
+			"\n"
+			"The remaining count is kept in $run",
+
+			"Usage: .block\n"
+			"Reads lines until .end and assembles them together\n"
+			"\n"
+			"Labels of a block can be used by later snippets. Lines that are pasted\n"
+			"at once are assembled as a block as well",
+
+			"Usage: .labels\n"
+			"Lists the labels defined so far and their addresses",
+
+			"Usage: .dis [address [count]]\n"
+			"Disassembles the instructions in memory starting at address\n"
+			"\n"
+			"  address - an integer or an expression, the pc by default\n"
+			"  count   - the amount of instructions, 10 by default",
+
+			"Usage: .stats [reset]\n"
+			"Shows how long the phases of a step took and how often the kernel was\n"
+			"called\n"
+			"\n"
+			"  reset - start counting from zero again",
+
+			"Usage: .reset\n"
+			"Puts the child back to its state at startup\n"
+			"\n"
+			"Memory and registers are restored from a copy-on-write snapshot, so only\n"
+			"the pages that were written since are copied. Allocations, labels,\n"
+			"watches and conditions are dropped.",
+
+			"Usage: .state save|load name\n"
+			"       .state diff name name\n"
+			"Saves the registers and named allocations to a file, loads them or\n"
+			"compares two saved states\n"
+			"\n"
+			"  name - a state in ~/.asm_repl_states\n"
+			"\n"
+			"The GPRs, flags, XMM/YMM registers and the contents of every $name are\n"
+			"saved. Loading makes missing allocations and moves registers that\n"
+			"pointed into an allocation that has another address now.",
+
+			"Usage: .batch reg=value[,value...] [reg=...] -- snippet\n"
+			"Runs a snippet once per input vector and shows the outputs as a table\n"
+			"\n"
+			"  reg     - a GPR or the flags register\n"
+			"  value   - an integer or an expression, vector i takes the ith value\n"
+			"            of every list and a single value is used for every vector\n"
+			"  snippet - instructions separated by ;\n"
+			"\n"
+			"A loop in the child loads every vector, runs the snippet and stores the\n"
+			"registers, with a single stop at the end. The other registers start as\n"
+			"they are now, with a stack of their own. The child's registers are\n"
+			"unchanged afterwards, e.g. .batch rax=1,2,3 rbx=7 -- imul rax, rbx",
+
+			"Usage: .sweep [threads=n] [random=n] [csv=file|bin=file] reg=lo..hi[:step] [reg=...] -- snippet\n"
+			"Runs a snippet over every combination of the ranges, or a random sample\n"
+			"of them, and shows the outputs or writes them to a file\n"
+			"\n"
+			"  threads - how many threads of the child run vectors, every core by default\n"
+			"  random  - the number of vectors with random values from the ranges\n"
+			"  csv     - a file for a row of inputs and outputs per vector\n"
+			"  bin     - a file for the same rows as raw words\n"
+			"  reg     - a GPR or the flags register\n"
+			"  lo, hi  - integers or expressions, both included\n"
+			"  step    - the distance between values, 1 by default\n"
+			"\n"
+			"More than 4096 vectors have to go to a file. The last range changes\n"
+			"fastest, e.g. .sweep csv=imul.csv rax=0..0xff rbx=0..0xff -- imul al, bl",
+
+			"Usage: .equiv [count=n] [threads=n] [live=reg|flag,...] [mem=reg:size] -- snippet -- snippet\n"
+			"Runs two snippets over the same random inputs and shows the first one\n"
+			"they disagree on\n"
+			"\n"
+			"  count   - the number of vectors, 1048576 by default\n"
+			"  threads - how many threads of the child run vectors, every core by default\n"
+			"  live    - the registers and flags (cf, zf, ...) to compare, all by default\n"
+			"  mem     - a register that points to size bytes of random memory per vector,\n"
+			"            which are compared as well\n"
+			"  snippet - instructions separated by ;\n"
+			"\n"
+			"A quarter of the inputs are edge cases like 0, -1 or 0x80000000. The\n"
+			"stack pointer and the direction flag aren't random, e.g.\n"
+			".equiv live=rax -- imul rax, rax, 8 -- shl rax, 3",
+
+			"Usage: .cont\n"
+			"Resumes the child at the current pc without writing new instructions"
+		};
+
+		ssize_t cmd = -1;
+		if(line[0] == '?' || line[0] == '.') {
+			for(size_t i = 0; i != ELEMENTS(cmd_names); i++) {
+				size_t len = strlen(cmd_names[i]);
+				if(strncmp(cmd_names[i], line + 1, len) == 0 && (line[len + 1] == '\0' || line[len + 1] == ' ')) {
+					cmd = i;
+					break;
+				}
+			}
+		}
+
+		if(line[0] == '?') {
+			if(cmd != -1) {
+				puts(help[cmd]);
+				continue;
+			}
+
+			puts("Valid input:\n"
+			       "  Help:\n"
+			       "    ?      - show this help\n"
+				   "    ?[cmd] - show help for a command\n"
+				   "\n"
+				   "  Commands:\n"
+				   "    .set      - change value of register\n"
+				   "    .read     - read from memory\n"
+				   "    .write    - write hex to memory\n"
+				   "    .writestr - write string to memory\n"
+				   "    .alloc    - allocate memory\n"
+				   "    .regs     - show the contents of the registers\n"
+				   "    .show     - toggle shown register types\n"
+				   "    .syntax   - change the assembly syntax to intel or at&t\n"
+				   "    .bits     - switch between 32 and 64 bit\n"
+				   "    .find     - search memory for a pattern\n"
+				   "    .maps     - list memory regions\n"
+				   "    .watch    - show changes to memory after each step\n"
+				   "    .hwwatch  - stop when memory is accessed\n"
+				   "    .cond     - stop when a condition is true\n"
+				   "    .until    - run a loop until a condition is true\n"
+				   "    .run      - run a loop for a number of iterations\n"
+				   "    .block    - assemble multiple lines together\n"
+				   "    .labels   - list the labels of earlier snippets\n"
+				   "    .dis      - disassemble memory\n"
+				   "    .stats    - show where the time of a step went\n"
+				   "    .reset    - put the child back to its state at startup\n"
+				   "    .state    - save, load or compare registers and allocations\n"
+				   "    .batch    - run a snippet over many inputs at once\n"
+				   "    .sweep    - run a snippet over ranges of inputs\n"
+				   "    .equiv    - check that two snippets compute the same\n"
+				   "    .cont     - resume the child without new instructions\n"
+				   "\n"
+				   "Any other input will be interpreted as " ARCH_NAME " assembly"
+			);
+		} else if(line[0] == '.') {
+			size_t args = count_tokens(line, " ") - 1;
+			char *line_end = line + strlen(line);
+
+			char *p = line + 1;
+			char *cmd_name = strsep(&p, " ");
+			char *arg1 = strsep(&p, " ");
+			char *arg2 = strsep(&p, " ");
+
+			bool resume = false;
+			switch(cmd) {
+				case set: {
+					if(args != 2) {
+						puts(help[cmd]);
+						continue;
+					}
+
+					size_t len = strlen(arg2);
+					if(len == 1) {
+						char c = arg2[0];
+						if(c == '0' || c == '1') {
+							x86_flags_t *flags = (x86_flags_t *)&state->uts.ts.flags_register;
+							bool matched = false;
+#define X(f) do { \
+	if(strcmp(arg1, #f) == 0) { \
+		flags->f = c - '0'; \
+		matched = true; \
+	} \
+} while(false)
+	FOREACH_STATUS_FLAG(X)
+#undef X
+
+							if(matched) {
+								continue;
+							}
+						}
+					}
+
+					size_t size;
+					unsigned char *data = hex2bytes(arg2, &size, true);
+					if(!data) {
+						// Not hex, so a GPR can be set to an expression
+						gpr_register_t *gpr = get_gpr_pointer(arg1, state);
+						gpr_register_t value;
+						if(!gpr || !get_value(task, arg2, state, &value)) {
+							puts(help[cmd]);
+							continue;
+						}
+
+						*gpr = value;
+						set_thread_state(thread, state);
+						break;
+					}
+
+					size_t expected_size;
+					gpr_register_t *gpr = get_gpr_pointer(arg1, state);
+					xmm_value_t *xmm;
+					if(gpr) {
+						expected_size = sizeof(*gpr);
+					} else {
+						xmm = get_fpr_pointer(arg1, float_state);
 						if(xmm) {
 							expected_size = sizeof(*xmm);
 						}
@@ -594,14 +1739,14 @@ void read_input(task_t task, thread_act_t thread, x86_thread_state_t *state, x86
 				}
 				case read: {
 					gpr_register_t address;
-					if(args < 1 || args > 2 || !get_value(arg1, state, &address)) {
+					if(args < 1 || args > 2 || !get_value(task, arg1, state, &address)) {
 						puts(help[cmd]);
 						continue;
 					}
 
 					gpr_register_t len = 0x20;
 					if(args == 2) {
-						if(!get_number(arg2, &len)) {
+						if(!get_value(task, arg2, state, &len)) {
 							puts(help[cmd]);
 							continue;
 						}
@@ -614,27 +1759,14 @@ void read_input(task_t task, thread_act_t thread, x86_thread_state_t *state, x86
 						continue;
 					});
 
-					const size_t row_bytes = 8;
-					for(int i = 0; i < count; i += row_bytes) {
-						char str[3 * row_bytes + 2 + row_bytes];
-						for(int j = 0; j < row_bytes && i + j < count; j++) {
-							unsigned char c = data[i + j];
-							str[3 * j] = int2hex(c >> 4);
-							str[3 * j + 1] = int2hex(c & 0x0f);
-							str[3 * j + 2] = ' ';
-							str[3 * row_bytes + 1 + j] = ISGRAPH(c)? c: '.';
-						}
-						str[3 * row_bytes] = ' ';
-						str[sizeof(str) - 1] = '\0';
-						printf(REGISTER_FORMAT_HEX ": %s\n", address + i, str);
-					}
+					print_hexdump(address, data, count, NULL);
 
 					free(data);
 					break;
 				}
 				case write: {
 					gpr_register_t address;
-					if(args != 2 || !get_value(arg1, state, &address)) {
+					if(args != 2 || !get_value(task, arg1, state, &address)) {
 						puts(help[cmd]);
 						continue;
 					}
@@ -650,89 +1782,420 @@ void read_input(task_t task, thread_act_t thread, x86_thread_state_t *state, x86
 						free(data);
 						continue;
 					});
+					watch_touch(address, size);
+					dis_invalidate(address, size);
 
 					printf("Wrote %zu bytes.\n", size);
 
 					free(data);
 					break;
 				}
-				case writestr: {
-					gpr_register_t address;
-					if(args != 2 || !get_value(arg1, state, &address)) {
+				case writestr: {
+					gpr_register_t address;
+					if(args != 2 || !get_value(task, arg1, state, &address)) {
+						puts(help[cmd]);
+						continue;
+					}
+
+					size_t size = strlen(arg2) + 1;
+
+					KERN_TRY("mach_vm_write", mach_vm_write(task, address, (vm_offset_t)arg2, size), {
+						continue;
+					});
+					watch_touch(address, size);
+					dis_invalidate(address, size);
+
+					printf("Wrote %zu bytes.\n", size);
+
+					break;
+				}
+				case alloc: {
+					if(args == 0) {
+						alloc_list();
+						break;
+					}
+
+					gpr_register_t len;
+					if(!get_number(arg1, &len)) {
+						// Named allocation from the heap
+						char *arg3 = strsep(&p, " ");
+
+						gpr_register_t align = 0;
+						if(args < 2 || args > 3 || !alloc_valid_name(arg1) || !get_number(arg2, &len) || (arg3 && !get_number(arg3, &align))) {
+							puts(help[cmd]);
+							continue;
+						}
+
+						mach_vm_address_t address;
+						if(alloc_named(task, arg1, len, align, &address)) {
+							printf("$%s = 0x%llx\n", arg1, address);
+						}
+						break;
+					}
+
+					alloc_options_t options = {0};
+					bool valid = true;
+					for(char *option = arg2; option && valid; option = strsep(&p, " ")) {
+						valid = alloc_parse_option(option, &options);
+					}
+
+					if(!valid) {
+						puts(help[cmd]);
+						continue;
+					}
+
+					mach_vm_address_t address;
+					mach_vm_size_t size = len;
+					if(!alloc_memory(task, &size, &options, &address)) {
+						continue;
+					}
+
+					alloc_set_name("alloc", address, size);
+
+					printf("Allocated %llu bytes at 0x%llx ($alloc)\n", size, address);
+					break;
+				}
+				case regs: {
+					print_registers(state, float_state);
+					break;
+				}
+				case show: {
+					if(args == 1) {
+						bool toggled = false;
+						for(size_t i = 0; i < ELEMENTS(register_type_names); i++) {
+							if(strcmp(arg1, register_type_names[i]) == 0) {
+								bool val = !show_register_types[i];
+								show_register_types[i] = val;
+								printf("%s toggled %s\n", arg1, val? "on": "off");
+								toggled = true;
+								break;
+							}
+						}
+						if(toggled) {
+							continue;
+						}
+					}
+
+					puts(help[cmd]);
+					break;
+				}
+				case syntax: {
+					if(args == 1) {
+						int type = -1;
+						if(strcmp(arg1, "intel") == 0) {
+							type = 0;
+						}
+						if(strcmp(arg1, "att") == 0) {
+							type = 1;
+						}
+
+						if(type != -1) {
+							syntax_type = type;
+							continue;
+						}
+					}
+
+					if(args == 0) {
+						printf("Current syntax: %s\n", syntax_type? "att": "intel");
+					}
+
+					puts(help[cmd]);
+					break;
+				}
+				case bits: {
+					if(args == 0) {
+						printf("Current architecture: %s\n", ARCH_NAME);
+						break;
+					}
+
+					int requested = strcmp(arg1, "32") == 0? 32: strcmp(arg1, "64") == 0? 64: 0;
+					if(args != 1 || requested == 0) {
+						puts(help[cmd]);
+						continue;
+					}
+
+					if(requested == BITS) {
+						printf("Already running %s.\n", ARCH_NAME);
+						break;
+					}
+
+					if(one_shot || recording || replaying) {
+						puts("Switching the architecture only works in interactive sessions.");
+						break;
+					}
+
+					if(peer_switch(requested)) {
+						printf("Back to %s\n", ARCH_NAME);
+						print_registers(state, float_state);
+					}
+					break;
+				}
+				case find: {
+					if(args < 1) {
+						puts(help[cmd]);
+						continue;
+					}
+
+					// The pattern may contain spaces
+					unsigned char *pattern;
+					size_t pattern_len;
+					char *range = parse_pattern(rejoin_args(arg1, line_end), &pattern, &pattern_len);
+					if(!range) {
+						puts(help[cmd]);
+						continue;
+					}
+
+					char *start_str = strsep(&range, " ");
+					char *len_str = strsep(&range, " ");
+
+					gpr_register_t start = 0;
+					gpr_register_t len = 0;
+					if((start_str && *start_str && !get_value(task, start_str, state, &start)) || (len_str && !get_number(len_str, &len)) || range) {
+						free(pattern);
+						puts(help[cmd]);
+						continue;
+					}
+
+					mach_vm_address_t end = len_str? (mach_vm_address_t)start + len: (mach_vm_address_t)-1;
+					size_t found = find_pattern(task, pattern, pattern_len, start, end);
+					printf("Found %zu matches.\n", found);
+
+					free(pattern);
+					break;
+				}
+				case maps: {
+					maps_print(task);
+					break;
+				}
+				case watch: {
+					if(args == 0) {
+						watch_list();
+						break;
+					}
+
+					if(args == 1 && strcmp(arg1, "clear") == 0) {
+						watch_clear();
+						break;
+					}
+
+					gpr_register_t address;
+					gpr_register_t len;
+					if(args != 2 || !get_value(task, arg1, state, &address) || !get_number(arg2, &len)) {
+						puts(help[cmd]);
+						continue;
+					}
+
+					if(!watch_add(task, address, len)) {
+						puts("Failed to watch memory range.");
+					}
+					break;
+				}
+				case hwwatch: {
+					if(args == 0) {
+						hwwatch_list();
+						break;
+					}
+
+					if(args == 1 && strcmp(arg1, "clear") == 0) {
+						hwwatch_clear(thread);
+						break;
+					}
+
+					char *arg3 = strsep(&p, " ");
+
+					gpr_register_t address;
+					gpr_register_t len;
+					hwwatch_type type = HWWATCH_WRITE;
+					if(args < 2 || args > 3 || !get_value(task, arg1, state, &address) || !get_number(arg2, &len) || (arg3 && !hwwatch_parse_type(arg3, &type))) {
+						puts(help[cmd]);
+						continue;
+					}
+
+					hwwatch_add(thread, address, len, type);
+					break;
+				}
+				case cond: {
+					if(args == 0) {
+						if(break_condition) {
+							printf("Condition: %s\n", break_condition->source);
+						}
+						break;
+					}
+
+					if(args == 1 && strcmp(arg1, "clear") == 0) {
+						expr_free(break_condition);
+						break_condition = NULL;
+						break;
+					}
+
+					// The condition may contain spaces
+					const char *error;
+					expr_t *condition = expr_compile(rejoin_args(arg1, line_end), &error);
+					if(!condition) {
+						printf("Invalid expression: %s\n", error);
+						continue;
+					}
+
+					expr_free(break_condition);
+					break_condition = condition;
+					break;
+				}
+				case until: {
+					if(args == 0) {
+						until_print();
+						break;
+					}
+
+					if(args == 1 && strcmp(arg1, "clear") == 0) {
+						until_clear();
+						break;
+					}
+
+					// The condition may contain spaces
+					char *str = rejoin_args(arg1, line_end);
+					char *label = NULL;
+					if(str[0] == '@') {
+						label = strsep(&str, " ") + 1;
+					}
+
+					const char *error;
+					expr_t *condition = str? expr_compile(str, &error): NULL;
+					if(!condition) {
+						puts(help[cmd]);
+						continue;
+					}
+
+					if(!until_arm(condition, 0, label, &error)) {
+						printf("Invalid condition: %s\n", error);
+						expr_free(condition);
+						continue;
+					}
+					break;
+				}
+				case run: {
+					char *label = NULL;
+					char *count_str = arg1;
+					if(args == 2 && arg1[0] == '@') {
+						label = arg1 + 1;
+						count_str = arg2;
+					}
+
+					gpr_register_t count;
+					if(args < 1 || args > 2 || (args == 2 && !label) || !get_value(task, count_str, state, &count) || count == 0) {
+						puts(help[cmd]);
+						continue;
+					}
+
+					// The check decrements the counter in the child
+					mach_vm_address_t counter;
+					if(!alloc_lookup("run", 3, &counter) && !alloc_named(task, "run", sizeof(count), sizeof(count), &counter)) {
+						continue;
+					}
+
+					KERN_TRY("mach_vm_write", mach_vm_write(task, counter, (vm_offset_t)&count, sizeof(count)), {
+						continue;
+					});
+					watch_touch(counter, sizeof(count));
+
+					const char *error;
+					until_arm(NULL, counter, label, &error);
+					break;
+				}
+				case block: {
+					char *text = read_block(NULL, ".end");
+					resume = text && write_snippet(task, thread, state, text);
+					free(text);
+					break;
+				}
+				case labels: {
+					block_list_labels();
+					break;
+				}
+				case dis: {
+					gpr_register_t address = state->uts.ts.pc_register;
+					gpr_register_t count = 10;
+					if(args > 2 || (args >= 1 && !get_value(task, arg1, state, &address)) || (args == 2 && (!get_value(task, arg2, state, &count) || count == 0))) {
+						puts(help[cmd]);
+						continue;
+					}
+
+					dis_print(task, address, count, syntax_type);
+					break;
+				}
+				case stats: {
+					if(args > 1 || (args == 1 && strcmp(arg1, "reset") != 0)) {
+						puts(help[cmd]);
+						continue;
+					}
+
+					if(args == 1) {
+						stats_reset();
+					} else {
+						stats_print();
+					}
+					break;
+				}
+				case reset: {
+					if(args != 0) {
 						puts(help[cmd]);
 						continue;
 					}
 
-					size_t size = strlen(arg2) + 1;
-
-					KERN_TRY("mach_vm_write", mach_vm_write(task, address, (vm_offset_t)arg2, size), {
-						continue;
-					});
-
-					printf("Wrote %zu bytes.\n", size);
+					uint64_t start = bench_now();
+					if(!reset_child(task, thread)) {
+						puts("Failed to reset the child.");
+						break;
+					}
+					printf("Reset the child in %.1f us\n", (bench_now() - start) / 1e3);
 
+					// It stops at the start of the arena again
+					resume = true;
 					break;
 				}
-				case alloc: {
-					gpr_register_t size;
-					if(args != 1 || !get_number(arg1, &size)) {
+				case state_cmd: {
+					char *arg3 = strsep(&p, " ");
+					if(args == 2 && strcmp(arg1, "save") == 0) {
+						state_save(task, thread, arg2);
+					} else if(args == 2 && strcmp(arg1, "load") == 0) {
+						if(state_load(task, thread, arg2)) {
+							get_thread_state(thread, state);
+							get_float_state(thread, float_state);
+							printf("Loaded %s\n", arg2);
+						}
+					} else if(args == 3 && strcmp(arg1, "diff") == 0) {
+						state_diff(arg2, arg3);
+					} else {
 						puts(help[cmd]);
 						continue;
 					}
-
-					mach_vm_address_t address;
-					KERN_TRY("mach_vm_allocate", mach_vm_allocate(task, &address, size, VM_FLAGS_ANYWHERE), {
-						continue;
-					});
-
-					printf("Allocated " REGISTER_FORMAT_DEC " bytes at 0x%llx\n", size, address);
 					break;
 				}
-				case regs: {
-					print_registers(state, float_state);
+				case batch: {
+					if(args < 2 || !run_batch(task, thread, state, rejoin_args(arg1, line_end))) {
+						puts(help[cmd]);
+						continue;
+					}
 					break;
 				}
-				case show: {
-					if(args == 1) {
-						bool toggled = false;
-						for(size_t i = 0; i < ELEMENTS(register_type_names); i++) {
-							if(strcmp(arg1, register_type_names[i]) == 0) {
-								bool val = !show_register_types[i];
-								show_register_types[i] = val;
-								printf("%s toggled %s\n", arg1, val? "on": "off");
-								toggled = true;
-								break;
-							}
-						}
-						if(toggled) {
-							continue;
-						}
+				case sweep: {
+					if(args < 2 || !run_sweep(task, thread, state, rejoin_args(arg1, line_end))) {
+						puts(help[cmd]);
+						continue;
 					}
-
-					puts(help[cmd]);
 					break;
 				}
-				case syntax: {
-					if(args == 1) {
-						int type = -1;
-						if(strcmp(arg1, "intel") == 0) {
-							type = 0;
-						}
-						if(strcmp(arg1, "att") == 0) {
-							type = 1;
-						}
-
-						if(type != -1) {
-							syntax_type = type;
-							continue;
-						}
-					}
-
-					if(args == 0) {
-						printf("Current syntax: %s\n", syntax_type? "att": "intel");
+				case equiv: {
+					if(args < 3 || !run_equiv(task, thread, state, rejoin_args(arg1, line_end))) {
+						puts(help[cmd]);
+						continue;
 					}
-
-					puts(help[cmd]);
+					break;
+				}
+				case cont: {
+					// The code the child continues in was never checked
+					watch_compare_next();
+					maps_invalidate();
+					resume = true;
 					break;
 				}
 				default: {
@@ -740,28 +2203,30 @@ void read_input(task_t task, thread_act_t thread, x86_thread_state_t *state, x86
 					break;
 				}
 			}
+
+			if(resume) {
+				break;
+			}
 		} else {
-			unsigned char *assembly;
-			size_t asm_len;
-			mach_vm_address_t pc = state->uts.ts.pc_register;
-			if(assemble_string(line, BITS, pc, &assembly, &asm_len, syntax_type)) {
-				KERN_FAIL("mach_vm_write", mach_vm_write(task, pc, (vm_offset_t)assembly, asm_len));
-				free(assembly);
-				write_int3(task, pc + asm_len);
+			// Lines that were pasted together are assembled as one block
+			if(input_pending()) {
+				line = read_block(line, NULL);
+			}
+
+			if(write_snippet(task, thread, state, line)) {
 				break;
-			} else {
-				puts("Failed to assemble instruction.");
 			}
 		}
 	}
 }
 
-void setup_readline() {
+void setup_readline(void) {
 	// Disable file auto-complete
 	rl_bind_key('\t', rl_insert);
 
 	asprintf(&histfile, "%s/%s", getenv("HOME"), ".asm_repl_history");
-	read_history(histfile);
+	history_load(histfile);
+	atexit(history_compact);
 }
 
 #define READY 'R'
@@ -779,37 +2244,65 @@ void read_ready(int fd) {
 	}
 }
 
+bool show_timing = false;
+
+// Prints how long each step of the startup took with -t
+void startup_mark(const char *step) {
+	static uint64_t last;
+	static double ns_per_tick;
+	if(!last) {
+		mach_timebase_info_data_t timebase;
+		mach_timebase_info(&timebase);
+		ns_per_tick = (double)timebase.numer / timebase.denom;
+		last = mach_absolute_time();
+		return;
+	}
+
+	uint64_t now = mach_absolute_time();
+	if(show_timing) {
+		fprintf(stderr, "%-18s %8.3f ms\n", step, (now - last) * ns_per_tick / 1e6);
+	}
+	last = now;
+}
+
 task_t child_task;
+pid_t child_pid;
+
+// ^C, which is only seen while waiting for the terminal or the child
+void sigint_event(void *context, intptr_t count) {
+	if(peer_waiting()) {
+		// The other architecture owns the terminal
+		return;
+	}
 
-void sigint_handler(int sig) {
 	if(waiting_for_input) {
-		// Clear line
+		// Clear line and print the prompt again
 		printf("\33[2K\r");
-		// Print prompt again
-		longjmp(prompt_jmp_buf, 0);
+		restart_line();
 	} else {
 		// Suspend child and prompt for input
 		puts("");
+		stop_reason = STOP_INTERRUPT;
+		// Whatever the child was running may have changed its mappings
+		maps_invalidate();
 		task_suspend(child_task);
-		pthread_mutex_unlock(&mutex);
+		child_stopped = true;
 	}
 }
 
-void sigchld_handler(int sig) {
-	int status;
-	waitpid(-1, &status, WNOHANG);
-	if(WIFSIGNALED(status)) {
-		puts("Process died!");
-		exit(1);
-	}
+void child_exit_event(void *context, intptr_t data) {
+	puts("Process died!");
+	exit(1);
 }
 
-int main(int argc, const char *argv[]) {
-	if(!taskport_auth()) {
-		puts("Failed to get taskport auth!");
-		exit(1);
-	}
+// A forked child waiting for the exception handler before it traps
+typedef struct {
+	pid_t pid;
+	int read_fd;
+	int write_fd;
+} child_t;
 
+void fork_child(child_t *child) {
 	int p1[2];
 	int p2[2];
 	pipe(p1);
@@ -823,7 +2316,7 @@ int main(int argc, const char *argv[]) {
 	pid_t pid = fork();
 	if(pid == -1) {
 		perror("fork");
-		return 1;
+		exit(1);
 	}
 
 	if(pid == 0) {
@@ -844,60 +2337,559 @@ int main(int argc, const char *argv[]) {
 
 		// This will be caught by the parents exception handler
 		__asm__("int3");
-	} else {
-		close(child_read);
-		close(child_write);
+	}
 
-		signal(SIGINT, sigint_handler);
-		signal(SIGCHLD, sigchld_handler);
+	close(child_read);
+	close(child_write);
 
-		setup_readline();
+	child->pid = pid;
+	child->read_fd = parent_read;
+	child->write_fd = parent_write;
+
+	// Wait for the child to be ready
+	read_ready(child->read_fd);
+}
+
+// A suspended child would otherwise outlive us
+void kill_child(void) {
+	kill(child_pid, SIGKILL);
+}
+
+// Takes control of a forked child and resumes it, it stops right away. The
+// snapshot for .reset is only taken if asked for, as it remaps every private
+// region of the child.
+task_t attach_child(child_t *child, thread_act_t *thread, bool snapshot) {
+	child_pid = child->pid;
+	atexit(kill_child);
 
-		// Wait for the child to be ready
-		read_ready(parent_read);
+	// Every wait for a stop would otherwise outlive a child that exited
+	if(!event_watch_process(child->pid, child_exit_event, NULL)) {
+		child_exit_event(NULL, 0);
+	}
+
+	task_t task;
+	if(task_for_pid(mach_task_self(), child->pid, &task) != KERN_SUCCESS) {
+		// Codesigned binaries and root don't need to ask for the right
+		if(!taskport_auth()) {
+			puts("Failed to get taskport auth!");
+			exit(1);
+		}
+		startup_mark("taskport auth");
 
-		task_t task;
-		if(task_for_pid(mach_task_self(), pid, &task) != KERN_SUCCESS) {
+		if(task_for_pid(mach_task_self(), child->pid, &task) != KERN_SUCCESS) {
 			puts("task_for_pid() failed!");
 			puts("Either codesign asm_repl or run as root.");
 			exit(1);
 		}
-		child_task = task;
+	}
+	child_task = task;
+	startup_mark("task_for_pid");
+
+	setup_exception_handler(task);
 
-		pthread_mutex_init(&mutex, NULL);
-		pthread_mutex_lock(&mutex);
+	// We have set up the exception handler so we make the child raise SIGTRAP
+	write_ready(child->write_fd);
 
-		setup_exception_handler(task);
+	// Wait for exception handler to be called
+	wait_for_stop();
+	startup_mark("exception handler");
+
+	mach_vm_address_t memory;
+	setup_child(task, thread, &memory);
+	if(recording || replaying) {
+		record_prepare(task, *thread);
+	}
+	startup_mark("code arena");
 
-		// We have set up the exception handler so we make the child raise SIGTRAP
-		write_ready(parent_write);
+	if(snapshot) {
+		if(!reset_save(task, *thread)) {
+			puts("Failed to take a snapshot for .reset.");
+		}
+		startup_mark("snapshot");
+	}
 
-		// Wait for exception handler to be called
-		pthread_mutex_lock(&mutex);
+	task_resume(task);
+	return task;
+}
 
-		thread_act_t thread;
-		mach_vm_address_t memory;
-		setup_child(task, &thread, &memory);
+// Takes control of a forked child and runs the input loop until exit
+void run_child(child_t *child) {
+	// A script of -c or of the daemon is known in full, so it only pays for
+	// the snapshot if it uses .reset
+	thread_act_t thread;
+	task_t task = attach_child(child, &thread, !one_shot || strstr(script, ".reset"));
+
+	bool first = true;
+	uint64_t resumed = 0;
+	// The state a faulting step is rolled back to, only known once the child
+	// stopped at the prompt
+	x86_thread_state_t before;
+	x86_float_state_t before_float;
+	bool have_before = false;
+	while(true) {
+		// Wait for exception handler
+		wait_for_stop();
+		uint64_t stopped = stats_now();
 
-		task_resume(task);
+		if(first) {
+			startup_mark("first stop");
+			first = false;
+		} else {
+			stats_add(PHASE_run, resumed);
+		}
 
-		while(true) {
-			// Wait for exception handler
-			pthread_mutex_lock(&mutex);
+		watch_disarm(task);
 
-			x86_thread_state_t state;
-			get_thread_state(thread, &state);
+		if(stop_reason == STOP_CONDITION) {
+			printf("Stopped because %s is true\n", break_condition->source);
+		}
+
+		if(stop_reason == STOP_FAULT) {
+			report_fault(task, get_pc(thread));
+			// The faulting code may have mapped memory before
+			maps_invalidate();
+
+			// Undo the step, memory it wrote stays as it is
+			if(have_before) {
+				set_thread_state(thread, &before);
+				set_float_state(thread, &before_float);
+				puts("The registers were restored to before the step.");
+			}
+		}
+
+		// A check of .until or .run trapped, skip the rest of its snippet
+		mach_vm_address_t resume_pc;
+		if(stop_reason == STOP_BREAKPOINT && until_hit(get_pc(thread), &resume_pc)) {
+			set_pc(thread, resume_pc);
+		}
+
+		// The trap flag is only set while the child runs
+		set_single_step(thread, false);
 
-			x86_float_state_t float_state;
-			get_float_state(thread, &float_state);
+		x86_thread_state_t state;
+		get_thread_state(thread, &state);
 
+		if(recording) {
+			record_stop(task, &state, stop_reason, stop_reason == STOP_INTERRUPT);
+		} else if(replaying) {
+			replay_stop(task, &state, stop_reason);
+		}
+
+		// A step past an execute watchpoint may have ended another way
+		hwwatch_stepped(thread);
+		if(stop_reason == STOP_DEBUG) {
+			hwwatch_report(task, thread, state.uts.ts.pc_register, syntax_type);
+		}
+
+		x86_float_state_t float_state;
+		get_float_state(thread, &float_state);
+		uint64_t rendering = stats_add(PHASE_state, stopped);
+
+		// A script only shows the state after its last line
+		if(!one_shot || !script) {
 			print_registers(&state, &float_state);
 
-			read_input(task, thread, &state, &float_state);
+			char next[128];
+			if(dis_describe(task, state.uts.ts.pc_register, syntax_type, next, sizeof(next))) {
+				printf(KBLU "Next:" RESET " %s\n", next);
+			}
+		}
+
+		watch_print_changes(task);
+		fflush(stdout);
+		stats_add(PHASE_render, rendering);
 
-			task_resume(task);
+		read_input(task, thread, &state, &float_state);
+		// Commands keep these in sync with the child
+		before = state;
+		before_float = float_state;
+		have_before = true;
+
+		watch_arm(task);
+		set_single_step(thread, break_condition != NULL || hwwatch_stepping());
+		if(replaying) {
+			replay_resume();
+		}
+		resumed = stats_now();
+		KERN_FAIL("task_resume", task_resume(task));
+	}
+}
+
+#define ASSEMBLE_SAMPLES 20
+#define STARTUP_SAMPLES 10
+#define STEP_SAMPLES 2000
+#define PRINT_SAMPLES 2000
+#define MEMORY_SAMPLES 500
+#define MEMORY_MAX_SIZE (1024 * 1024)
+
+void bench_assemble(void) {
+	const char *lines[][2] = {
+		{"nop", "nop"},
+		{"immediate", IF32("mov eax, 0x1234", "mov rax, 0x1234")},
+		{"memory operand", IF32("add eax, [ebx + ecx * 4 + 0x10]", "add rax, [rbx + rcx * 8 + 0x10]")},
+		{"three instructions", IF32("mov eax, 1; add eax, 2; imul eax, eax", "mov rax, 1; add rax, 2; imul rax, rax")},
+	};
+
+	uint64_t samples[ASSEMBLE_SAMPLES];
+	for(size_t i = 0; i < ELEMENTS(lines); i++) {
+		char *line = strdup(lines[i][1]);
+		for(size_t j = 0; j < ASSEMBLE_SAMPLES; j++) {
+			unsigned char *assembly;
+			size_t asm_len;
+			uint64_t start = bench_now();
+			assemble_string(line, BITS, 0x1000, &assembly, &asm_len, false);
+			samples[j] = bench_now() - start;
+			free(assembly);
+		}
+		free(line);
+
+		char name[64];
+		snprintf(name, sizeof(name), "assemble %s", lines[i][0]);
+		bench_report(name, samples, ASSEMBLE_SAMPLES, 0);
+	}
+}
+
+// Runs a whole asm_repl with an empty script, from exec to exit
+void bench_startup(const char *self) {
+	uint64_t samples[STARTUP_SAMPLES];
+	for(size_t i = 0; i < STARTUP_SAMPLES; i++) {
+		uint64_t start = bench_now();
+		pid_t pid = fork();
+		if(pid == 0) {
+			int null_fd = open("/dev/null", O_WRONLY);
+			dup2(null_fd, STDOUT_FILENO);
+			execl(self, self, "-c", "", NULL);
+			_exit(1);
+		}
+
+		int status;
+		waitpid(pid, &status, 0);
+		samples[i] = bench_now() - start;
+	}
+
+	bench_report("startup", samples, STARTUP_SAMPLES, 0);
+}
+
+// Writes a nop at pc, resumes the child and waits for it to trap on the int3
+// after it
+void bench_step(task_t task, thread_act_t thread) {
+	static const unsigned char nop = 0x90;
+
+	uint64_t *samples = malloc(STEP_SAMPLES * sizeof(*samples));
+	for(size_t i = 0; i < STEP_SAMPLES; i++) {
+		uint64_t start = bench_now();
+
+		mach_vm_address_t pc = get_pc(thread);
+		mach_vm_address_t address = arena_reserve(task, pc, sizeof(nop), true);
+		if(address != pc) {
+			set_pc(thread, address);
+		}
+		arena_write(task, address, &nop, sizeof(nop), true);
+
+		task_resume(task);
+		wait_for_stop();
+
+		x86_thread_state_t state;
+		get_thread_state(thread, &state);
+
+		samples[i] = bench_now() - start;
+	}
+
+	bench_report("step round trip", samples, STEP_SAMPLES, 0);
+	free(samples);
+}
+
+// Renders to /dev/null, a changing register keeps the highlighting busy
+void bench_print_registers(thread_act_t thread) {
+	x86_thread_state_t state;
+	x86_float_state_t float_state;
+	get_thread_state(thread, &state);
+	get_float_state(thread, &float_state);
+
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+
+	uint64_t *samples = malloc(PRINT_SAMPLES * sizeof(*samples));
+	for(size_t i = 0; i < PRINT_SAMPLES; i++) {
+		state.uts.ts.IF32(__eax, __rax) = i;
+
+		uint64_t start = bench_now();
+		print_registers(&state, &float_state);
+		fflush(stdout);
+		samples[i] = bench_now() - start;
+	}
+
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	close(null_fd);
+
+	bench_report("print_registers", samples, PRINT_SAMPLES, 0);
+	free(samples);
+}
+
+// The kernel calls behind .read and .write
+void bench_memory(task_t task) {
+	mach_vm_address_t address = 0;
+	KERN_FAIL("mach_vm_allocate", mach_vm_allocate(task, &address, MEMORY_MAX_SIZE, VM_FLAGS_ANYWHERE));
+
+	unsigned char *data = calloc(1, MEMORY_MAX_SIZE);
+	uint64_t samples[MEMORY_SAMPLES];
+
+	for(size_t size = 16; size <= MEMORY_MAX_SIZE; size *= 16) {
+		char name[64];
+
+		for(size_t i = 0; i < MEMORY_SAMPLES; i++) {
+			mach_vm_size_t count;
+			uint64_t start = bench_now();
+			KERN_FAIL("mach_vm_read_overwrite", mach_vm_read_overwrite(task, address, size, (mach_vm_address_t)data, &count));
+			samples[i] = bench_now() - start;
+		}
+		snprintf(name, sizeof(name), ".read %zu bytes", size);
+		bench_report(name, samples, MEMORY_SAMPLES, size);
+
+		for(size_t i = 0; i < MEMORY_SAMPLES; i++) {
+			uint64_t start = bench_now();
+			KERN_FAIL("mach_vm_write", mach_vm_write(task, address, (vm_offset_t)data, size));
+			samples[i] = bench_now() - start;
+		}
+		snprintf(name, sizeof(name), ".write %zu bytes", size);
+		bench_report(name, samples, MEMORY_SAMPLES, size);
+	}
+
+	free(data);
+}
+
+// Measures the hot paths of the REPL itself and appends the results to a file
+void run_bench(const char *self, const char *path) {
+	if(!bench_open(path)) {
+		exit(1);
+	}
+
+	bench_assemble();
+	bench_startup(self);
+
+	child_t child;
+	fork_child(&child);
+	thread_act_t thread;
+	task_t task = attach_child(&child, &thread, false);
+
+	// Wait for the first stop
+	wait_for_stop();
+
+	bench_step(task, thread);
+	bench_print_registers(thread);
+	bench_memory(task);
+
+	exit(0);
+}
+
+// Cases that run longer than this are reported as hangs
+#define FUZZ_TIMEOUT_US 100000
+
+#define FUZZ_TIMER 1
+
+bool fuzz_interrupted = false;
+
+void fuzz_sigint_event(void *context, intptr_t count) {
+	fuzz_interrupted = true;
+}
+
+// Stops a case that didn't reach its end in time, like ^C would
+void fuzz_timeout_event(void *context, intptr_t data) {
+	stop_reason = STOP_INTERRUPT;
+	task_suspend(child_task);
+	child_stopped = true;
+}
+
+// Resumes the child at pc and waits for it to stop
+void fuzz_resume(task_t task, thread_act_t thread, mach_vm_address_t pc) {
+	x86_thread_state_t state;
+	get_thread_state(thread, &state);
+	state.uts.ts.pc_register = pc;
+	((x86_flags_t *)&state.uts.ts.flags_register)->TF = false;
+	set_thread_state(thread, &state);
+
+	event_timer(FUZZ_TIMER, FUZZ_TIMEOUT_US, fuzz_timeout_event, NULL);
+	KERN_FAIL("task_resume", task_resume(task));
+	wait_for_stop();
+	event_cancel_timer(FUZZ_TIMER);
+}
+
+// Runs batches of random instruction sequences in the child until interrupted
+// and appends whatever looks wrong to a file
+void run_fuzz(const char *path, const char *corpus) {
+	child_t child;
+	fork_child(&child);
+	thread_act_t thread;
+	task_t task = attach_child(&child, &thread, false);
+
+	// Wait for the first stop
+	wait_for_stop();
+
+	if(!fuzz_init(task, path, corpus)) {
+		exit(1);
+	}
+
+	event_watch_signal(SIGINT, fuzz_sigint_event, NULL);
+
+	while(!fuzz_interrupted) {
+		mach_vm_address_t pc = fuzz_batch(task);
+		while(pc) {
+			fuzz_resume(task, thread, pc);
+
+			fuzz_stop_t kind = FUZZ_TRAP;
+			if(stop_reason == STOP_FAULT) {
+				kind = FUZZ_FAULT;
+			} else if(stop_reason == STOP_INTERRUPT) {
+				kind = FUZZ_HANG;
+			}
+			pc = fuzz_stopped(task, get_pc(thread), kind, fault.exception, fault.code);
+		}
+		fuzz_progress(false);
+	}
+
+	fuzz_progress(true);
+	fputs("\n", stderr);
+	exit(0);
+}
+
+// The child the next request takes control of
+child_t waiting_child;
+
+// A client connected, it is served by a forked worker. The worker starts
+// from the clean state of the daemon, without its event sources.
+void client_event(void *context, intptr_t pending) {
+	int listen_fd = (int)(intptr_t)context;
+	int fd = accept(listen_fd, NULL, NULL);
+	if(fd == -1) {
+		return;
+	}
+
+	pid_t pid = fork();
+	if(pid == 0) {
+		close(listen_fd);
+
+		one_shot = true;
+		script = daemon_read_script(fd);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		daemon_worker_init();
+
+		run_child(&waiting_child);
+	}
+
+	close(fd);
+	close(waiting_child.read_fd);
+	close(waiting_child.write_fd);
+	fork_child(&waiting_child);
+}
+
+// Keeps a forked child waiting so a request only has to take control of it
+void run_daemon(void) {
+	int listen_fd = daemon_listen();
+	if(listen_fd == -1) {
+		exit(1);
+	}
+
+	// Asked for once so the workers don't have to
+	if(geteuid() != 0 && !taskport_auth()) {
+		puts("Failed to get taskport auth!");
+		exit(1);
+	}
+
+	// Neither the children nor the workers are waited for
+	signal(SIGCHLD, SIG_IGN);
+
+	fork_child(&waiting_child);
+	if(!event_watch_fd(listen_fd, client_event, (void *)(intptr_t)listen_fd)) {
+		exit(1);
+	}
+
+	bool done = false;
+	event_run_until(&done);
+}
+
+int main(int argc, const char *argv[]) {
+	startup_mark(NULL);
+
+	bool daemon = false;
+	const char *bench_path = NULL;
+	const char *fuzz_path = NULL;
+	const char *corpus_path = NULL;
+	for(int i = 1; i < argc; i++) {
+		if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			one_shot = true;
+			script = strdup(argv[++i]);
+		} else if(strcmp(argv[i], "-t") == 0) {
+			show_timing = true;
+		} else if(strcmp(argv[i], "--daemon") == 0) {
+			daemon = true;
+		} else if(strcmp(argv[i], "--peer") == 0 && i + 2 < argc) {
+			// Started by .bits of the other architecture
+			peer_init(atoi(argv[i + 1]), atoi(argv[i + 2]));
+			i += 2;
+		} else if(strcmp(argv[i], "--stats") == 0) {
+			atexit(stats_print);
+		} else if(strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+			bench_path = argv[++i];
+		} else if(strcmp(argv[i], "--fuzz") == 0 && i + 1 < argc) {
+			fuzz_path = argv[++i];
+		} else if(strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) {
+			corpus_path = argv[++i];
+		} else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			if(!record_open(argv[++i])) {
+				return 1;
+			}
+			recording = true;
+		} else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			if(!replay_open(argv[++i])) {
+				return 1;
+			}
+			replaying = true;
+		} else {
+			printf("Usage: %s [-t] [--stats] [--record file] [-c snippet | --daemon | --replay file | --bench file | --fuzz file [--corpus file]]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(replaying) {
+		// Only the result of the replay is reported, on stderr
+		freopen("/dev/null", "w", stdout);
+	}
+
+	if(bench_path) {
+		run_bench(argv[0], bench_path);
+	}
+
+	if(fuzz_path) {
+		run_fuzz(fuzz_path, corpus_path);
+	}
+
+	if(daemon) {
+		run_daemon();
+	}
+
+	if(one_shot && !recording) {
+		// A running daemon already has a child waiting
+		int fd = daemon_connect();
+		if(fd != -1) {
+			int status = daemon_request(fd, script);
+			startup_mark("daemon request");
+			return status;
 		}
 	}
 
+	event_watch_signal(SIGINT, sigint_event, NULL);
+
+	child_t child;
+	fork_child(&child);
+	startup_mark("fork");
+
+	run_child(&child);
+
 	return 0;
 }
@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
+#include <ctype.h>
 
 #include "utils.h"
 
@@ -71,3 +73,69 @@ bool assemble_string(char *str, uint8_t bits, uint64_t address, unsigned char **
 
 	return true;
 }
+
+// Checks whether a snippet can't transfer control within itself or to earlier
+// code, i.e. it doesn't define labels or contain branches
+bool is_straight_line(char *str) {
+	static const char *branches[] = {
+		"call", "ret", "loop", "iret", "jecxz", "jrcxz",
+	};
+
+	const char *p = str;
+	while(*p) {
+		while(isspace(*p) || *p == ';') {
+			p++;
+		}
+
+		const char *mnemonic = p;
+		size_t len = 0;
+		while(mnemonic[len] && !isspace(mnemonic[len]) && mnemonic[len] != ';') {
+			len++;
+		}
+
+		if(len > 0) {
+			if(memchr(mnemonic, ':', len) || tolower(mnemonic[0]) == 'j') {
+				return false;
+			}
+
+			for(size_t i = 0; i < sizeof(branches) / sizeof(*branches); i++) {
+				if(strncasecmp(mnemonic, branches[i], strlen(branches[i])) == 0) {
+					return false;
+				}
+			}
+		}
+
+		// Skip the operands
+		p = strchr(p, ';');
+		if(!p) {
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool is_label_char(char c) {
+	return isalnum(c) || c == '_' || c == '.';
+}
+
+// Splits a leading "label:" off a statement
+bool take_label(const char **p, const char **label, size_t *len) {
+	while(isspace(**p)) {
+		(*p)++;
+	}
+
+	size_t i = 0;
+	while(is_label_char((*p)[i])) {
+		i++;
+	}
+
+	if(i == 0 || (*p)[i] != ':') {
+		return false;
+	}
+
+	*label = *p;
+	*len = i;
+	*p += i + 1;
+	return true;
+}
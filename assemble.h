@@ -1 +1,4 @@
 int assemble_string(char *str, uint8_t bits, uint64_t address, unsigned char **output, size_t *output_size, bool att_syntax);
+bool is_straight_line(char *str);
+bool is_label_char(char c);
+bool take_label(const char **p, const char **label, size_t *len);
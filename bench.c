@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+
+#include "arch.h"
+#include "bench.h"
+
+static FILE *results;
+static time_t started;
+
+uint64_t bench_now(void) {
+	static mach_timebase_info_data_t timebase;
+	if(timebase.denom == 0) {
+		mach_timebase_info(&timebase);
+	}
+
+	return mach_absolute_time() * timebase.numer / timebase.denom;
+}
+
+// Results are appended as one JSON object per line, so runs of different
+// versions can be compared
+bool bench_open(const char *path) {
+	results = fopen(path, "a");
+	if(!results) {
+		perror("fopen()");
+		return false;
+	}
+
+	started = time(NULL);
+	printf("%-28s %8s %10s %10s %10s %10s %10s %10s\n", "benchmark", "samples", "min", "median", "mean", "p99", "max", "MB/s");
+	return true;
+}
+
+static int compare(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y? -1: x > y;
+}
+
+static void format_ns(uint64_t ns, char *buf, size_t size) {
+	if(ns < 10000) {
+		snprintf(buf, size, "%" PRIu64 "ns", ns);
+	} else if(ns < 10000000) {
+		snprintf(buf, size, "%.1fus", ns / 1e3);
+	} else {
+		snprintf(buf, size, "%.1fms", ns / 1e6);
+	}
+}
+
+// Sorts the samples and reports their distribution. With bytes set the
+// throughput of the median sample is reported as well.
+void bench_report(const char *name, uint64_t *samples, size_t count, size_t bytes) {
+	qsort(samples, count, sizeof(*samples), compare);
+
+	double mean = 0;
+	for(size_t i = 0; i < count; i++) {
+		mean += samples[i];
+	}
+	mean /= count;
+
+	double variance = 0;
+	for(size_t i = 0; i < count; i++) {
+		variance += (samples[i] - mean) * (samples[i] - mean);
+	}
+	double stddev = sqrt(variance / count);
+
+	uint64_t min = samples[0];
+	uint64_t median = samples[count / 2];
+	uint64_t p99 = samples[count * 99 / 100];
+	uint64_t max = samples[count - 1];
+	double throughput = bytes && median? bytes * 1e3 / median: 0;
+
+	char columns[5][16];
+	format_ns(min, columns[0], sizeof(columns[0]));
+	format_ns(median, columns[1], sizeof(columns[1]));
+	format_ns(mean, columns[2], sizeof(columns[2]));
+	format_ns(p99, columns[3], sizeof(columns[3]));
+	format_ns(max, columns[4], sizeof(columns[4]));
+	printf("%-28s %8zu %10s %10s %10s %10s %10s", name, count, columns[0], columns[1], columns[2], columns[3], columns[4]);
+	if(bytes) {
+		printf(" %10.1f", throughput);
+	}
+	puts("");
+
+	fprintf(results, "{\"time\": %ld, \"arch\": \"%s\", \"name\": \"%s\", \"samples\": %zu, \"min_ns\": %" PRIu64 ", \"median_ns\": %" PRIu64 ", \"mean_ns\": %.0f, \"p99_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 ", \"stddev_ns\": %.0f", (long)started, ARCH_NAME, name, count, min, median, mean, p99, max, stddev);
+	if(bytes) {
+		fprintf(results, ", \"bytes\": %zu, \"mb_per_s\": %.1f", bytes, throughput);
+	}
+	fprintf(results, "}\n");
+	fflush(results);
+}
@@ -0,0 +1,3 @@
+uint64_t bench_now(void);
+bool bench_open(const char *path);
+void bench_report(const char *name, uint64_t *samples, size_t count, size_t bytes);
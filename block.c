@@ -0,0 +1,354 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <mach/mach.h>
+
+#include "assemble.h"
+#include "block.h"
+
+#define MAX_PASSES 16
+#define NOP 0x90
+
+typedef struct {
+	char *name;
+	mach_vm_address_t address;
+} label_t;
+
+// Labels of the code written to the arena so far, later snippets can branch
+// to them
+static label_t *labels;
+static size_t label_count;
+
+// Labels of the last assembled snippet, only added once it is written
+static label_t *pending;
+static size_t pending_count;
+
+// Statements that are assembled together. Labels can only be defined at the
+// start of a chunk, so their address is known from the size of the chunks
+// before them.
+typedef struct {
+	char **labels;
+	size_t label_count;
+	char *text;
+
+	mach_vm_address_t address;
+	unsigned char *bytes;
+	size_t len;
+
+	// What the bytes were assembled from
+	char *assembled;
+	mach_vm_address_t assembled_address;
+} chunk_t;
+
+static bool find_label(const label_t *list, size_t count, const char *name, size_t len, mach_vm_address_t *address) {
+	for(size_t i = 0; i < count; i++) {
+		if(strlen(list[i].name) == len && strncmp(list[i].name, name, len) == 0) {
+			*address = list[i].address;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool find_local_label(const chunk_t *chunks, size_t count, const char *name, size_t len, mach_vm_address_t *address) {
+	for(size_t i = 0; i < count; i++) {
+		for(size_t j = 0; j < chunks[i].label_count; j++) {
+			if(strlen(chunks[i].labels[j]) == len && strncmp(chunks[i].labels[j], name, len) == 0) {
+				*address = chunks[i].address;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+static void append(char **str, size_t *len, const char *add, size_t add_len) {
+	*str = realloc(*str, *len + add_len + 1);
+	memcpy(*str + *len, add, add_len);
+	*len += add_len;
+	(*str)[*len] = '\0';
+}
+
+static chunk_t *split_chunks(const char *code, size_t *count) {
+	chunk_t *chunks = calloc(1, sizeof(*chunks));
+	*count = 1;
+
+	const char *p = code;
+	while(*p) {
+		const char *end = strchr(p, ';');
+		if(!end) {
+			end = p + strlen(p);
+		}
+
+		char *statement = strndup(p, end - p);
+		const char *rest = statement;
+		const char *label;
+		size_t label_len;
+
+		while(take_label(&rest, &label, &label_len)) {
+			chunk_t *c = &chunks[*count - 1];
+			if(c->text) {
+				chunks = realloc(chunks, (*count + 1) * sizeof(*chunks));
+				c = &chunks[(*count)++];
+				memset(c, 0, sizeof(*c));
+			}
+
+			c->labels = realloc(c->labels, (c->label_count + 1) * sizeof(*c->labels));
+			c->labels[c->label_count++] = strndup(label, label_len);
+		}
+
+		while(isspace(*rest)) {
+			rest++;
+		}
+
+		if(*rest) {
+			chunk_t *c = &chunks[*count - 1];
+			size_t len = c->text? strlen(c->text): 0;
+			if(c->text) {
+				append(&c->text, &len, "; ", 2);
+			}
+			append(&c->text, &len, rest, strlen(rest));
+		}
+
+		free(statement);
+		p = *end? end + 1: end;
+	}
+
+	return chunks;
+}
+
+static void free_chunks(chunk_t *chunks, size_t count) {
+	for(size_t i = 0; i < count; i++) {
+		for(size_t j = 0; j < chunks[i].label_count; j++) {
+			free(chunks[i].labels[j]);
+		}
+		free(chunks[i].labels);
+		free(chunks[i].text);
+		free(chunks[i].bytes);
+		free(chunks[i].assembled);
+	}
+	free(chunks);
+}
+
+// Replaces label operands with the address of the label in the current layout.
+// Mnemonics and registers are never replaced, even if a label has their name.
+// earlier is set when a label of an earlier snippet was replaced.
+static char *substitute(const char *text, const chunk_t *chunks, size_t count, bool *replaced, bool *earlier) {
+	char *result = NULL;
+	size_t len = 0;
+	append(&result, &len, "", 0);
+
+	bool mnemonic = true;
+	const char *p = text;
+	while(*p) {
+		if(*p == ';') {
+			mnemonic = true;
+		}
+
+		bool identifier = isalpha(*p) || *p == '_' || *p == '.';
+		if(!identifier || (p != text && (is_label_char(p[-1]) || p[-1] == '%'))) {
+			append(&result, &len, p, 1);
+			p++;
+			continue;
+		}
+
+		size_t name_len = 0;
+		while(is_label_char(p[name_len])) {
+			name_len++;
+		}
+
+		mach_vm_address_t address;
+		bool local = !mnemonic && find_local_label(chunks, count, p, name_len, &address);
+		if(!mnemonic && (local || find_label(labels, label_count, p, name_len, &address))) {
+			char number[32];
+			int number_len = snprintf(number, sizeof(number), "0x%llx", address);
+			append(&result, &len, number, number_len);
+			*replaced = true;
+			*earlier = *earlier || !local;
+		} else {
+			append(&result, &len, p, name_len);
+		}
+
+		mnemonic = false;
+		p += name_len;
+	}
+
+	return result;
+}
+
+static void layout(chunk_t *chunks, size_t count, mach_vm_address_t address) {
+	for(size_t i = 0; i < count; i++) {
+		chunks[i].address = address;
+		address += chunks[i].len;
+	}
+}
+
+// Assembles every chunk at its address until no chunk changes its size. Sizes
+// only ever grow, a shorter encoding is padded with nops, so this converges.
+static bool relax(chunk_t *chunks, size_t count, uint8_t bits, mach_vm_address_t address) {
+	for(int pass = 0; pass < MAX_PASSES; pass++) {
+		layout(chunks, count, address);
+
+		bool changed = false;
+		for(size_t i = 0; i < count; i++) {
+			chunk_t *c = &chunks[i];
+			if(!c->text) {
+				continue;
+			}
+
+			bool replaced = false;
+			bool earlier = false;
+			char *text = substitute(c->text, chunks, count, &replaced, &earlier);
+			if(c->assembled && c->assembled_address == c->address && strcmp(text, c->assembled) == 0) {
+				free(text);
+				continue;
+			}
+
+			unsigned char *bytes;
+			size_t len;
+			if(!assemble_string(text, bits, c->address, &bytes, &len, false)) {
+				free(bytes);
+				free(text);
+				return false;
+			}
+
+			if(len < c->len) {
+				bytes = realloc(bytes, c->len);
+				memset(bytes + len, NOP, c->len - len);
+				len = c->len;
+			}
+
+			changed = changed || len != c->len;
+
+			free(c->bytes);
+			free(c->assembled);
+			c->bytes = bytes;
+			c->len = len;
+			c->assembled = text;
+			c->assembled_address = c->address;
+		}
+
+		if(!changed) {
+			return true;
+		}
+	}
+
+	puts("The addresses of the labels didn't converge.");
+	return false;
+}
+
+static void clear_pending(void) {
+	for(size_t i = 0; i < pending_count; i++) {
+		free(pending[i].name);
+	}
+	free(pending);
+	pending = NULL;
+	pending_count = 0;
+}
+
+// Assembles a snippet of one or more statements that may define labels and
+// branch to them or to the labels of earlier snippets. Snippets without any
+// labels are assembled in one go. In at&t syntax the assembler resolves the
+// labels of the snippet itself, as it isn't told the address, so labels of
+// earlier snippets can't be used.
+bool block_assemble(char *code, uint8_t bits, mach_vm_address_t address, unsigned char **output, size_t *output_size, bool att_syntax) {
+	clear_pending();
+
+	size_t count;
+	chunk_t *chunks = split_chunks(code, &count);
+
+	bool replaced = false;
+	bool earlier = false;
+	for(size_t i = 0; i < count; i++) {
+		if(chunks[i].text) {
+			free(substitute(chunks[i].text, chunks, count, &replaced, &earlier));
+		}
+	}
+
+	if(att_syntax) {
+		free_chunks(chunks, count);
+		if(earlier) {
+			puts("Labels of earlier snippets can only be used with the intel syntax.");
+			*output = NULL;
+			*output_size = 0;
+			return false;
+		}
+		return assemble_string(code, bits, address, output, output_size, att_syntax);
+	}
+
+	if(count == 1 && chunks[0].label_count == 0 && !replaced) {
+		free_chunks(chunks, count);
+		return assemble_string(code, bits, address, output, output_size, att_syntax);
+	}
+
+	if(!relax(chunks, count, bits, address)) {
+		free_chunks(chunks, count);
+		*output = NULL;
+		return false;
+	}
+
+	*output_size = 0;
+	*output = NULL;
+	for(size_t i = 0; i < count; i++) {
+		chunk_t *c = &chunks[i];
+		*output = realloc(*output, *output_size + c->len);
+		memcpy(*output + *output_size, c->bytes, c->len);
+		*output_size += c->len;
+
+		for(size_t j = 0; j < c->label_count; j++) {
+			pending = realloc(pending, (pending_count + 1) * sizeof(*pending));
+			pending[pending_count++] = (label_t){strdup(c->labels[j]), c->address};
+		}
+	}
+
+	free_chunks(chunks, count);
+	return *output_size != 0;
+}
+
+// Makes the labels of the last assembled snippet available to later ones,
+// except those generated by asm_repl itself
+void block_commit_labels(void) {
+	for(size_t i = 0; i < pending_count; i++) {
+		if(strncmp(pending[i].name, BLOCK_INTERNAL_LABEL, strlen(BLOCK_INTERNAL_LABEL)) == 0) {
+			continue;
+		}
+
+		size_t j;
+		for(j = 0; j < label_count; j++) {
+			if(strcmp(labels[j].name, pending[i].name) == 0) {
+				break;
+			}
+		}
+
+		if(j == label_count) {
+			labels = realloc(labels, (label_count + 1) * sizeof(*labels));
+			labels[label_count++].name = strdup(pending[i].name);
+		}
+		labels[j].address = pending[i].address;
+	}
+
+	clear_pending();
+}
+
+// The code the labels pointed to is gone after .reset
+void block_forget_labels(void) {
+	for(size_t i = 0; i < label_count; i++) {
+		free(labels[i].name);
+	}
+	free(labels);
+	labels = NULL;
+	label_count = 0;
+
+	clear_pending();
+}
+
+void block_list_labels(void) {
+	for(size_t i = 0; i < label_count; i++) {
+		printf("%s = 0x%llx\n", labels[i].name, labels[i].address);
+	}
+}
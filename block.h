@@ -0,0 +1,7 @@
+// Labels of generated code stay local to their snippet
+#define BLOCK_INTERNAL_LABEL "asm_repl_"
+
+bool block_assemble(char *code, uint8_t bits, mach_vm_address_t address, unsigned char **output, size_t *output_size, bool att_syntax);
+void block_commit_labels(void);
+void block_forget_labels(void);
+void block_list_labels(void);
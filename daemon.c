@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+// The output of a worker ends with a NUL and its exit status, which printed
+// text doesn't contain
+#define TRAILER_SIZE 2
+
+static void socket_address(struct sockaddr_un *address) {
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	snprintf(address->sun_path, sizeof(address->sun_path), "%s/%s", getenv("HOME"), ".asm_repl.sock");
+}
+
+int daemon_listen(void) {
+	struct sockaddr_un address;
+	socket_address(&address);
+
+	int running = daemon_connect();
+	if(running != -1) {
+		close(running);
+		printf("A daemon is already listening on %s\n", address.sun_path);
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1) {
+		perror("socket()");
+		return -1;
+	}
+
+	// A daemon that exited without cleaning up leaves the socket behind
+	unlink(address.sun_path);
+
+	if(bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 16) != 0) {
+		perror("bind()");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// Returns -1 when no daemon is running
+int daemon_connect(void) {
+	struct sockaddr_un address;
+	socket_address(&address);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1) {
+		return -1;
+	}
+
+	if(connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool write_all(int fd, const char *buf, size_t len) {
+	while(len > 0) {
+		ssize_t written = write(fd, buf, len);
+		if(written <= 0) {
+			return false;
+		}
+		buf += written;
+		len -= written;
+	}
+
+	return true;
+}
+
+// Sends a script to the daemon and copies everything it prints to stdout.
+// Returns the exit status of the worker, which ends the output with it.
+int daemon_request(int fd, const char *script) {
+	if(!write_all(fd, script, strlen(script))) {
+		close(fd);
+		return 1;
+	}
+	shutdown(fd, SHUT_WR);
+
+	// The last bytes read so far may be the trailer, so they are held back
+	char buf[4096];
+	size_t held = 0;
+	ssize_t len;
+	while((len = read(fd, buf + held, sizeof(buf) - held)) > 0) {
+		size_t total = held + len;
+		held = total < TRAILER_SIZE? total: TRAILER_SIZE;
+		write_all(STDOUT_FILENO, buf, total - held);
+		memmove(buf, buf + total - held, held);
+	}
+	close(fd);
+
+	// A worker that crashed never sent one
+	if(len != 0 || held != TRAILER_SIZE || buf[0] != '\0') {
+		write_all(STDOUT_FILENO, buf, held);
+		return 1;
+	}
+	return (unsigned char)buf[1];
+}
+
+static bool worker = false;
+static bool replied = false;
+
+// Ends the output of a worker with its exit status. Anything printed after
+// that, e.g. by other atexit handlers, doesn't reach the client.
+void daemon_reply(int status) {
+	if(!worker || replied) {
+		return;
+	}
+	replied = true;
+
+	fflush(stdout);
+	fflush(stderr);
+	char trailer[TRAILER_SIZE] = {'\0', status};
+	write_all(STDOUT_FILENO, trailer, sizeof(trailer));
+	freopen("/dev/null", "w", stdout);
+	freopen("/dev/null", "w", stderr);
+}
+
+static void reply_failure(void) {
+	daemon_reply(1);
+}
+
+// Called by a worker once its output goes to the client. Only a script that
+// ran to its end replies with success, every other exit is a failure.
+void daemon_worker_init(void) {
+	worker = true;
+	atexit(reply_failure);
+}
+
+// Reads the script of a request, the client closes its end when it is done
+char *daemon_read_script(int fd) {
+	size_t len = 0;
+	size_t capacity = 256;
+	char *script = malloc(capacity);
+
+	ssize_t n;
+	while((n = read(fd, script + len, capacity - len - 1)) > 0) {
+		len += n;
+		if(capacity - len - 1 == 0) {
+			capacity *= 2;
+			script = realloc(script, capacity);
+		}
+	}
+
+	script[len] = '\0';
+	return script;
+}
@@ -0,0 +1,6 @@
+int daemon_listen(void);
+int daemon_connect(void);
+int daemon_request(int fd, const char *script);
+void daemon_reply(int status);
+void daemon_worker_init(void);
+char *daemon_read_script(int fd);
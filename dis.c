@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+#include <capstone/capstone.h>
+
+#include "arch.h"
+#include "colors.h"
+#include "dis.h"
+#include "macros.h"
+
+#define MAX_INSN_SIZE 15
+// Longer instructions push the text further right
+#define BYTES_COLUMN 10
+
+// Direct-mapped, an address only ever lives in one slot
+#define CACHE_SLOTS 4096
+#define CACHE_SLOT(a) (((a) ^ ((a) >> 12)) & (CACHE_SLOTS - 1))
+
+typedef struct {
+	bool valid;
+	bool att;
+	mach_vm_address_t address;
+	uint8_t size;
+	uint8_t bytes[MAX_INSN_SIZE];
+	char text[96];
+} dis_entry_t;
+
+static dis_entry_t cache[CACHE_SLOTS];
+
+static csh handle;
+static cs_insn *insn;
+static bool opened = false;
+static bool handle_att = false;
+
+static bool open_handle(bool att) {
+	if(!opened) {
+		cs_err err = cs_open(CS_ARCH_X86, IF32(CS_MODE_32, CS_MODE_64), &handle);
+		if(err != CS_ERR_OK) {
+			printf("cs_open() failed: %s\n", cs_strerror(err));
+			return false;
+		}
+		insn = cs_malloc(handle);
+		opened = true;
+	}
+
+	if(att != handle_att) {
+		cs_option(handle, CS_OPT_SYNTAX, att? CS_OPT_SYNTAX_ATT: CS_OPT_SYNTAX_INTEL);
+		handle_att = att;
+	}
+
+	return true;
+}
+
+// Decodes the instruction at the start of code, from the cache if the bytes
+// it was decoded from are still the same
+static const dis_entry_t *decode(mach_vm_address_t address, const uint8_t *code, size_t size, bool att) {
+	dis_entry_t *entry = &cache[CACHE_SLOT(address)];
+	if(entry->valid && entry->address == address && entry->att == att && entry->size <= size && memcmp(entry->bytes, code, entry->size) == 0) {
+		return entry;
+	}
+
+	if(!open_handle(att)) {
+		return NULL;
+	}
+
+	uint64_t insn_address = address;
+	if(!cs_disasm_iter(handle, &code, &size, &insn_address, insn)) {
+		return NULL;
+	}
+
+	entry->valid = true;
+	entry->att = att;
+	entry->address = address;
+	entry->size = insn->size;
+	memcpy(entry->bytes, insn->bytes, insn->size);
+	snprintf(entry->text, sizeof(entry->text), "%s%s%s", insn->mnemonic, insn->op_str[0]? " ": "", insn->op_str);
+	return entry;
+}
+
+// Reads up to len bytes of code, less if the range runs into an unmapped page
+static bool read_code(task_t task, mach_vm_address_t address, uint8_t *code, mach_vm_size_t len, mach_vm_size_t *read) {
+	if(KERN_CALL("mach_vm_read_overwrite", mach_vm_read_overwrite(task, address, len, (mach_vm_address_t)code, read)) == KERN_SUCCESS) {
+		return true;
+	}
+
+	mach_vm_size_t page_len = vm_page_size - address % vm_page_size;
+	return page_len < len && KERN_CALL("mach_vm_read_overwrite", mach_vm_read_overwrite(task, address, page_len, (mach_vm_address_t)code, read)) == KERN_SUCCESS;
+}
+
+static void print_entry(const dis_entry_t *entry) {
+	printf(KGRN "%" PRIX64 ":" RESET " ", (uint64_t)entry->address);
+	for(size_t i = 0; i < entry->size; i++) {
+		printf("%02x", entry->bytes[i]);
+	}
+	printf("%*s %s\n", entry->size < BYTES_COLUMN? 2 * (BYTES_COLUMN - entry->size): 0, "", entry->text);
+}
+
+// Disassembles count instructions starting at address. Returns the amount of
+// instructions that could be decoded.
+size_t dis_print(task_t task, mach_vm_address_t address, size_t count, bool att) {
+	size_t len = count * MAX_INSN_SIZE;
+	uint8_t *code = malloc(len);
+
+	mach_vm_size_t read;
+	if(!read_code(task, address, code, len, &read)) {
+		printf("Failed to read memory at 0x%llx\n", address);
+		free(code);
+		return 0;
+	}
+
+	size_t decoded = 0;
+	size_t offset = 0;
+	while(decoded < count && offset < read) {
+		const dis_entry_t *entry = decode(address + offset, code + offset, read - offset, att);
+		if(!entry) {
+			printf(KGRN "%" PRIX64 ":" RESET " %02x%*s (bad)\n", (uint64_t)(address + offset), code[offset], 2 * (BYTES_COLUMN - 1), "");
+			offset++;
+		} else {
+			print_entry(entry);
+			offset += entry->size;
+		}
+		decoded++;
+	}
+
+	free(code);
+	return decoded;
+}
+
+// Describes the instruction at address, unless it is an int3
+bool dis_describe(task_t task, mach_vm_address_t address, bool att, char *buf, size_t size) {
+	uint8_t code[MAX_INSN_SIZE];
+	mach_vm_size_t read;
+	if(!read_code(task, address, code, sizeof(code), &read) || code[0] == 0xCC) {
+		return false;
+	}
+
+	const dis_entry_t *entry = decode(address, code, read, att);
+	if(!entry) {
+		return false;
+	}
+
+	snprintf(buf, size, "%s", entry->text);
+	return true;
+}
+
+// Describes the instruction that ends at address, e.g. the one that hit a
+// data watchpoint. x86 can't be decoded backwards, so instructions are decoded
+// from every start up to MAX_INSN_SIZE bytes before and the first sequence
+// that ends exactly at address is taken, as they tend to fall into step.
+bool dis_describe_before(task_t task, mach_vm_address_t address, bool att, char *buf, size_t size) {
+	uint8_t code[MAX_INSN_SIZE];
+	mach_vm_size_t len = address < MAX_INSN_SIZE? address: MAX_INSN_SIZE;
+	mach_vm_size_t read;
+	if(KERN_CALL("mach_vm_read_overwrite", mach_vm_read_overwrite(task, address - len, len, (mach_vm_address_t)code, &read)) != KERN_SUCCESS) {
+		// The page before may not be mapped
+		mach_vm_size_t in_page = (address - 1) % vm_page_size + 1;
+		len = in_page < len? in_page: len;
+		if(KERN_CALL("mach_vm_read_overwrite", mach_vm_read_overwrite(task, address - len, len, (mach_vm_address_t)code, &read)) != KERN_SUCCESS) {
+			return false;
+		}
+	}
+
+	mach_vm_address_t start = address - len;
+	for(size_t first = 0; first < len; first++) {
+		const dis_entry_t *last = NULL;
+		size_t offset = first;
+		while(offset < len) {
+			last = decode(start + offset, code + offset, len - offset, att);
+			if(!last) {
+				break;
+			}
+			offset += last->size;
+		}
+
+		if(last && offset == len) {
+			snprintf(buf, size, "%s", last->text);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Called by every path that writes to the child, so decoded instructions
+// overlapping the range are dropped
+void dis_invalidate(mach_vm_address_t address, size_t len) {
+	if(len >= CACHE_SLOTS) {
+		memset(cache, 0, sizeof(cache));
+		return;
+	}
+
+	// Instructions starting up to MAX_INSN_SIZE - 1 bytes before may overlap
+	mach_vm_address_t start = address >= MAX_INSN_SIZE - 1? address - (MAX_INSN_SIZE - 1): 0;
+	for(mach_vm_address_t a = start; a < address + len; a++) {
+		dis_entry_t *entry = &cache[CACHE_SLOT(a)];
+		if(entry->valid && entry->address == a && a + entry->size > address) {
+			entry->valid = false;
+		}
+	}
+}
@@ -0,0 +1,4 @@
+size_t dis_print(task_t task, mach_vm_address_t address, size_t count, bool att);
+bool dis_describe(task_t task, mach_vm_address_t address, bool att, char *buf, size_t size);
+bool dis_describe_before(task_t task, mach_vm_address_t address, bool att, char *buf, size_t size);
+void dis_invalidate(mach_vm_address_t address, size_t len);
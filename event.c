@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/event.h>
+#include <mach/mach.h>
+
+#include "event.h"
+#include "macros.h"
+
+// Every wait of asm_repl goes through one kqueue, so stops of the child,
+// signals, the terminal and other processes are handled one at a time on the
+// main thread, in the order they happened
+#define MAX_SOURCES 32
+
+typedef struct {
+	int16_t filter;
+	uintptr_t ident;
+	event_callback_t callback;
+	void *context;
+} source_t;
+
+static source_t sources[MAX_SOURCES];
+static int kq = -1;
+static pid_t kq_pid = -1;
+
+// A forked process doesn't inherit the kqueue, it starts without sources
+static int queue(void) {
+	if(kq_pid != getpid()) {
+		kq = kqueue();
+		if(kq == -1) {
+			perror("kqueue()");
+			exit(1);
+		}
+		kq_pid = getpid();
+		memset(sources, 0, sizeof(sources));
+	}
+
+	return kq;
+}
+
+static source_t *find(int16_t filter, uintptr_t ident) {
+	for(size_t i = 0; i < MAX_SOURCES; i++) {
+		if(sources[i].callback && sources[i].filter == filter && sources[i].ident == ident) {
+			return &sources[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Adds a source or changes the callback of one that is already watched
+static bool watch(int16_t filter, uintptr_t ident, uint32_t fflags, intptr_t data, uint16_t flags, event_callback_t callback, void *context) {
+	int q = queue();
+
+	source_t *source = find(filter, ident);
+	for(size_t i = 0; !source && i < MAX_SOURCES; i++) {
+		if(!sources[i].callback) {
+			source = &sources[i];
+		}
+	}
+	if(!source) {
+		puts("Too many event sources.");
+		return false;
+	}
+
+	struct kevent change;
+	EV_SET(&change, ident, filter, EV_ADD | flags, fflags, data, source);
+	if(kevent(q, &change, 1, NULL, 0, NULL) == -1) {
+		perror("kevent()");
+		return false;
+	}
+
+	*source = (source_t){
+		.filter = filter,
+		.ident = ident,
+		.callback = callback,
+		.context = context,
+	};
+	return true;
+}
+
+static void unwatch(int16_t filter, uintptr_t ident) {
+	source_t *source = find(filter, ident);
+	if(!source) {
+		return;
+	}
+
+	struct kevent change;
+	EV_SET(&change, ident, filter, EV_DELETE, 0, 0, NULL);
+	kevent(queue(), &change, 1, NULL, 0, NULL);
+	source->callback = NULL;
+}
+
+bool event_watch_fd(int fd, event_callback_t callback, void *context) {
+	return watch(EVFILT_READ, fd, 0, 0, 0, callback, context);
+}
+
+void event_unwatch_fd(int fd) {
+	unwatch(EVFILT_READ, fd);
+}
+
+// The signal is ignored, so it only shows up as an event
+bool event_watch_signal(int sig, event_callback_t callback, void *context) {
+	signal(sig, SIG_IGN);
+	return watch(EVFILT_SIGNAL, sig, 0, 0, 0, callback, context);
+}
+
+// Calls back once the process exits. Only its parent may ask for the exit
+// status, which a daemon worker isn't for the child it takes over.
+bool event_watch_process(pid_t pid, event_callback_t callback, void *context) {
+	return watch(EVFILT_PROC, pid, NOTE_EXIT, 0, EV_ONESHOT, callback, context);
+}
+
+// Calls back when the port has a message, which the callback receives.
+// kqueue only watches port sets, so the port gets one of its own.
+bool event_watch_port(mach_port_t port, event_callback_t callback, void *context) {
+	mach_port_t set;
+	KERN_TRY("mach_port_allocate", mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_PORT_SET, &set), {
+		return false;
+	});
+	KERN_TRY("mach_port_insert_member", mach_port_insert_member(mach_task_self(), port, set), {
+		mach_port_mod_refs(mach_task_self(), set, MACH_PORT_RIGHT_PORT_SET, -1);
+		return false;
+	});
+
+	return watch(EVFILT_MACHPORT, set, 0, 0, 0, callback, context);
+}
+
+// Calls back once after us microseconds, unless it is cancelled before
+bool event_timer(uintptr_t id, uint64_t us, event_callback_t callback, void *context) {
+	return watch(EVFILT_TIMER, id, NOTE_USECONDS, us, EV_ONESHOT, callback, context);
+}
+
+void event_cancel_timer(uintptr_t id) {
+	unwatch(EVFILT_TIMER, id);
+}
+
+// Handles events until one of them sets done. Events are taken one at a
+// time, so a callback that removes a source never sees a stale event of it.
+void event_run_until(const bool *done) {
+	int q = queue();
+	while(!*done) {
+		struct kevent event;
+		int n = kevent(q, NULL, 0, &event, 1, NULL);
+		if(n == -1 && errno == EINTR) {
+			continue;
+		} else if(n == -1) {
+			perror("kevent()");
+			exit(1);
+		} else if(n == 0) {
+			continue;
+		}
+
+		source_t *source = event.udata;
+		if(!source->callback) {
+			continue;
+		}
+
+		event_callback_t callback = source->callback;
+		void *context = source->context;
+		// The kernel already forgot a one shot source
+		if(event.filter == EVFILT_TIMER || event.filter == EVFILT_PROC) {
+			source->callback = NULL;
+		}
+		callback(context, event.data);
+	}
+}
@@ -0,0 +1,12 @@
+// Called on the main thread with the data of the event: the bytes that can
+// be read or how often a signal arrived
+typedef void (*event_callback_t)(void *context, intptr_t data);
+
+bool event_watch_fd(int fd, event_callback_t callback, void *context);
+void event_unwatch_fd(int fd);
+bool event_watch_signal(int sig, event_callback_t callback, void *context);
+bool event_watch_process(pid_t pid, event_callback_t callback, void *context);
+bool event_watch_port(mach_port_t port, event_callback_t callback, void *context);
+bool event_timer(uintptr_t id, uint64_t us, event_callback_t callback, void *context);
+void event_cancel_timer(uintptr_t id);
+void event_run_until(const bool *done);
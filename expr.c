@@ -0,0 +1,339 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+
+#include "arch.h"
+#include "alloc.h"
+#include "expr.h"
+#include "macros.h"
+#include "registers.h"
+#include "status_flags.h"
+
+#define EXPR_MAX_DEPTH 32
+
+typedef struct {
+	const char *p;
+	const char *error;
+
+	expr_insn_t *code;
+	size_t len;
+	size_t capacity;
+
+	size_t depth;
+	size_t max_depth;
+} parser_t;
+
+static void emit(parser_t *parser, expr_op op, uint64_t arg) {
+	if(parser->len == parser->capacity) {
+		parser->capacity = parser->capacity? 2 * parser->capacity: 16;
+		parser->code = realloc(parser->code, parser->capacity * sizeof(*parser->code));
+	}
+
+	parser->code[parser->len++] = (expr_insn_t){op, arg};
+
+	// Keep track of the evaluation stack so it can be a fixed size array
+	if(op == OP_CONST || op == OP_REG || op == OP_FLAG) {
+		parser->depth++;
+		if(parser->depth > parser->max_depth) {
+			parser->max_depth = parser->depth;
+		}
+	} else if(op >= OP_ADD) {
+		parser->depth--;
+	}
+}
+
+static void skip_space(parser_t *parser) {
+	while(isspace(*parser->p)) {
+		parser->p++;
+	}
+}
+
+static bool accept(parser_t *parser, const char *token) {
+	skip_space(parser);
+
+	size_t len = strlen(token);
+	if(strncmp(parser->p, token, len) != 0) {
+		return false;
+	}
+
+	// Don't take the first character of a two character operator
+	if(len == 1 && parser->p[1] != '\0' && strchr("<>=&|", token[0]) && (parser->p[1] == token[0] || parser->p[1] == '=')) {
+		return false;
+	}
+
+	parser->p += len;
+	return true;
+}
+
+static bool lookup_register(const char *name, size_t len, size_t *offset) {
+#define X(r) do { \
+	if(strlen(#r) == len && strncmp(name, #r, len) == 0) { \
+		*offset = offsetof(x86_thread_state_t, uts.ts.__ ## r); \
+		return true; \
+	} \
+} while(false)
+	FOREACH_REGISTER(X)
+#undef X
+
+	return false;
+}
+
+static bool lookup_flag(const char *name, size_t len, uint64_t *mask) {
+#define X(f) do { \
+	if(strlen(#f) == len && strncmp(name, #f, len) == 0) { \
+		x86_flags_t flags = {0}; \
+		flags.f = 1; \
+		*mask = flags.rflags; \
+		return true; \
+	} \
+} while(false)
+	FOREACH_STATUS_FLAG(X)
+#undef X
+
+	return false;
+}
+
+static void parse_expr(parser_t *parser);
+
+static void parse_primary(parser_t *parser) {
+	skip_space(parser);
+
+	const char *p = parser->p;
+
+	if(accept(parser, "(")) {
+		parse_expr(parser);
+		if(!accept(parser, ")")) {
+			parser->error = "expected ')'";
+		}
+		return;
+	}
+
+	if(accept(parser, "[")) {
+		parse_expr(parser);
+		emit(parser, OP_DEREF, 0);
+		if(!accept(parser, "]")) {
+			parser->error = "expected ']'";
+		}
+		return;
+	}
+
+	if(isdigit(*p)) {
+		char *end;
+		uint64_t value = strtoull(p, &end, 0);
+		if(isalnum(*end) || *end == '_') {
+			parser->error = "invalid number";
+			return;
+		}
+		emit(parser, OP_CONST, value);
+		parser->p = end;
+		return;
+	}
+
+	bool variable = *p == '$';
+	if(variable) {
+		p++;
+	}
+
+	size_t len = 0;
+	while(isalnum(p[len]) || p[len] == '_') {
+		len++;
+	}
+
+	if(len == 0) {
+		parser->error = "expected a number, register or $name";
+		return;
+	}
+
+	size_t offset;
+	uint64_t value;
+	if(variable) {
+		mach_vm_address_t address;
+		if(!alloc_lookup(p, len, &address)) {
+			parser->error = "unknown $name";
+			return;
+		}
+		emit(parser, OP_CONST, address);
+	} else if(lookup_register(p, len, &offset)) {
+		emit(parser, OP_REG, offset);
+	} else if(lookup_flag(p, len, &value)) {
+		emit(parser, OP_FLAG, value);
+	} else {
+		parser->error = "unknown register";
+		return;
+	}
+
+	parser->p = p + len;
+}
+
+static void parse_unary(parser_t *parser) {
+	if(accept(parser, "-")) {
+		parse_unary(parser);
+		emit(parser, OP_NEG, 0);
+	} else if(accept(parser, "~")) {
+		parse_unary(parser);
+		emit(parser, OP_NOT, 0);
+	} else if(accept(parser, "!")) {
+		parse_unary(parser);
+		emit(parser, OP_LNOT, 0);
+	} else {
+		parse_primary(parser);
+	}
+}
+
+typedef struct {
+	const char *token;
+	expr_op op;
+} binary_op_t;
+
+// Binary operators from the lowest to the highest precedence
+static const binary_op_t precedence[][5] = {
+	{{"||", OP_LOR}},
+	{{"&&", OP_LAND}},
+	{{"|", OP_OR}},
+	{{"^", OP_XOR}},
+	{{"&", OP_AND}},
+	{{"==", OP_EQ}, {"!=", OP_NE}},
+	{{"<=", OP_LE}, {">=", OP_GE}, {"<", OP_LT}, {">", OP_GT}},
+	{{"<<", OP_SHL}, {">>", OP_SHR}},
+	{{"+", OP_ADD}, {"-", OP_SUB}},
+	{{"*", OP_MUL}, {"/", OP_DIV}, {"%", OP_MOD}},
+};
+
+static void parse_binary(parser_t *parser, size_t level) {
+	if(level == sizeof(precedence) / sizeof(*precedence)) {
+		parse_unary(parser);
+		return;
+	}
+
+	parse_binary(parser, level + 1);
+
+	while(!parser->error) {
+		const binary_op_t *matched = NULL;
+		for(const binary_op_t *op = precedence[level]; op->token; op++) {
+			if(accept(parser, op->token)) {
+				matched = op;
+				break;
+			}
+		}
+
+		if(!matched) {
+			break;
+		}
+
+		parse_binary(parser, level + 1);
+		emit(parser, matched->op, 0);
+	}
+}
+
+static void parse_expr(parser_t *parser) {
+	parse_binary(parser, 0);
+}
+
+expr_t *expr_compile(const char *str, const char **error) {
+	parser_t parser = {
+		.p = str,
+	};
+
+	parse_expr(&parser);
+	skip_space(&parser);
+
+	if(!parser.error && *parser.p != '\0') {
+		parser.error = "unexpected character";
+	}
+
+	if(!parser.error && parser.max_depth > EXPR_MAX_DEPTH) {
+		parser.error = "expression is too deep";
+	}
+
+	if(parser.error) {
+		*error = parser.error;
+		free(parser.code);
+		return NULL;
+	}
+
+	expr_t *expr = malloc(sizeof(*expr));
+	expr->code = parser.code;
+	expr->len = parser.len;
+	expr->source = strdup(str);
+	return expr;
+}
+
+void expr_free(expr_t *expr) {
+	if(expr) {
+		free(expr->code);
+		free(expr->source);
+		free(expr);
+	}
+}
+
+bool expr_eval(const expr_t *expr, task_t task, const x86_thread_state_t *state, uint64_t *result) {
+	uint64_t stack[EXPR_MAX_DEPTH];
+	size_t sp = 0;
+
+	for(const expr_insn_t *insn = expr->code; insn != expr->code + expr->len; insn++) {
+		uint64_t b = sp > 0? stack[sp - 1]: 0;
+		uint64_t *a = sp > 1? &stack[sp - 2]: NULL;
+
+		switch(insn->op) {
+			case OP_CONST:
+				stack[sp++] = insn->arg;
+				break;
+			case OP_REG:
+				stack[sp++] = *(const gpr_register_t *)((const char *)state + insn->arg);
+				break;
+			case OP_FLAG:
+				stack[sp++] = (state->uts.ts.flags_register & insn->arg) != 0;
+				break;
+			case OP_DEREF: {
+				gpr_register_t value = 0;
+				mach_vm_size_t count;
+				if(KERN_CALL("mach_vm_read_overwrite", mach_vm_read_overwrite(task, b, sizeof(value), (mach_vm_address_t)&value, &count)) != KERN_SUCCESS) {
+					return false;
+				}
+				stack[sp - 1] = value;
+				break;
+			}
+			case OP_NEG:  stack[sp - 1] = -b; break;
+			case OP_NOT:  stack[sp - 1] = ~b; break;
+			case OP_LNOT: stack[sp - 1] = !b; break;
+			case OP_ADD:  *a += b; sp--; break;
+			case OP_SUB:  *a -= b; sp--; break;
+			case OP_MUL:  *a *= b; sp--; break;
+			case OP_DIV:
+			case OP_MOD:
+				if(b == 0) {
+					return false;
+				}
+				*a = insn->op == OP_DIV? *a / b: *a % b;
+				sp--;
+				break;
+			case OP_AND:  *a &= b; sp--; break;
+			case OP_OR:   *a |= b; sp--; break;
+			case OP_XOR:  *a ^= b; sp--; break;
+			case OP_SHL:  *a = b < BITS? *a << b: 0; sp--; break;
+			case OP_SHR:  *a = b < BITS? *a >> b: 0; sp--; break;
+			case OP_EQ:   *a = *a == b; sp--; break;
+			case OP_NE:   *a = *a != b; sp--; break;
+			case OP_LT:   *a = *a < b; sp--; break;
+			case OP_LE:   *a = *a <= b; sp--; break;
+			case OP_GT:   *a = *a > b; sp--; break;
+			case OP_GE:   *a = *a >= b; sp--; break;
+			case OP_LAND: *a = *a && b; sp--; break;
+			case OP_LOR:  *a = *a || b; sp--; break;
+		}
+
+		// Values wrap at the word size of the child, like in the checks .until
+		// compiles, so -1 equals 0xFFFFFFFF for a 32-bit child
+		stack[sp - 1] = (gpr_register_t)stack[sp - 1];
+	}
+
+	*result = stack[0];
+	return true;
+}
@@ -0,0 +1,47 @@
+typedef enum {
+	// Operands
+	OP_CONST,
+	OP_REG,
+	OP_FLAG,
+	// Unary operators
+	OP_DEREF,
+	OP_NEG,
+	OP_NOT,
+	OP_LNOT,
+	// Binary operators
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_MOD,
+	OP_AND,
+	OP_OR,
+	OP_XOR,
+	OP_SHL,
+	OP_SHR,
+	OP_EQ,
+	OP_NE,
+	OP_LT,
+	OP_LE,
+	OP_GT,
+	OP_GE,
+	OP_LAND,
+	OP_LOR,
+} expr_op;
+
+typedef struct {
+	expr_op op;
+	// Value of OP_CONST, offset into x86_thread_state_t of OP_REG or mask of OP_FLAG
+	uint64_t arg;
+} expr_insn_t;
+
+// An expression compiled to code for a small stack machine
+typedef struct {
+	expr_insn_t *code;
+	size_t len;
+	char *source;
+} expr_t;
+
+expr_t *expr_compile(const char *str, const char **error);
+void expr_free(expr_t *expr);
+bool expr_eval(const expr_t *expr, task_t task, const x86_thread_state_t *state, uint64_t *result);
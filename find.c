@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+#include <emmintrin.h>
+
+#include "find.h"
+#include "maps.h"
+
+#define FIND_CHUNK_SIZE 0x100000
+#define FIND_MAX_THREADS 16
+#define FIND_MAX_RESULTS 256
+
+typedef struct {
+	mach_vm_address_t address;
+	mach_vm_size_t size;
+} find_chunk_t;
+
+typedef struct {
+	task_t task;
+	const unsigned char *pattern;
+	size_t pattern_len;
+
+	find_chunk_t *chunks;
+	size_t chunk_count;
+
+	pthread_mutex_t lock;
+	size_t next_chunk;
+	size_t results;
+} find_job_t;
+
+// SSE2 memmem: compare the first and last byte of the needle against 16
+// positions at once and only memcmp the candidates where both match
+static const unsigned char *simd_memmem(const unsigned char *haystack, size_t haystack_len, const unsigned char *needle, size_t needle_len) {
+	if(needle_len == 0 || needle_len > haystack_len) {
+		return NULL;
+	}
+
+	if(needle_len == 1) {
+		return memchr(haystack, needle[0], haystack_len);
+	}
+
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+
+	size_t i = 0;
+	for(; i + needle_len - 1 + sizeof(__m128i) <= haystack_len; i += sizeof(__m128i)) {
+		__m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i *)(haystack + i + needle_len - 1));
+
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last)));
+		while(mask) {
+			unsigned int bit = __builtin_ctz(mask);
+			if(memcmp(haystack + i + bit + 1, needle + 1, needle_len - 2) == 0) {
+				return haystack + i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+
+	for(; i + needle_len <= haystack_len; i++) {
+		if(haystack[i] == needle[0] && memcmp(haystack + i + 1, needle + 1, needle_len - 1) == 0) {
+			return haystack + i;
+		}
+	}
+
+	return NULL;
+}
+
+static void *find_worker(void *arg) {
+	find_job_t *job = arg;
+
+	unsigned char *buf = malloc(FIND_CHUNK_SIZE + job->pattern_len);
+
+	while(true) {
+		pthread_mutex_lock(&job->lock);
+		// The counter only moves for a chunk that is taken, so it never
+		// passes the end
+		bool done = job->next_chunk >= job->chunk_count || job->results >= FIND_MAX_RESULTS;
+		size_t index = done? 0: job->next_chunk++;
+		pthread_mutex_unlock(&job->lock);
+
+		if(done) {
+			break;
+		}
+
+		find_chunk_t *chunk = &job->chunks[index];
+
+		mach_vm_size_t count;
+		if(mach_vm_read_overwrite(job->task, chunk->address, chunk->size, (mach_vm_address_t)buf, &count) != KERN_SUCCESS) {
+			continue;
+		}
+
+		const unsigned char *p = buf;
+		const unsigned char *end = buf + count;
+		while((p = simd_memmem(p, end - p, job->pattern, job->pattern_len))) {
+			pthread_mutex_lock(&job->lock);
+			bool print = job->results < FIND_MAX_RESULTS;
+			job->results++;
+			if(print) {
+				mach_vm_address_t address = chunk->address + (p - buf);
+				const char *label = maps_label(address);
+				printf("0x%llx%s%s\n", address, label? " ": "", label? label: "");
+				fflush(stdout);
+			}
+			pthread_mutex_unlock(&job->lock);
+
+			if(!print) {
+				break;
+			}
+
+			p++;
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+// Splits all readable regions between start and end into chunks that
+// overlap by pattern_len - 1 bytes so matches across chunk borders are found
+static find_chunk_t *collect_chunks(task_t task, size_t pattern_len, mach_vm_address_t start, mach_vm_address_t end, size_t *chunk_count) {
+	size_t capacity = 64;
+	size_t count = 0;
+	find_chunk_t *chunks = malloc(capacity * sizeof(*chunks));
+
+	size_t region_count;
+	const map_region_t *regions = maps_regions(task, &region_count);
+	for(size_t i = 0; i < region_count; i++) {
+		mach_vm_address_t region_start = MAX(regions[i].start, start);
+		mach_vm_address_t region_end = MIN(regions[i].end, end);
+
+		if(!(regions[i].protection & VM_PROT_READ) || region_start >= region_end) {
+			continue;
+		}
+
+		for(mach_vm_address_t a = region_start; a < region_end; a += FIND_CHUNK_SIZE) {
+			if(count == capacity) {
+				capacity *= 2;
+				chunks = realloc(chunks, capacity * sizeof(*chunks));
+			}
+
+			chunks[count].address = a;
+			chunks[count].size = MIN(FIND_CHUNK_SIZE + pattern_len - 1, region_end - a);
+			count++;
+		}
+	}
+
+	*chunk_count = count;
+	return chunks;
+}
+
+size_t find_pattern(task_t task, const unsigned char *pattern, size_t pattern_len, mach_vm_address_t start, mach_vm_address_t end) {
+	find_job_t job = {
+		.task = task,
+		.pattern = pattern,
+		.pattern_len = pattern_len,
+	};
+	pthread_mutex_init(&job.lock, NULL);
+
+	job.chunks = collect_chunks(task, pattern_len, start, end, &job.chunk_count);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t thread_count = MIN(MIN(cpus > 0? (size_t)cpus: 1, FIND_MAX_THREADS), job.chunk_count);
+
+	// The calling thread is one of the workers
+	thread_count = thread_count > 0? thread_count - 1: 0;
+
+	pthread_t threads[FIND_MAX_THREADS];
+	for(size_t i = 0; i < thread_count; i++) {
+		if(pthread_create(&threads[i], NULL, find_worker, &job) != 0) {
+			thread_count = i;
+			break;
+		}
+	}
+
+	find_worker(&job);
+
+	for(size_t i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if(job.results > FIND_MAX_RESULTS) {
+		printf("Stopped after %d results.\n", FIND_MAX_RESULTS);
+	}
+
+	pthread_mutex_destroy(&job.lock);
+	free(job.chunks);
+
+	return MIN(job.results, FIND_MAX_RESULTS);
+}
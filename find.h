@@ -0,0 +1 @@
+size_t find_pattern(task_t task, const unsigned char *pattern, size_t pattern_len, mach_vm_address_t start, mach_vm_address_t end);
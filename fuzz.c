@@ -0,0 +1,611 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <ctype.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+#include <mach/mach_time.h>
+#include <capstone/capstone.h>
+
+#include "arch.h"
+#include "fuzz.h"
+#include "macros.h"
+#include "maps.h"
+#include "utils.h"
+
+// Cases are run in batches, a batch only stops the child once unless a case
+// faults, traps or hangs
+#define BATCH_CASES 1024
+#define MAX_CASE_INSNS 4
+#define MAX_INSN_SIZE 15
+#define MAX_CASE_BYTES (MAX_CASE_INSNS * MAX_INSN_SIZE)
+// Prologue, random instructions and epilogue
+#define MAX_CASE_CODE (64 + MAX_CASE_BYTES + 48)
+
+#define DATA_SIZE 0x10000
+#define STACK_OFFSET (DATA_SIZE / 2)
+
+#define MAX_SEED_ATTEMPTS 8
+#define MAX_RANDOM_ATTEMPTS 64
+
+// A case loads its registers from its input slot and stores them to its
+// output slot. Both have the same layout, ordered by how the epilogue pushes.
+#if defined(__i386__)
+// mxcsr, then what popad, popfd and pop esp load
+#define SLOT_WORDS 11
+#define SLOT_FLAGS 9
+#define SLOT_SP 10
+static const char *slot_names[SLOT_WORDS] = {"mxcsr", "edi", "esi", "ebp", NULL, "ebx", "edx", "ecx", "eax", "eflags", "esp"};
+#else
+#define SLOT_WORDS 18
+#define SLOT_FLAGS 16
+#define SLOT_SP 17
+static const char *slot_names[SLOT_WORDS] = {"mxcsr", "r15", "r14", "r13", "r12", "r11", "r10", "r9", "r8", "rdi", "rsi", "rbp", "rbx", "rdx", "rcx", "rax", "rflags", "rsp"};
+#endif
+
+// Only the status flags and the direction flag are checked
+#define CHECKED_FLAGS 0xCD5
+// Bit 1 is always set, interrupts are always enabled
+#define FIXED_FLAGS 0x202
+
+#define MXCSR_DEFAULT 0x1F80
+// Rounding mode, flush to zero and denormals are zero
+#define MXCSR_RANDOM 0xE040
+
+typedef struct {
+	uint8_t bytes[MAX_CASE_BYTES];
+	size_t len;
+	// Status flags the instructions are documented to change
+	uint64_t allowed_flags;
+	mach_vm_address_t start;
+	mach_vm_address_t body;
+	mach_vm_address_t end;
+	bool stopped;
+} fuzz_case_t;
+
+typedef struct {
+	uint8_t bytes[MAX_CASE_BYTES];
+	size_t len;
+} seed_t;
+
+static const struct {
+	uint64_t flag;
+	uint64_t changes;
+} flag_effects[] = {
+	{0x001, X86_EFLAGS_MODIFY_CF | X86_EFLAGS_RESET_CF | X86_EFLAGS_SET_CF | X86_EFLAGS_UNDEFINED_CF},
+	{0x004, X86_EFLAGS_MODIFY_PF | X86_EFLAGS_RESET_PF | X86_EFLAGS_UNDEFINED_PF},
+	{0x010, X86_EFLAGS_MODIFY_AF | X86_EFLAGS_RESET_AF | X86_EFLAGS_UNDEFINED_AF},
+	{0x040, X86_EFLAGS_MODIFY_ZF | X86_EFLAGS_UNDEFINED_ZF},
+	{0x080, X86_EFLAGS_MODIFY_SF | X86_EFLAGS_RESET_SF | X86_EFLAGS_UNDEFINED_SF},
+	{0x400, X86_EFLAGS_MODIFY_DF | X86_EFLAGS_RESET_DF | X86_EFLAGS_SET_DF},
+	{0x800, X86_EFLAGS_MODIFY_OF | X86_EFLAGS_RESET_OF | X86_EFLAGS_UNDEFINED_OF},
+};
+
+// Instructions that would leave the case or the process
+static const char *banned_mnemonics[] = {
+	"syscall", "sysenter", "sysexit", "sysret", "int1", "bound", "xbegin", "xabort", "xend",
+};
+
+static csh handle;
+static cs_insn *insn;
+
+static uint64_t rng_state;
+
+static seed_t *seeds;
+static size_t seed_count;
+
+static FILE *findings;
+static char **finding_keys;
+static size_t finding_count;
+
+static fuzz_case_t cases[BATCH_CASES];
+static gpr_register_t inputs[BATCH_CASES][SLOT_WORDS];
+static gpr_register_t outputs[BATCH_CASES][SLOT_WORDS];
+static unsigned char data[DATA_SIZE];
+
+// Code, inputs and outputs are mapped together, so the epilogue can reach its
+// output slot with a rip relative operand. Code and inputs come first and are
+// only writable while a batch is written, the outputs are on pages of their
+// own after them.
+static unsigned char *local;
+static size_t local_size;
+static size_t code_size;
+static mach_vm_address_t remote;
+static mach_vm_address_t remote_inputs;
+static mach_vm_address_t remote_outputs;
+static mach_vm_address_t remote_data;
+// The breakpoint after the last case
+static mach_vm_address_t batch_end;
+
+static struct {
+	uint64_t cases;
+	uint64_t faults;
+	uint64_t traps;
+	uint64_t hangs;
+	uint64_t flags;
+	uint64_t started;
+	uint64_t last_progress;
+} counters;
+
+static uint64_t random64(void) {
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double elapsed_seconds(uint64_t since) {
+	mach_timebase_info_data_t timebase;
+	mach_timebase_info(&timebase);
+	return (mach_absolute_time() - since) * (double)timebase.numer / timebase.denom / 1e9;
+}
+
+static bool load_corpus(const char *path) {
+	FILE *f = fopen(path, "r");
+	if(!f) {
+		perror("fopen()");
+		return false;
+	}
+
+	// The first word of a line is the hex of a sequence, so the findings of
+	// an earlier run can be used as a corpus
+	char line[1024];
+	while(fgets(line, sizeof(line), f)) {
+		char *p = line;
+		char *word = strsep(&p, " \t\n");
+		if(strcmp(word, "crash") == 0 || strcmp(word, "trap") == 0 || strcmp(word, "hang") == 0 || strcmp(word, "flags") == 0) {
+			word = strsep(&p, " \t\n");
+		}
+
+		size_t len;
+		unsigned char *bytes = word? hex2bytes(word, &len, false): NULL;
+		if(!bytes) {
+			continue;
+		}
+
+		seeds = realloc(seeds, (seed_count + 1) * sizeof(*seeds));
+		seed_t *seed = &seeds[seed_count++];
+		seed->len = len < MAX_CASE_BYTES? len: MAX_CASE_BYTES;
+		memcpy(seed->bytes, bytes, seed->len);
+		free(bytes);
+	}
+
+	fclose(f);
+	printf("Loaded %zu seeds from %s\n", seed_count, path);
+	return true;
+}
+
+bool fuzz_init(task_t task, const char *findings_path, const char *corpus_path) {
+	cs_err err = cs_open(CS_ARCH_X86, IF32(CS_MODE_32, CS_MODE_64), &handle);
+	if(err != CS_ERR_OK) {
+		printf("cs_open() failed: %s\n", cs_strerror(err));
+		return false;
+	}
+	cs_option(handle, CS_OPT_DETAIL, CS_OPT_ON);
+	insn = cs_malloc(handle);
+
+	if(corpus_path && !load_corpus(corpus_path)) {
+		return false;
+	}
+
+	findings = fopen(findings_path, "a");
+	if(!findings) {
+		perror("fopen()");
+		return false;
+	}
+
+	rng_state = mach_absolute_time() | 1;
+	printf("Seed: 0x%" PRIx64 "\n", rng_state);
+
+	code_size = BATCH_CASES * MAX_CASE_CODE + 1 + sizeof(inputs);
+	code_size = (code_size + vm_page_size - 1) / vm_page_size * vm_page_size;
+	local_size = code_size + (sizeof(outputs) + vm_page_size - 1) / vm_page_size * vm_page_size;
+	local = calloc(1, local_size);
+
+	KERN_TRY("mach_vm_allocate", mach_vm_allocate(task, &remote, local_size, VM_FLAGS_ANYWHERE), {
+		return false;
+	});
+	KERN_TRY("mach_vm_protect", mach_vm_protect(task, remote, code_size, false, VM_PROT_READ | VM_PROT_EXECUTE), {
+		return false;
+	});
+
+	// The data has an inaccessible page on both sides, so a string
+	// instruction that walks out of it, e.g. backwards with DF set, faults
+	// instead of overwriting the outputs, inputs or code of the batch
+	mach_vm_address_t data_region;
+	KERN_TRY("mach_vm_allocate", mach_vm_allocate(task, &data_region, DATA_SIZE + 2 * vm_page_size, VM_FLAGS_ANYWHERE), {
+		return false;
+	});
+	KERN_TRY("mach_vm_protect", mach_vm_protect(task, data_region, vm_page_size, false, VM_PROT_NONE), {
+		return false;
+	});
+	KERN_TRY("mach_vm_protect", mach_vm_protect(task, data_region + vm_page_size + DATA_SIZE, vm_page_size, false, VM_PROT_NONE), {
+		return false;
+	});
+	remote_data = data_region + vm_page_size;
+
+	maps_note(remote, local_size, "fuzz");
+	maps_note(remote_data, DATA_SIZE, "fuzz data");
+
+	remote_inputs = remote + BATCH_CASES * MAX_CASE_CODE + 1;
+	remote_outputs = remote + code_size;
+
+	for(size_t i = 0; i < DATA_SIZE; i++) {
+		data[i] = random64();
+	}
+
+	counters.started = mach_absolute_time();
+	counters.last_progress = counters.started;
+	return true;
+}
+
+static bool acceptable(const cs_insn *insn) {
+	const cs_detail *detail = insn->detail;
+	for(size_t i = 0; i < detail->groups_count; i++) {
+		uint8_t group = detail->groups[i];
+		if(group == CS_GRP_JUMP || group == CS_GRP_CALL || group == CS_GRP_RET || group == CS_GRP_INT || group == CS_GRP_IRET) {
+			return false;
+		}
+	}
+
+	for(size_t i = 0; i < ELEMENTS(banned_mnemonics); i++) {
+		if(strcmp(insn->mnemonic, banned_mnemonics[i]) == 0) {
+			return false;
+		}
+	}
+
+	// Writes relative to the pc would change the code of other cases
+	for(size_t i = 0; i < detail->x86.op_count; i++) {
+		const cs_x86_op *op = &detail->x86.operands[i];
+		if(op->type == X86_OP_MEM && (op->mem.base == X86_REG_RIP || op->mem.base == X86_REG_EIP)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static uint64_t allowed_flags(const cs_insn *insn) {
+	uint64_t allowed = 0;
+	for(size_t i = 0; i < ELEMENTS(flag_effects); i++) {
+		if(insn->detail->x86.eflags & flag_effects[i].changes) {
+			allowed |= flag_effects[i].flag;
+		}
+	}
+	return allowed;
+}
+
+// Appends the acceptable instructions decoded from bytes to the case
+static void take_instructions(fuzz_case_t *c, const uint8_t *bytes, size_t len, size_t max) {
+	const uint8_t *code = bytes;
+	size_t size = len;
+	uint64_t address = 0;
+	for(size_t n = 0; n < max && cs_disasm_iter(handle, &code, &size, &address, insn); n++) {
+		if(!acceptable(insn)) {
+			continue;
+		}
+
+		memcpy(c->bytes + c->len, insn->bytes, insn->size);
+		c->len += insn->size;
+		c->allowed_flags |= allowed_flags(insn);
+	}
+}
+
+static void mutate(uint8_t *bytes, size_t *len) {
+	int mutations = 1 + random64() % 4;
+	for(int i = 0; i < mutations; i++) {
+		size_t at = *len? random64() % *len: 0;
+		switch(random64() % 4) {
+			case 0:
+				if(*len) {
+					bytes[at] ^= 1 << (random64() % 8);
+				}
+				break;
+			case 1:
+				if(*len) {
+					bytes[at] = random64();
+				}
+				break;
+			case 2:
+				if(*len < MAX_CASE_BYTES) {
+					memmove(bytes + at + 1, bytes + at, *len - at);
+					bytes[at] = random64();
+					(*len)++;
+				}
+				break;
+			case 3:
+				if(*len > 1) {
+					memmove(bytes + at, bytes + at + 1, *len - at - 1);
+					(*len)--;
+				}
+				break;
+		}
+	}
+}
+
+static void generate(fuzz_case_t *c) {
+	memset(c, 0, sizeof(*c));
+
+	// Half of the cases are mutated seeds, if there are any
+	if(seed_count && random64() % 2) {
+		for(int attempt = 0; attempt < MAX_SEED_ATTEMPTS && c->len == 0; attempt++) {
+			seed_t seed = seeds[random64() % seed_count];
+			mutate(seed.bytes, &seed.len);
+			take_instructions(c, seed.bytes, seed.len, MAX_CASE_INSNS);
+		}
+	}
+
+	size_t wanted = 1 + random64() % MAX_CASE_INSNS;
+	for(int attempt = 0; attempt < MAX_RANDOM_ATTEMPTS && c->len == 0; attempt++) {
+		for(size_t i = 0; i < wanted; i++) {
+			uint8_t bytes[MAX_INSN_SIZE];
+			for(size_t j = 0; j < sizeof(bytes); j += 8) {
+				uint64_t r = random64();
+				memcpy(bytes + j, &r, sizeof(bytes) - j < 8? sizeof(bytes) - j: 8);
+			}
+			take_instructions(c, bytes, sizeof(bytes), 1);
+		}
+	}
+}
+
+static gpr_register_t random_register(void) {
+	switch(random64() % 4) {
+		case 0:
+			// Memory operands mostly hit the data
+			return remote_data + random64() % DATA_SIZE;
+		case 1: {
+			static const gpr_register_t edges[] = {0, 1, -1, IF32(0x7FFFFFFF, 0x7FFFFFFFFFFFFFFF), IF32(0x80000000, 0x8000000000000000), 0x80, 0xFF, 0x8000, 0xFFFF};
+			return edges[random64() % ELEMENTS(edges)];
+		}
+		case 2:
+			return random64() % 0x100;
+		default:
+			return random64();
+	}
+}
+
+static void randomize_inputs(gpr_register_t *slot) {
+	for(size_t i = 0; i < SLOT_WORDS; i++) {
+		slot[i] = random_register();
+	}
+
+	slot[0] = MXCSR_DEFAULT | (random64() & MXCSR_RANDOM);
+	slot[SLOT_FLAGS] = (random64() & CHECKED_FLAGS) | FIXED_FLAGS;
+	slot[SLOT_SP] = remote_data + STACK_OFFSET + (random64() % (STACK_OFFSET / 2) & ~(gpr_register_t)(sizeof(gpr_register_t) - 1));
+}
+
+static size_t emit(unsigned char *p, const void *bytes, size_t len) {
+	memcpy(p, bytes, len);
+	return len;
+}
+
+// Loads the registers from the input slot. The x87 and SSE state is reset,
+// as a case may unmask exceptions.
+static size_t emit_prologue(unsigned char *p, mach_vm_address_t input) {
+	size_t n = 0;
+	gpr_register_t address = input;
+#if defined(__i386__)
+	n += emit(p + n, "\xBC", 1);
+	n += emit(p + n, &address, sizeof(address));
+	// ldmxcsr [esp]; fninit; pop eax; popad; popfd; pop esp
+	n += emit(p + n, "\x0F\xAE\x14\x24\xDB\xE3\x58\x61\x9D\x5C", 10);
+	// A case may have loaded another data segment: push ss; pop ds; push ss; pop es
+	n += emit(p + n, "\x16\x1F\x16\x07", 4);
+#else
+	n += emit(p + n, "\x48\xBC", 2);
+	n += emit(p + n, &address, sizeof(address));
+	// ldmxcsr [rsp]; fninit; pop rax
+	n += emit(p + n, "\x0F\xAE\x14\x24\xDB\xE3\x58", 7);
+	// pop r15 ... pop r8
+	for(int r = 7; r >= 0; r--) {
+		p[n++] = 0x41;
+		p[n++] = 0x58 + r;
+	}
+	// pop rdi; pop rsi; pop rbp; pop rbx; pop rdx; pop rcx; pop rax; popfq; pop rsp
+	n += emit(p + n, "\x5F\x5E\x5D\x5B\x5A\x59\x58\x9D\x5C", 9);
+#endif
+	return n;
+}
+
+// Swaps the stack pointer with the end of the output slot and pushes the
+// registers there, the stack pointer of the case ends up in the last word
+static size_t emit_epilogue(unsigned char *p, mach_vm_address_t address, mach_vm_address_t output) {
+	size_t n = 0;
+	mach_vm_address_t last_word = output + (SLOT_WORDS - 1) * sizeof(gpr_register_t);
+#if defined(__i386__)
+	// xchg [last_word], esp; pushfd; pushad
+	uint32_t absolute = last_word;
+	n += emit(p + n, "\x87\x25", 2);
+	n += emit(p + n, &absolute, sizeof(absolute));
+	n += emit(p + n, "\x9C\x60", 2);
+#else
+	// xchg [rip + rel], rsp
+	int32_t rel = last_word - (address + 7);
+	n += emit(p + n, "\x48\x87\x25", 3);
+	n += emit(p + n, &rel, sizeof(rel));
+	// pushfq; push rax; push rcx; push rdx; push rbx; push rbp; push rsi; push rdi
+	n += emit(p + n, "\x9C\x50\x51\x52\x53\x55\x56\x57", 8);
+	// push r8 ... push r15
+	for(int r = 0; r < 8; r++) {
+		p[n++] = 0x41;
+		p[n++] = 0x50 + r;
+	}
+#endif
+	return n;
+}
+
+// Generates the next batch and writes it to the child. Returns the address
+// the child has to be resumed at.
+mach_vm_address_t fuzz_batch(task_t task) {
+	size_t offset = 0;
+	for(size_t i = 0; i < BATCH_CASES; i++) {
+		fuzz_case_t *c = &cases[i];
+		generate(c);
+		randomize_inputs(inputs[i]);
+
+		mach_vm_address_t input = remote_inputs + i * sizeof(inputs[i]);
+		mach_vm_address_t output = remote_outputs + i * sizeof(outputs[i]);
+
+		c->start = remote + offset;
+		offset += emit_prologue(local + offset, input);
+		c->body = remote + offset;
+		offset += emit(local + offset, c->bytes, c->len);
+		c->end = remote + offset;
+		offset += emit_epilogue(local + offset, remote + offset, output);
+
+		// The epilogue pushes below the last word, which holds its own address
+		memset(outputs[i], 0, sizeof(outputs[i]));
+		outputs[i][SLOT_WORDS - 1] = output + (SLOT_WORDS - 1) * sizeof(gpr_register_t);
+	}
+	batch_end = remote + offset;
+	local[offset++] = 0xCC;
+
+	memcpy(local + (remote_inputs - remote), inputs, sizeof(inputs));
+	memcpy(local + (remote_outputs - remote), outputs, sizeof(outputs));
+
+	// Cases can't write to the code and inputs of the batch
+	KERN_FAIL("mach_vm_protect", mach_vm_protect(task, remote, code_size, false, VM_PROT_READ | VM_PROT_WRITE));
+	KERN_FAIL("mach_vm_write", mach_vm_write(task, remote, (vm_offset_t)local, local_size));
+	KERN_FAIL("mach_vm_protect", mach_vm_protect(task, remote, code_size, false, VM_PROT_READ | VM_PROT_EXECUTE));
+	KERN_FAIL("mach_vm_write", mach_vm_write(task, remote_data, (vm_offset_t)data, DATA_SIZE));
+
+	return cases[0].start;
+}
+
+static size_t find_case(mach_vm_address_t pc) {
+	size_t lo = 0;
+	size_t hi = BATCH_CASES;
+	while(hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(cases[mid].start <= pc) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Describes the instructions of a case as "hex # disassembly"
+static void describe_case(const fuzz_case_t *c, char *buf, size_t size, char *mnemonics, size_t mnemonics_size) {
+	size_t n = 0;
+	for(size_t i = 0; i < c->len && n + 2 < size; i++) {
+		n += snprintf(buf + n, size - n, "%02x", c->bytes[i]);
+	}
+	n += snprintf(buf + n, size > n? size - n: 0, " #");
+
+	mnemonics[0] = '\0';
+	size_t m = 0;
+
+	const uint8_t *code = c->bytes;
+	size_t len = c->len;
+	uint64_t address = c->body;
+	while(n < size && cs_disasm_iter(handle, &code, &len, &address, insn)) {
+		n += snprintf(buf + n, size - n, " %s%s%s;", insn->mnemonic, insn->op_str[0]? " ": "", insn->op_str);
+		if(m < mnemonics_size) {
+			m += snprintf(mnemonics + m, mnemonics_size - m, "%s%s", m? " ": "", insn->mnemonic);
+		}
+	}
+}
+
+// Findings are only written once per kind and instructions
+static void record(const char *kind, const fuzz_case_t *c, size_t index, const char *detail) {
+	char description[1024];
+	char mnemonics[256];
+	describe_case(c, description, sizeof(description), mnemonics, sizeof(mnemonics));
+
+	char *key;
+	asprintf(&key, "%s %s %s", kind, detail, mnemonics);
+	for(size_t i = 0; i < finding_count; i++) {
+		if(strcmp(finding_keys[i], key) == 0) {
+			free(key);
+			return;
+		}
+	}
+	finding_keys = realloc(finding_keys, (finding_count + 1) * sizeof(*finding_keys));
+	finding_keys[finding_count++] = key;
+
+	fprintf(findings, "%s %s | %s |", kind, description, detail);
+	for(size_t i = 0; i < SLOT_WORDS; i++) {
+		if(slot_names[i]) {
+			fprintf(findings, " %s=0x%llx", slot_names[i], (unsigned long long)inputs[index][i]);
+		}
+	}
+	fprintf(findings, "\n");
+	fflush(findings);
+}
+
+static void check_flags(void) {
+	for(size_t i = 0; i < BATCH_CASES; i++) {
+		fuzz_case_t *c = &cases[i];
+		if(c->stopped) {
+			continue;
+		}
+
+		uint64_t changed = (inputs[i][SLOT_FLAGS] ^ outputs[i][SLOT_FLAGS]) & CHECKED_FLAGS;
+		uint64_t unexpected = changed & ~c->allowed_flags;
+		if(unexpected) {
+			counters.flags++;
+			char detail[64];
+			snprintf(detail, sizeof(detail), "changed undocumented flags 0x%llx", (unsigned long long)unexpected);
+			record("flags", c, i, detail);
+		}
+	}
+}
+
+static void finish_batch(task_t task) {
+	KERN_FAIL("mach_vm_read_overwrite", mach_vm_read_overwrite(task, remote_outputs, sizeof(outputs), (mach_vm_address_t)outputs, &(mach_vm_size_t){0}));
+	check_flags();
+	counters.cases += BATCH_CASES;
+}
+
+// Handles a stop of the child during a batch. Returns where to resume it, or
+// 0 once the batch is done.
+mach_vm_address_t fuzz_stopped(task_t task, mach_vm_address_t pc, fuzz_stop_t kind, exception_type_t exception, int64_t code) {
+	// Without branches the child can't get anywhere else, but don't get
+	// lost if it does
+	if((kind == FUZZ_TRAP && pc == batch_end) || pc < remote || pc > batch_end) {
+		finish_batch(task);
+		return 0;
+	}
+
+	size_t index = find_case(pc);
+	fuzz_case_t *c = &cases[index];
+	c->stopped = true;
+
+	char detail[128];
+	if(kind == FUZZ_HANG) {
+		counters.hangs++;
+		snprintf(detail, sizeof(detail), "hung at +%llu", (unsigned long long)(pc - c->body));
+		record("hang", c, index, detail);
+	} else if(kind == FUZZ_FAULT) {
+		counters.faults++;
+		snprintf(detail, sizeof(detail), "exception %d code 0x%llx at +%llu", exception, (unsigned long long)code, (unsigned long long)(pc - c->body));
+		record("crash", c, index, detail);
+	} else {
+		counters.traps++;
+		snprintf(detail, sizeof(detail), "trapped at +%llu", (unsigned long long)(pc - c->body));
+		record("trap", c, index, detail);
+	}
+
+	if(index + 1 == BATCH_CASES) {
+		finish_batch(task);
+		return 0;
+	}
+
+	return cases[index + 1].start;
+}
+
+void fuzz_progress(bool force) {
+	if(!force && elapsed_seconds(counters.last_progress) < 1) {
+		return;
+	}
+	counters.last_progress = mach_absolute_time();
+
+	double seconds = elapsed_seconds(counters.started);
+	fprintf(stderr, "\r%" PRIu64 " cases, %.0f/s, %" PRIu64 " faults, %" PRIu64 " traps, %" PRIu64 " hangs, %" PRIu64 " flag anomalies, %zu findings ", counters.cases, counters.cases / seconds, counters.faults, counters.traps, counters.hangs, counters.flags, finding_count);
+}
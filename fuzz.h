@@ -0,0 +1,10 @@
+typedef enum {
+	FUZZ_FAULT,
+	FUZZ_TRAP,
+	FUZZ_HANG,
+} fuzz_stop_t;
+
+bool fuzz_init(task_t task, const char *findings_path, const char *corpus_path);
+mach_vm_address_t fuzz_batch(task_t task);
+mach_vm_address_t fuzz_stopped(task_t task, mach_vm_address_t pc, fuzz_stop_t kind, exception_type_t exception, int64_t code);
+void fuzz_progress(bool force);
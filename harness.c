@@ -0,0 +1,592 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+
+#include "arch.h"
+#include "block.h"
+#include "harness.h"
+#include "macros.h"
+#include "maps.h"
+
+// The harness, its vectors and the snippet's stacks share one region that
+// is mapped into both us and the child, so vectors are neither written nor
+// read with a kernel call. Every lane has its own copy of the harness, which
+// starts with its control words, and its own stack, so lanes can run on
+// threads of their own.
+#define LANE_SIZE 0x10000
+#define CODE_OFFSET 0x40
+// Every lane has room for HARNESS_PROGRAMS snippets, so they can take turns
+// without being assembled again
+#define PROGRAM_SIZE ((LANE_SIZE - CODE_OFFSET) / HARNESS_PROGRAMS)
+#define STACK_SIZE 0x10000
+
+// The harness keeps its state in memory, as every register belongs to the
+// snippet
+typedef struct {
+	// The stack pointer word of the current input vector
+	gpr_register_t in_cursor;
+	// The end of the next output vector, outputs are pushed downwards
+	gpr_register_t out_cursor;
+	gpr_register_t saved_sp;
+	gpr_register_t remaining;
+	// How many lanes are still running, only the one of lane 0 is used
+	gpr_register_t active;
+} control_t;
+
+// The order popad, popfd and pop esp load them in. pushad stores the same
+// order, with the stack pointer of pushad in place of the ignored word.
+#if defined(__i386__)
+#define FIELD(r) offsetof(x86_thread_state32_t, __##r)
+static const char *names[HARNESS_WORDS] = {"edi", "esi", "ebp", NULL, "ebx", "edx", "ecx", "eax", "eflags", "esp"};
+static const size_t fields[HARNESS_WORDS] = {FIELD(edi), FIELD(esi), FIELD(ebp), 0, FIELD(ebx), FIELD(edx), FIELD(ecx), FIELD(eax), FIELD(eflags), FIELD(esp)};
+#else
+#define FIELD(r) offsetof(x86_thread_state64_t, __##r)
+static const char *names[HARNESS_WORDS] = {"r15", "r14", "r13", "r12", "r11", "r10", "r9", "r8", "rdi", "rsi", "rbp", "rbx", "rdx", "rcx", "rax", "rflags", "rsp"};
+static const size_t fields[HARNESS_WORDS] = {FIELD(r15), FIELD(r14), FIELD(r13), FIELD(r12), FIELD(r11), FIELD(r10), FIELD(r9), FIELD(r8), FIELD(rdi), FIELD(rsi), FIELD(rbp), FIELD(rbx), FIELD(rdx), FIELD(rcx), FIELD(rax), FIELD(rflags), FIELD(rsp)};
+#endif
+
+static unsigned char *local;
+static mach_vm_address_t remote;
+static mach_vm_size_t region_size;
+static size_t capacity;
+static size_t lane_capacity;
+
+// Memory of every vector that snippets reach through a register
+static unsigned char *memory_local;
+static mach_vm_address_t memory_remote;
+static mach_vm_size_t memory_size;
+
+// The vectors every lane was armed with
+static size_t lane_first[HARNESS_MAX_LANES];
+static size_t lane_count[HARNESS_MAX_LANES];
+static int lane_program[HARNESS_MAX_LANES];
+
+// The exception every vector faulted with, 0 if it ran to the end. Only
+// kept on our side, as the child never sees it.
+static exception_type_t *faults;
+
+int harness_register_index(const char *name) {
+	for(int i = 0; i < HARNESS_WORDS; i++) {
+		if(names[i] && strcmp(names[i], name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+const char *harness_register_name(int index) {
+	return names[index];
+}
+
+// Unmaps the region on our side, the child's side is gone after .reset
+void harness_reset(void) {
+	if(local) {
+		mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)local, region_size);
+	}
+	if(memory_local) {
+		mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)memory_local, memory_size);
+	}
+	free(faults);
+	faults = NULL;
+	local = NULL;
+	remote = 0;
+	capacity = 0;
+	lane_capacity = 0;
+	memory_local = NULL;
+	memory_remote = 0;
+	memory_size = 0;
+}
+
+static size_t stacks_offset(void) {
+	return lane_capacity * LANE_SIZE;
+}
+
+static size_t vectors_offset(void) {
+	return stacks_offset() + lane_capacity * STACK_SIZE;
+}
+
+// Maps size bytes into both us and the child
+static bool map_shared(task_t task, mach_vm_size_t size, const char *name, unsigned char **local_address, mach_vm_address_t *remote_address) {
+	mach_vm_address_t address = 0;
+	KERN_TRY("mach_vm_allocate", mach_vm_allocate(mach_task_self(), &address, size, VM_FLAGS_ANYWHERE), {
+		return false;
+	});
+
+	vm_prot_t cur;
+	vm_prot_t max;
+	mach_vm_address_t shared = 0;
+	KERN_TRY("mach_vm_remap", mach_vm_remap(task, &shared, size, 0, VM_FLAGS_ANYWHERE, mach_task_self(), address, false, &cur, &max, VM_INHERIT_NONE), {
+		mach_vm_deallocate(mach_task_self(), address, size);
+		return false;
+	});
+	KERN_TRY("mach_vm_protect", mach_vm_protect(task, shared, size, false, VM_PROT_ALL), {
+		mach_vm_deallocate(task, shared, size);
+		mach_vm_deallocate(mach_task_self(), address, size);
+		return false;
+	});
+
+	// The vectors are scratch, they are filled again for every run
+	maps_note(shared, size, name);
+	maps_note_used(shared, 0);
+
+	*local_address = (unsigned char *)address;
+	*remote_address = shared;
+	return true;
+}
+
+static mach_vm_size_t page_round(mach_vm_size_t size) {
+	return (size + vm_page_size - 1) & ~((mach_vm_size_t)vm_page_size - 1);
+}
+
+static bool reserve(task_t task, size_t count, size_t lanes) {
+	if(count <= capacity && lanes <= lane_capacity) {
+		return true;
+	}
+
+	if(local) {
+		KERN_CALL("mach_vm_deallocate", mach_vm_deallocate(task, remote, region_size));
+		mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)local, region_size);
+		local = NULL;
+	}
+
+	mach_vm_size_t size = page_round(lanes * (LANE_SIZE + STACK_SIZE) + 2 * count * sizeof(harness_vector_t));
+	if(!map_shared(task, size, "harness", &local, &remote)) {
+		capacity = 0;
+		lane_capacity = 0;
+		return false;
+	}
+
+	region_size = size;
+	capacity = count;
+	lane_capacity = lanes;
+	faults = realloc(faults, count * sizeof(*faults));
+	return true;
+}
+
+// Memory that is mapped into both us and the child, for snippets that load
+// or store. Its address in the child is stored in address.
+unsigned char *harness_memory(task_t task, size_t size, mach_vm_address_t *address) {
+	if(size > memory_size) {
+		if(memory_local) {
+			KERN_CALL("mach_vm_deallocate", mach_vm_deallocate(task, memory_remote, memory_size));
+			mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)memory_local, memory_size);
+			memory_local = NULL;
+			memory_size = 0;
+		}
+
+		if(!map_shared(task, page_round(size), "harness memory", &memory_local, &memory_remote)) {
+			return NULL;
+		}
+		memory_size = page_round(size);
+	}
+
+	*address = memory_remote;
+	return memory_local;
+}
+
+static control_t *lane_control(size_t lane) {
+	return (control_t *)(local + lane * LANE_SIZE);
+}
+
+static size_t emit(unsigned char *p, const void *bytes, size_t len) {
+	memcpy(p, bytes, len);
+	return len;
+}
+
+// An instruction with a memory operand of a control word: rip relative in
+// 64 bit, absolute in 32 bit
+static size_t emit_control(unsigned char *p, mach_vm_address_t address, const char *opcode, size_t opcode_len, mach_vm_address_t target) {
+	size_t n = emit(p, opcode, opcode_len);
+#if defined(__i386__)
+	uint32_t absolute = target;
+	n += emit(p + n, &absolute, sizeof(absolute));
+#else
+	int32_t rel = target - (address + n + sizeof(int32_t));
+	n += emit(p + n, &rel, sizeof(rel));
+#endif
+	return n;
+}
+
+// Loads the next input vector. The stack pointer is kept in in_cursor
+// right before the snippet's own is popped.
+static size_t emit_prologue(unsigned char *p, mach_vm_address_t address, mach_vm_address_t control) {
+	size_t n = 0;
+#if defined(__i386__)
+	// mov esp, [in_cursor]; lea esp, [esp+4]; popad; popfd
+	n += emit_control(p + n, address + n, "\x8B\x25", 2, control + offsetof(control_t, in_cursor));
+	n += emit(p + n, "\x8D\x64\x24\x04\x61\x9D", 6);
+	// mov [in_cursor], esp; pop esp
+	n += emit_control(p + n, address + n, "\x89\x25", 2, control + offsetof(control_t, in_cursor));
+	n += emit(p + n, "\x5C", 1);
+#else
+	// mov rsp, [in_cursor]; lea rsp, [rsp+8]
+	n += emit_control(p + n, address + n, "\x48\x8B\x25", 3, control + offsetof(control_t, in_cursor));
+	n += emit(p + n, "\x48\x8D\x64\x24\x08", 5);
+	// pop r15 ... pop r8
+	for(int r = 7; r >= 0; r--) {
+		p[n++] = 0x41;
+		p[n++] = 0x58 + r;
+	}
+	// pop rdi; pop rsi; pop rbp; pop rbx; pop rdx; pop rcx; pop rax; popfq
+	n += emit(p + n, "\x5F\x5E\x5D\x5B\x5A\x59\x58\x9D", 8);
+	// mov [in_cursor], rsp; pop rsp
+	n += emit_control(p + n, address + n, "\x48\x89\x25", 3, control + offsetof(control_t, in_cursor));
+	n += emit(p + n, "\x5C", 1);
+#endif
+	return n;
+}
+
+// Pushes the state after the snippet to the next output vector and loops
+// back to the prologue until every vector ran. Nothing before the flags are
+// pushed changes them. A lane that is done spins until the last one is, which
+// stops the child, so a run raises a single breakpoint however many lanes it
+// has.
+static size_t emit_epilogue(unsigned char *p, mach_vm_address_t address, mach_vm_address_t loop, mach_vm_address_t control) {
+	size_t n = 0;
+#if defined(__i386__)
+	// mov [saved_sp], esp; mov esp, [out_cursor]; push [saved_sp]; pushfd; pushad
+	n += emit_control(p + n, address + n, "\x89\x25", 2, control + offsetof(control_t, saved_sp));
+	n += emit_control(p + n, address + n, "\x8B\x25", 2, control + offsetof(control_t, out_cursor));
+	n += emit_control(p + n, address + n, "\xFF\x35", 2, control + offsetof(control_t, saved_sp));
+	n += emit(p + n, "\x9C\x60", 2);
+	// mov [out_cursor], esp; dec dword [remaining]
+	n += emit_control(p + n, address + n, "\x89\x25", 2, control + offsetof(control_t, out_cursor));
+	n += emit_control(p + n, address + n, "\xFF\x0D", 2, control + offsetof(control_t, remaining));
+	// jnz loop; lock dec dword [active]
+	int32_t rel = loop - (address + n + 6);
+	n += emit(p + n, "\x0F\x85", 2);
+	n += emit(p + n, &rel, sizeof(rel));
+	n += emit_control(p + n, address + n, "\xF0\xFF\x0D", 3, remote + offsetof(control_t, active));
+#else
+	// mov [saved_sp], rsp; mov rsp, [out_cursor]; push [saved_sp]
+	n += emit_control(p + n, address + n, "\x48\x89\x25", 3, control + offsetof(control_t, saved_sp));
+	n += emit_control(p + n, address + n, "\x48\x8B\x25", 3, control + offsetof(control_t, out_cursor));
+	n += emit_control(p + n, address + n, "\xFF\x35", 2, control + offsetof(control_t, saved_sp));
+	// pushfq; push rax; push rcx; push rdx; push rbx; push rbp; push rsi; push rdi
+	n += emit(p + n, "\x9C\x50\x51\x52\x53\x55\x56\x57", 8);
+	// push r8 ... push r15
+	for(int r = 0; r < 8; r++) {
+		p[n++] = 0x41;
+		p[n++] = 0x50 + r;
+	}
+	// mov [out_cursor], rsp; dec qword [remaining]
+	n += emit_control(p + n, address + n, "\x48\x89\x25", 3, control + offsetof(control_t, out_cursor));
+	n += emit_control(p + n, address + n, "\x48\xFF\x0D", 3, control + offsetof(control_t, remaining));
+	// jnz loop; lock dec qword [active]
+	int32_t rel = loop - (address + n + 6);
+	n += emit(p + n, "\x0F\x85", 2);
+	n += emit(p + n, &rel, sizeof(rel));
+	n += emit_control(p + n, address + n, "\xF0\x48\xFF\x0D", 4, remote + offsetof(control_t, active));
+#endif
+	// jz done; spin: pause; jmp spin; done: int3
+	n += emit(p + n, "\x74\x04\xF3\x90\xEB\xFC\xCC", 7);
+	return n;
+}
+
+static mach_vm_address_t program_entry(size_t lane, int program) {
+	return remote + lane * LANE_SIZE + CODE_OFFSET + program * PROGRAM_SIZE;
+}
+
+static unsigned char *program_local(size_t lane, int program) {
+	return local + lane * LANE_SIZE + CODE_OFFSET + program * PROGRAM_SIZE;
+}
+
+// Makes room for count vectors and assembles the snippet into a program
+// slot of the harness of every lane
+bool harness_prepare(task_t task, char *code, bool att_syntax, size_t count, size_t lanes, int program) {
+	if(count == 0 || lanes == 0 || lanes > HARNESS_MAX_LANES || !reserve(task, count, lanes)) {
+		return false;
+	}
+
+	// The prologue has the same length everywhere
+	size_t prologue_len = emit_prologue(program_local(0, program), program_entry(0, program), remote);
+
+	// Assembled at the addresses of two lanes: if the bytes are the same the
+	// snippet is position independent and copied to the other lanes,
+	// otherwise it is assembled for every lane
+	unsigned char *assembly = NULL;
+	size_t asm_len = 0;
+	bool shared = false;
+	for(size_t lane = 0; lane < lanes; lane++) {
+		mach_vm_address_t control = remote + lane * LANE_SIZE;
+		mach_vm_address_t entry = program_entry(lane, program);
+		unsigned char *p = program_local(lane, program);
+		size_t n = emit_prologue(p, entry, control);
+
+		if(!shared) {
+			unsigned char *lane_assembly;
+			size_t lane_len;
+			if(!block_assemble(code, BITS, entry + n, &lane_assembly, &lane_len, att_syntax)) {
+				puts("Failed to assemble instruction.");
+				free(assembly);
+				return false;
+			}
+
+			shared = lane == 1 && lane_len == asm_len && memcmp(lane_assembly, assembly, asm_len) == 0;
+			free(assembly);
+			assembly = lane_assembly;
+			asm_len = lane_len;
+		}
+
+		// Room for the epilogue
+		if(prologue_len + asm_len + 128 > PROGRAM_SIZE) {
+			puts("The snippet is too large for the harness.");
+			free(assembly);
+			return false;
+		}
+
+		n += emit(p + n, assembly, asm_len);
+		emit_epilogue(p + n, entry + n, entry, control);
+
+		lane_count[lane] = 0;
+	}
+
+	free(assembly);
+	return true;
+}
+
+// Splits the count vectors from first on between at most lanes lanes, which
+// run the given program, and stores where the thread of every lane has to be
+// resumed. Returns how many
+// lanes got vectors.
+size_t harness_arm(size_t first, size_t count, size_t lanes, int program, mach_vm_address_t *entries) {
+	mach_vm_address_t inputs = remote + vectors_offset();
+	mach_vm_address_t outputs = inputs + capacity * sizeof(harness_vector_t);
+
+	// A lane without vectors would never stop
+	size_t per_lane = (count + lanes - 1) / lanes;
+	size_t used = (count + per_lane - 1) / per_lane;
+	for(size_t lane = 0; lane < used; lane++) {
+		size_t lane_start = first + lane * per_lane;
+		size_t n = lane == used - 1? first + count - lane_start: per_lane;
+
+		control_t *control = lane_control(lane);
+		control->in_cursor = inputs + lane_start * sizeof(harness_vector_t) - sizeof(gpr_register_t);
+		control->out_cursor = outputs + (lane_start + n) * sizeof(harness_vector_t);
+		control->remaining = n;
+
+		lane_first[lane] = lane_start;
+		lane_count[lane] = n;
+		lane_program[lane] = program;
+		entries[lane] = program_entry(lane, program);
+	}
+	memset(faults + first, 0, count * sizeof(*faults));
+	for(size_t lane = used; lane < lane_capacity; lane++) {
+		lane_count[lane] = 0;
+	}
+
+	lane_control(0)->active = used;
+	return used;
+}
+
+// The vector a lane runs next, or the one it stopped in
+size_t harness_next(size_t lane) {
+	return lane_first[lane] + lane_count[lane] - lane_control(lane)->remaining;
+}
+
+bool harness_finished(size_t lane) {
+	return lane_control(lane)->remaining == 0;
+}
+
+// Gives up on a lane that faulted. Returns whether it was the last one that
+// was running, otherwise the last one still stops the child.
+bool harness_abandon(size_t lane) {
+	return __sync_sub_and_fetch(&lane_control(0)->active, 1) == 0;
+}
+
+// Records that the vector a lane is in faulted and moves the lane on to
+// its next vector, whose prologue the faulting thread is resumed at. The
+// output of the vector is a copy of its input. Returns false if it was the
+// lane's last vector, which is then abandoned like a lane that gave up.
+bool harness_skip(size_t lane, exception_type_t exception, mach_vm_address_t *resume) {
+	size_t index = harness_next(lane);
+	faults[index] = exception;
+
+	control_t *control = lane_control(lane);
+	control->out_cursor -= sizeof(harness_vector_t);
+	*(harness_vector_t *)(local + (control->out_cursor - remote)) = harness_inputs()[index];
+	if(--control->remaining == 0) {
+		return false;
+	}
+
+	*resume = program_entry(lane, lane_program[lane]);
+	return true;
+}
+
+// The exception a vector faulted with, 0 if it didn't
+exception_type_t harness_fault(size_t index) {
+	return faults[index];
+}
+
+const char *harness_fault_name(exception_type_t exception) {
+	switch(exception) {
+		case EXC_BAD_ACCESS: return "bad access";
+		case EXC_BAD_INSTRUCTION: return "invalid instruction";
+		case EXC_ARITHMETIC: return "arithmetic";
+		default: return "fault";
+	}
+}
+
+harness_vector_t *harness_inputs(void) {
+	return (harness_vector_t *)(local + vectors_offset());
+}
+
+// Outputs are pushed from the end of a lane's vectors, so the output of its
+// first vector is the last one
+const harness_vector_t *harness_output(size_t index) {
+	harness_vector_t *outputs = harness_inputs() + capacity;
+	for(size_t lane = 0; lane < lane_capacity; lane++) {
+		size_t first = lane_first[lane];
+		if(lane_count[lane] && first <= index && index < first + lane_count[lane]) {
+			return &outputs[first + lane_count[lane] - 1 - (index - first)];
+		}
+	}
+
+	return &outputs[index];
+}
+
+// An input vector with the registers of state and the stack of a lane
+void harness_vector_from_state(const x86_thread_state_t *state, size_t lane, harness_vector_t *vector) {
+	for(int i = 0; i < HARNESS_WORDS; i++) {
+		if(names[i]) {
+			memcpy(&vector->words[i], (const char *)&state->uts.ts + fields[i], sizeof(gpr_register_t));
+		}
+	}
+
+	vector->words[HARNESS_SP] = remote + stacks_offset() + (lane + 1) * STACK_SIZE - 0x100;
+	vector->words[HARNESS_FLAGS] &= ~(gpr_register_t)0x100;
+}
+
+// Prints a row per vector with the given inputs and every register that
+// differs from its input in any row
+void harness_print_table(size_t count, const int *shown, size_t shown_count) {
+	const harness_vector_t *inputs = harness_inputs();
+
+	bool changed[HARNESS_WORDS] = {false};
+	for(size_t i = 0; i < count; i++) {
+		const harness_vector_t *output = harness_output(i);
+		for(int r = 0; r < HARNESS_WORDS; r++) {
+			if(names[r] && output->words[r] != inputs[i].words[r]) {
+				changed[r] = true;
+			}
+		}
+	}
+
+	// The flags are the reason for most sweeps
+	changed[HARNESS_FLAGS] = true;
+
+	printf("%8s", "#");
+	for(size_t s = 0; s < shown_count; s++) {
+		printf(" %*s", 2 + 2 * (int)sizeof(gpr_register_t), names[shown[s]]);
+	}
+	printf(" |");
+	for(int r = HARNESS_WORDS - 1; r >= 0; r--) {
+		if(changed[r]) {
+			printf(" %*s", 2 + 2 * (int)sizeof(gpr_register_t), names[r]);
+		}
+	}
+	puts("");
+
+	for(size_t i = 0; i < count; i++) {
+		const harness_vector_t *output = harness_output(i);
+		printf("%8zu", i);
+		for(size_t s = 0; s < shown_count; s++) {
+			printf(" 0x" REGISTER_FORMAT_HEX_PADDED, inputs[i].words[shown[s]]);
+		}
+		printf(" |");
+		if(faults[i]) {
+			printf(" %s\n", harness_fault_name(faults[i]));
+			continue;
+		}
+		for(int r = HARNESS_WORDS - 1; r >= 0; r--) {
+			if(changed[r]) {
+				printf(" 0x" REGISTER_FORMAT_HEX_PADDED, output->words[r]);
+			}
+		}
+		puts("");
+	}
+}
+
+// The binary output of .sweep: this header, the index of every swept
+// register as a uint32_t and then a row per vector with the inputs of the
+// swept registers, every output word in harness order and the exception the
+// vector faulted with as a uint32_t
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t bits;
+	uint32_t input_count;
+	uint32_t words;
+} harness_file_header_t;
+
+#define HARNESS_FILE_VERSION 2
+
+// Writes the column names as CSV, or the header of the binary format
+bool harness_write_header(FILE *file, bool binary, const int *shown, size_t shown_count) {
+	if(binary) {
+		harness_file_header_t header = {
+			.magic = {'A', 'S', 'M', 'W'},
+			.version = HARNESS_FILE_VERSION,
+			.bits = BITS,
+			.input_count = shown_count,
+			.words = HARNESS_WORDS,
+		};
+		if(fwrite(&header, sizeof(header), 1, file) != 1) {
+			return false;
+		}
+		for(size_t s = 0; s < shown_count; s++) {
+			uint32_t index = shown[s];
+			if(fwrite(&index, sizeof(index), 1, file) != 1) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	for(size_t s = 0; s < shown_count; s++) {
+		fprintf(file, "%s_in,", names[shown[s]]);
+	}
+	for(int r = HARNESS_WORDS - 1; r >= 0; r--) {
+		if(names[r]) {
+			fprintf(file, "%s,", names[r]);
+		}
+	}
+	fputs("fault\n", file);
+	return !ferror(file);
+}
+
+// Writes a row per vector from first on, with the given inputs, every
+// output register and the fault, if any
+bool harness_write_rows(FILE *file, bool binary, size_t first, size_t count, const int *shown, size_t shown_count) {
+	const harness_vector_t *inputs = harness_inputs();
+	for(size_t i = first; i < first + count; i++) {
+		const harness_vector_t *output = harness_output(i);
+		if(binary) {
+			for(size_t s = 0; s < shown_count; s++) {
+				fwrite(&inputs[i].words[shown[s]], sizeof(gpr_register_t), 1, file);
+			}
+			fwrite(output->words, sizeof(output->words), 1, file);
+			uint32_t fault = faults[i];
+			fwrite(&fault, sizeof(fault), 1, file);
+			continue;
+		}
+
+		for(size_t s = 0; s < shown_count; s++) {
+			fprintf(file, "0x" REGISTER_FORMAT_HEX ",", inputs[i].words[shown[s]]);
+		}
+		for(int r = HARNESS_WORDS - 1; r >= 0; r--) {
+			if(names[r]) {
+				fprintf(file, "0x" REGISTER_FORMAT_HEX ",", output->words[r]);
+			}
+		}
+		fprintf(file, "%s\n", faults[i]? harness_fault_name(faults[i]): "");
+	}
+	return !ferror(file);
+}
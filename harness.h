@@ -0,0 +1,31 @@
+// Registers and flags in the order the harness pops them
+#define HARNESS_WORDS IF32(10, 17)
+#define HARNESS_FLAGS IF32(8, 15)
+#define HARNESS_SP IF32(9, 16)
+
+// Every lane runs on a thread of its own
+#define HARNESS_MAX_LANES 64
+#define HARNESS_PROGRAMS 2
+
+typedef struct {
+	gpr_register_t words[HARNESS_WORDS];
+} harness_vector_t;
+
+int harness_register_index(const char *name);
+const char *harness_register_name(int index);
+void harness_reset(void);
+bool harness_prepare(task_t task, char *code, bool att_syntax, size_t count, size_t lanes, int program);
+unsigned char *harness_memory(task_t task, size_t size, mach_vm_address_t *address);
+size_t harness_arm(size_t first, size_t count, size_t lanes, int program, mach_vm_address_t *entries);
+size_t harness_next(size_t lane);
+bool harness_finished(size_t lane);
+bool harness_abandon(size_t lane);
+bool harness_skip(size_t lane, exception_type_t exception, mach_vm_address_t *resume);
+exception_type_t harness_fault(size_t index);
+const char *harness_fault_name(exception_type_t exception);
+harness_vector_t *harness_inputs(void);
+const harness_vector_t *harness_output(size_t index);
+void harness_vector_from_state(const x86_thread_state_t *state, size_t lane, harness_vector_t *vector);
+void harness_print_table(size_t count, const int *shown, size_t shown_count);
+bool harness_write_header(FILE *file, bool binary, const int *shown, size_t shown_count);
+bool harness_write_rows(FILE *file, bool binary, size_t first, size_t count, const int *shown, size_t shown_count);
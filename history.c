@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <vis.h>
+#include <editline/readline.h>
+
+#include "history.h"
+
+// Only the end of the journal is loaded at startup
+#define HISTORY_LOAD_LINES 10000
+// The journal is compacted at exit once it grows beyond this
+#define HISTORY_MAX_BYTES (4 * 1024 * 1024)
+#define HISTORY_KEEP_LINES 50000
+
+#define BLOCK_SIZE (64 * 1024)
+
+// Files written by write_history start with this and encode whitespace
+#define LEGACY_HEADER "_HiStOrY_V2_\n"
+
+static int fd = -1;
+static char *history_path;
+
+// Finds the offset at which the last count lines of the file start, by
+// reading blocks backwards from the end
+static off_t tail_offset(off_t size, size_t count) {
+	char *block = malloc(BLOCK_SIZE);
+	off_t end = size;
+	size_t lines = 0;
+	off_t offset = 0;
+
+	while(end > 0) {
+		off_t start = end > BLOCK_SIZE? end - BLOCK_SIZE: 0;
+		ssize_t len = pread(fd, block, end - start, start);
+		if(len <= 0) {
+			break;
+		}
+
+		for(ssize_t i = len - 1; i >= 0; i--) {
+			// The newline ending the file doesn't start a line
+			if(block[i] == '\n' && start + i != size - 1 && ++lines == count) {
+				offset = start + i + 1;
+				free(block);
+				return offset;
+			}
+		}
+
+		end = start;
+	}
+
+	free(block);
+	return offset;
+}
+
+static char *read_range(off_t start, off_t end) {
+	char *buf = malloc(end - start + 1);
+	ssize_t len = pread(fd, buf, end - start, start);
+	buf[len > 0? len: 0] = '\0';
+	return buf;
+}
+
+// Replaces the contents of the file, the caller holds the exclusive lock
+static void rewrite(const char *data, size_t len) {
+	// Writes to a descriptor opened with O_APPEND always go to the end
+	int rewrite_fd = open(history_path, O_WRONLY);
+	if(rewrite_fd != -1) {
+		if(pwrite(rewrite_fd, data, len, 0) == (ssize_t)len) {
+			ftruncate(rewrite_fd, len);
+		}
+		close(rewrite_fd);
+	}
+}
+
+// Converts a history file written by write_history to one line per entry
+static void migrate(off_t size) {
+	// Only a legacy file is read in full
+	char header[sizeof(LEGACY_HEADER) - 1];
+	if(pread(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, LEGACY_HEADER, sizeof(header)) != 0) {
+		return;
+	}
+
+	char *old = read_range(0, size);
+
+	// Decoding never makes a line longer
+	char *lines = malloc(size + 1);
+	size_t len = 0;
+
+	char *p = old + strlen(LEGACY_HEADER);
+	char *line;
+	while((line = strsep(&p, "\n"))) {
+		if(line[0] != '\0') {
+			len += strunvis(lines + len, line);
+			lines[len++] = '\n';
+		}
+	}
+
+	rewrite(lines, len);
+	free(lines);
+	free(old);
+}
+
+// Opens the journal for appending and loads its most recent lines
+void history_load(const char *path) {
+	fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0600);
+	if(fd == -1) {
+		return;
+	}
+	history_path = strdup(path);
+
+	flock(fd, LOCK_EX);
+	struct stat st;
+	if(fstat(fd, &st) == 0) {
+		migrate(st.st_size);
+	}
+	flock(fd, LOCK_UN);
+
+	flock(fd, LOCK_SH);
+	if(fstat(fd, &st) != 0) {
+		flock(fd, LOCK_UN);
+		return;
+	}
+
+	off_t start = tail_offset(st.st_size, HISTORY_LOAD_LINES);
+	char *lines = read_range(start, st.st_size);
+	flock(fd, LOCK_UN);
+
+	char *p = lines;
+	char *line;
+	while((line = strsep(&p, "\n"))) {
+		if(line[0] != '\0') {
+			add_history(line);
+		}
+	}
+
+	free(lines);
+}
+
+// Appends one line with a single write, so the lines of concurrent sessions
+// never interleave
+void history_append(const char *line) {
+	if(fd == -1) {
+		return;
+	}
+
+	size_t len = strlen(line);
+	char *record = malloc(len + 1);
+	memcpy(record, line, len);
+	record[len] = '\n';
+
+	// Compaction holds an exclusive lock while it rewrites the file
+	flock(fd, LOCK_SH);
+	write(fd, record, len + 1);
+	flock(fd, LOCK_UN);
+
+	free(record);
+}
+
+// Keeps only the most recent lines once the journal grew too large. The file
+// is rewritten in place so other sessions can keep appending to it.
+void history_compact(void) {
+	if(fd == -1) {
+		return;
+	}
+
+	flock(fd, LOCK_EX);
+
+	struct stat st;
+	if(fstat(fd, &st) == 0 && st.st_size > HISTORY_MAX_BYTES) {
+		off_t start = tail_offset(st.st_size, HISTORY_KEEP_LINES);
+		char *lines = read_range(start, st.st_size);
+		size_t len = st.st_size - start;
+
+		rewrite(lines, len);
+		free(lines);
+	}
+
+	flock(fd, LOCK_UN);
+}
@@ -0,0 +1,3 @@
+void history_load(const char *path);
+void history_append(const char *line);
+void history_compact(void);
@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+
+#include "arch.h"
+#include "dis.h"
+#include "macros.h"
+#include "hwwatch.h"
+
+#define HWWATCH_SLOTS 4
+
+#define DR6_HIT(i) (1 << (i))
+#define DR6_BS     (1 << 14)
+
+#define DR7_ENABLE(i)     (1 << (2 * (i)))
+#define DR7_RW(i, rw)     ((gpr_register_t)(rw) << (16 + 4 * (i)))
+#define DR7_LEN(i, len)   ((gpr_register_t)(len) << (18 + 4 * (i)))
+
+typedef struct {
+	bool used;
+	// Disabled while the instruction at an execute watchpoint runs once
+	bool stepping;
+	mach_vm_address_t address;
+	size_t len;
+	hwwatch_type type;
+} hwwatch_t;
+
+static hwwatch_t slots[HWWATCH_SLOTS];
+
+static char *type_names[] = {
+	[HWWATCH_EXECUTE] = "x",
+	[HWWATCH_WRITE] = "w",
+	[HWWATCH_READWRITE] = "rw",
+};
+
+bool hwwatch_parse_type(char *str, hwwatch_type *type) {
+	for(size_t i = 0; i < ELEMENTS(type_names); i++) {
+		if(type_names[i] && strcmp(str, type_names[i]) == 0) {
+			*type = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool get_debug_state(thread_act_t thread, x86_debug_state_t *state) {
+	mach_msg_type_number_t stateCount = x86_DEBUG_STATE_COUNT;
+	KERN_TRY("thread_get_state", thread_get_state(thread, x86_DEBUG_STATE, (thread_state_t)state, &stateCount), {
+		return false;
+	});
+	return true;
+}
+
+static bool set_debug_state(thread_act_t thread, x86_debug_state_t *state) {
+	KERN_TRY("thread_set_state", thread_set_state(thread, x86_DEBUG_STATE, (thread_state_t)state, x86_DEBUG_STATE_COUNT), {
+		return false;
+	});
+	return true;
+}
+
+static unsigned int len_bits(size_t len) {
+	switch(len) {
+		case 1: return 0;
+		case 2: return 1;
+		case 8: return 2;
+		default: return 3;
+	}
+}
+
+// Writes the slots to the debug registers. The status in DR6 is kept until
+// the hits it records were reported.
+static bool apply(thread_act_t thread, bool clear_status) {
+	x86_debug_state_t state;
+	if(!get_debug_state(thread, &state)) {
+		return false;
+	}
+
+	gpr_register_t dr7 = 0;
+	gpr_register_t *drs[] = {
+		&state.uds.ds.__dr0,
+		&state.uds.ds.__dr1,
+		&state.uds.ds.__dr2,
+		&state.uds.ds.__dr3,
+	};
+
+	for(int i = 0; i < HWWATCH_SLOTS; i++) {
+		hwwatch_t *w = &slots[i];
+		if(!w->used || w->stepping) {
+			*drs[i] = 0;
+			continue;
+		}
+
+		*drs[i] = w->address;
+		dr7 |= DR7_ENABLE(i) | DR7_RW(i, w->type) | DR7_LEN(i, len_bits(w->len));
+	}
+
+	if(clear_status) {
+		state.uds.ds.__dr6 = 0;
+	}
+	state.uds.ds.__dr7 = dr7;
+
+	return set_debug_state(thread, &state);
+}
+
+bool hwwatch_add(thread_act_t thread, mach_vm_address_t address, size_t len, hwwatch_type type) {
+	if(type == HWWATCH_EXECUTE) {
+		len = 1;
+	}
+
+	bool valid_len = len == 1 || len == 2 || len == 4 || (BITS == 64 && len == 8);
+	if(!valid_len || address % len != 0) {
+		printf("Length must be 1, 2, 4%s and the address aligned to it.\n", IF32("", " or 8"));
+		return false;
+	}
+
+	for(int i = 0; i < HWWATCH_SLOTS; i++) {
+		if(!slots[i].used) {
+			slots[i] = (hwwatch_t){
+				.used = true,
+				.address = address,
+				.len = len,
+				.type = type,
+			};
+
+			if(!apply(thread, true)) {
+				slots[i].used = false;
+				return false;
+			}
+
+			return true;
+		}
+	}
+
+	printf("All %d debug registers are in use.\n", HWWATCH_SLOTS);
+	return false;
+}
+
+void hwwatch_clear(thread_act_t thread) {
+	memset(slots, 0, sizeof(slots));
+	apply(thread, true);
+}
+
+void hwwatch_list(void) {
+	for(int i = 0; i < HWWATCH_SLOTS; i++) {
+		if(slots[i].used) {
+			printf("%d: 0x%llx %zu %s\n", i, slots[i].address, slots[i].len, type_names[slots[i].type]);
+		}
+	}
+}
+
+// Whether a debug exception was caused by a watchpoint rather than by single
+// stepping. The debug state is only read when a slot is in use.
+bool hwwatch_triggered(thread_act_t thread) {
+	bool used = false;
+	for(int i = 0; i < HWWATCH_SLOTS; i++) {
+		used = used || slots[i].used;
+	}
+
+	if(!used) {
+		return false;
+	}
+
+	x86_debug_state_t state;
+	if(!get_debug_state(thread, &state)) {
+		return false;
+	}
+
+	return (state.uds.ds.__dr6 & (DR6_HIT(0) | DR6_HIT(1) | DR6_HIT(2) | DR6_HIT(3))) != 0;
+}
+
+// Called after the child stopped on a debug exception. Reports every slot
+// that triggered together with the instruction and current value.
+void hwwatch_report(task_t task, thread_act_t thread, gpr_register_t pc, bool att) {
+	x86_debug_state_t state;
+	if(!get_debug_state(thread, &state)) {
+		return;
+	}
+
+	gpr_register_t dr6 = state.uds.ds.__dr6;
+
+	for(int i = 0; i < HWWATCH_SLOTS; i++) {
+		hwwatch_t *w = &slots[i];
+		if(!w->used || !(dr6 & DR6_HIT(i))) {
+			continue;
+		}
+
+		if(w->type == HWWATCH_EXECUTE) {
+			// Execute watchpoints fault before the instruction runs. The kernel
+			// drops the resume flag, so the slot is disabled while the child
+			// single steps the instruction and armed again by hwwatch_stepped.
+			printf("Watchpoint %d (x) hit at " REGISTER_FORMAT_HEX "\n", i, pc);
+			w->stepping = true;
+			continue;
+		}
+
+		uint64_t value = 0;
+		mach_vm_size_t count;
+		bool read = KERN_CALL("mach_vm_read_overwrite", mach_vm_read_overwrite(task, w->address, w->len, (mach_vm_address_t)&value, &count)) == KERN_SUCCESS;
+
+		// Data watchpoints trap after the instruction, which ends at pc
+		char insn[128];
+		if(dis_describe_before(task, pc, att, insn, sizeof(insn))) {
+			printf("Watchpoint %d (%s) hit by %s before " REGISTER_FORMAT_HEX ": ", i, type_names[w->type], insn, pc);
+		} else {
+			printf("Watchpoint %d (%s) hit by the instruction before " REGISTER_FORMAT_HEX ": ", i, type_names[w->type], pc);
+		}
+		if(read) {
+			printf("0x%llx = 0x%" PRIx64 "\n", w->address, value);
+		} else {
+			printf("0x%llx is unreadable\n", w->address);
+		}
+	}
+
+	// Clears DR6 and disables the slots that are stepped past
+	apply(thread, true);
+}
+
+// Whether the child has to single step past an execute watchpoint
+bool hwwatch_stepping(void) {
+	for(int i = 0; i < HWWATCH_SLOTS; i++) {
+		if(slots[i].stepping) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Called on every single step trap and at every stop. Arms the execute
+// watchpoints that were stepped past again and returns whether there were
+// any. Hits of the step stay in DR6 for hwwatch_report.
+bool hwwatch_stepped(thread_act_t thread) {
+	if(!hwwatch_stepping()) {
+		return false;
+	}
+
+	for(int i = 0; i < HWWATCH_SLOTS; i++) {
+		slots[i].stepping = false;
+	}
+	apply(thread, false);
+	return true;
+}
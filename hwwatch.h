@@ -0,0 +1,15 @@
+// Values are the R/W bits of DR7
+typedef enum {
+	HWWATCH_EXECUTE = 0,
+	HWWATCH_WRITE = 1,
+	HWWATCH_READWRITE = 3,
+} hwwatch_type;
+
+bool hwwatch_parse_type(char *str, hwwatch_type *type);
+bool hwwatch_add(thread_act_t thread, mach_vm_address_t address, size_t len, hwwatch_type type);
+void hwwatch_clear(thread_act_t thread);
+void hwwatch_list(void);
+bool hwwatch_triggered(thread_act_t thread);
+void hwwatch_report(task_t task, thread_act_t thread, gpr_register_t pc, bool att);
+bool hwwatch_stepping(void);
+bool hwwatch_stepped(thread_act_t thread);
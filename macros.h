@@ -0,0 +1,37 @@
+#define ELEMENTS(x) (sizeof(x) / sizeof(*x))
+
+#define LIST(x, ...)     x,
+#define STR_LIST(x, ...) #x,
+#define LIST2(x, y, ...) y,
+
+// Counted for .stats
+void stats_kernel_call(const char *name);
+
+// A kernel call whose result is handled by the caller
+#define KERN_CALL(s, x) (stats_kernel_call(s), (x))
+
+#define STD_FAIL(s, x) do { \
+	int ret = (x); \
+	if(ret != 0) { \
+		perror(s "()"); \
+		exit(ret); \
+	} \
+} while(false)
+
+#define KERN_FAIL(s, x) do { \
+	stats_kernel_call(s); \
+	kern_return_t ret = (x); \
+	if(ret != KERN_SUCCESS) { \
+		printf(s "() failed: %s\n", mach_error_string(ret)); \
+		exit(ret); \
+	} \
+} while(false)
+
+#define KERN_TRY(s, x, f) if(true) { \
+	stats_kernel_call(s); \
+	kern_return_t ret = (x); \
+	if(ret != KERN_SUCCESS) { \
+		printf(s "() failed: %s\n", mach_error_string(ret)); \
+		f \
+	} \
+} else do {} while(0)
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/param.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+
+#include "macros.h"
+#include "maps.h"
+
+#define MAX_NOTES 256
+
+// Regions returned by mach_vm_region never overlap, so a sorted array with
+// binary search gives the same O(log n) lookups as an interval tree
+static map_region_t *regions;
+static size_t region_count;
+static size_t region_capacity;
+static bool regions_valid = false;
+
+static map_note_t notes[MAX_NOTES];
+static size_t note_count;
+
+void maps_invalidate(void) {
+	regions_valid = false;
+}
+
+void maps_note(mach_vm_address_t address, mach_vm_size_t size, const char *label) {
+	if(note_count < MAX_NOTES) {
+		notes[note_count++] = (map_note_t){address, address + size, label, address + size};
+	}
+
+	maps_invalidate();
+}
+
+// Marks how much of a noted region is in use, e.g. of a heap that is mostly
+// reserved, or none of it for scratch memory
+void maps_note_used(mach_vm_address_t address, mach_vm_size_t used) {
+	for(size_t i = 0; i < note_count; i++) {
+		if(notes[i].start == address) {
+			notes[i].used_end = address + used;
+		}
+	}
+}
+
+// Drops the notes after the first count, for regions that were unmapped
+void maps_forget(size_t count) {
+	if(count < note_count) {
+		note_count = count;
+	}
+
+	maps_invalidate();
+}
+
+// The regions we mapped ourselves, in the order they were mapped
+const map_note_t *maps_notes(size_t *count) {
+	*count = note_count;
+	return notes;
+}
+
+const char *maps_label(mach_vm_address_t address) {
+	for(size_t i = 0; i < note_count; i++) {
+		if(notes[i].start <= address && address < notes[i].end) {
+			return notes[i].label;
+		}
+	}
+
+	return NULL;
+}
+
+static void refresh(task_t task) {
+	region_count = 0;
+
+	mach_vm_address_t address = 0;
+	while(true) {
+		mach_vm_size_t size;
+		vm_region_basic_info_data_64_t info;
+		mach_msg_type_number_t info_count = VM_REGION_BASIC_INFO_COUNT_64;
+		mach_port_t object_name;
+		if(KERN_CALL("mach_vm_region", mach_vm_region(task, &address, &size, VM_REGION_BASIC_INFO_64, (vm_region_info_t)&info, &info_count, &object_name)) != KERN_SUCCESS) {
+			break;
+		}
+
+		if(region_count == region_capacity) {
+			region_capacity = region_capacity? 2 * region_capacity: 256;
+			regions = realloc(regions, region_capacity * sizeof(*regions));
+		}
+
+		regions[region_count++] = (map_region_t){
+			.start = address,
+			.end = address + size,
+			.protection = info.protection,
+			.max_protection = info.max_protection,
+			.shared = info.shared,
+		};
+
+		address += size;
+	}
+
+	regions_valid = true;
+}
+
+const map_region_t *maps_regions(task_t task, size_t *count) {
+	if(!regions_valid) {
+		refresh(task);
+	}
+
+	*count = region_count;
+	return regions;
+}
+
+const map_region_t *maps_lookup(task_t task, mach_vm_address_t address) {
+	size_t count;
+	const map_region_t *r = maps_regions(task, &count);
+
+	size_t lo = 0;
+	size_t hi = count;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(address < r[mid].start) {
+			hi = mid;
+		} else if(address >= r[mid].end) {
+			lo = mid + 1;
+		} else {
+			return &r[mid];
+		}
+	}
+
+	return NULL;
+}
+
+// Conservatively checks whether code contains an instruction that can
+// enter the kernel (syscall, sysenter or int n) and so change the mappings
+bool maps_may_change(const unsigned char *code, size_t len) {
+	for(size_t i = 0; i + 1 < len; i++) {
+		if(code[i] == 0x0F && (code[i + 1] == 0x05 || code[i + 1] == 0x34)) {
+			return true;
+		}
+		if(code[i] == 0xCD) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+char *prot_string(vm_prot_t prot, char *buf) {
+	buf[0] = (prot & VM_PROT_READ)? 'r': '-';
+	buf[1] = (prot & VM_PROT_WRITE)? 'w': '-';
+	buf[2] = (prot & VM_PROT_EXECUTE)? 'x': '-';
+	buf[3] = '\0';
+	return buf;
+}
+
+static void format_size(mach_vm_size_t size, char *buf, size_t buf_len) {
+	const char *units = "BKMGT";
+	while(size >= 1024 && size % 1024 == 0 && units[1]) {
+		size /= 1024;
+		units++;
+	}
+	snprintf(buf, buf_len, "%llu%c", size, *units);
+}
+
+void maps_print(task_t task) {
+	size_t count;
+	const map_region_t *r = maps_regions(task, &count);
+
+	for(size_t i = 0; i < count; i++) {
+		char prot[4];
+		char max_prot[4];
+		char size[32];
+		format_size(r[i].end - r[i].start, size, sizeof(size));
+
+		printf("%016llx-%016llx %s/%s %8s", r[i].start, r[i].end, prot_string(r[i].protection, prot), prot_string(r[i].max_protection, max_prot), size);
+
+		for(size_t j = 0; j < note_count; j++) {
+			if(r[i].start <= notes[j].start && notes[j].start < r[i].end) {
+				printf("  %s@%llx", notes[j].label, notes[j].start);
+			}
+		}
+
+		if(r[i].shared) {
+			printf("  (shared)");
+		}
+
+		puts("");
+	}
+}
@@ -0,0 +1,27 @@
+typedef struct {
+	mach_vm_address_t start;
+	mach_vm_address_t end;
+	vm_prot_t protection;
+	vm_prot_t max_protection;
+	bool shared;
+} map_region_t;
+
+typedef struct {
+	mach_vm_address_t start;
+	mach_vm_address_t end;
+	const char *label;
+	// --record only hashes the contents up to here
+	mach_vm_address_t used_end;
+} map_note_t;
+
+void maps_invalidate(void);
+void maps_note(mach_vm_address_t address, mach_vm_size_t size, const char *label);
+void maps_note_used(mach_vm_address_t address, mach_vm_size_t used);
+void maps_forget(size_t count);
+const map_note_t *maps_notes(size_t *count);
+const char *maps_label(mach_vm_address_t address);
+const map_region_t *maps_regions(task_t task, size_t *count);
+const map_region_t *maps_lookup(task_t task, mach_vm_address_t address);
+bool maps_may_change(const unsigned char *code, size_t len);
+char *prot_string(vm_prot_t prot, char *buf);
+void maps_print(task_t task);
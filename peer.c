@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <signal.h>
+#include <mach/mach.h>
+#include <mach/machine.h>
+#include <mach-o/dyld.h>
+
+#include "event.h"
+#include "peer.h"
+
+// Whoever holds the token owns the terminal, the other side waits for it
+#define TOKEN 'T'
+
+extern char **environ;
+
+static int read_fd = -1;
+static int write_fd = -1;
+static pid_t peer_pid = -1;
+static bool waiting = false;
+static bool handed_back = false;
+
+// The other side handed the terminal back, or exited
+static void token_event(void *context, intptr_t data) {
+	char buf;
+	ssize_t len;
+	while((len = read(read_fd, &buf, sizeof(buf))) == -1 && errno == EINTR);
+	if(len != 1) {
+		exit(0);
+	}
+
+	handed_back = true;
+}
+
+// Called with the pipes of the asm_repl that spawned us
+void peer_init(int peer_read_fd, int peer_write_fd) {
+	read_fd = peer_read_fd;
+	write_fd = peer_write_fd;
+}
+
+bool peer_waiting(void) {
+	return waiting;
+}
+
+// Starts the slice of our own fat binary for the other architecture. It
+// owns the terminal right away.
+static bool spawn(int bits) {
+	char path[1024];
+	uint32_t path_size = sizeof(path);
+	if(_NSGetExecutablePath(path, &path_size) != 0) {
+		puts("Failed to find the asm_repl binary.");
+		return false;
+	}
+
+	int to_peer[2];
+	int from_peer[2];
+	if(pipe(to_peer) != 0 || pipe(from_peer) != 0) {
+		perror("pipe()");
+		return false;
+	}
+
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	cpu_type_t cpu = bits == 32? CPU_TYPE_I386: CPU_TYPE_X86_64;
+	size_t count;
+	posix_spawnattr_setbinpref_np(&attr, 1, &cpu, &count);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addclose(&actions, to_peer[1]);
+	posix_spawn_file_actions_addclose(&actions, from_peer[0]);
+
+	char read_arg[16];
+	char write_arg[16];
+	snprintf(read_arg, sizeof(read_arg), "%d", to_peer[0]);
+	snprintf(write_arg, sizeof(write_arg), "%d", from_peer[1]);
+	char *argv[] = {path, "--peer", read_arg, write_arg, NULL};
+
+	int ret = posix_spawn(&peer_pid, path, &actions, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close(to_peer[0]);
+	close(from_peer[1]);
+
+	if(ret != 0) {
+		printf("Failed to start the %d bit asm_repl: %s\n", bits, strerror(ret));
+		close(to_peer[1]);
+		close(from_peer[0]);
+		return false;
+	}
+
+	read_fd = from_peer[0];
+	write_fd = to_peer[1];
+	return true;
+}
+
+// Hands the terminal to the asm_repl of the other architecture, starting it
+// the first time, and waits until it is handed back. Both keep their child,
+// so every switch continues where that side left off. Exits once the other
+// side exits, as the session ended there.
+bool peer_switch(int bits) {
+	fflush(stdout);
+	// A side that exited is noticed by the failing write
+	signal(SIGPIPE, SIG_IGN);
+
+	static const char token = TOKEN;
+	if(write_fd == -1 || write(write_fd, &token, sizeof(token)) != sizeof(token)) {
+		// The other side is gone or was never started
+		if(write_fd != -1) {
+			close(read_fd);
+			close(write_fd);
+		}
+		if(!spawn(bits)) {
+			return false;
+		}
+	}
+
+	// Events like ^C are still handled while the other side has the terminal
+	waiting = true;
+	handed_back = false;
+	if(!event_watch_fd(read_fd, token_event, NULL)) {
+		exit(1);
+	}
+	event_run_until(&handed_back);
+	event_unwatch_fd(read_fd);
+	waiting = false;
+
+	return true;
+}
@@ -0,0 +1,3 @@
+void peer_init(int peer_read_fd, int peer_write_fd);
+bool peer_waiting(void);
+bool peer_switch(int bits);
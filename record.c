@@ -0,0 +1,488 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/param.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+
+#include "arch.h"
+#include "macros.h"
+#include "maps.h"
+#include "registers.h"
+#include "record.h"
+#include "watch.h"
+
+// A recording is a header followed by records, each starting with its tag:
+//   'L' u32 length, the line     - a line that was entered
+//   'P'                          - input_pending() was true
+//   'S' u8 reason, u8 interrupted, registers, u64 flags, u8 count, u64 hashes
+//                                - the child stopped
+// Every register is stored as u8 region, u64 value, see normalize(). The
+// hash of a region is the hash of the hashes of its pages.
+#define MAGIC "ASMR"
+#define VERSION 2
+
+#define TAG_LINE 'L'
+#define TAG_PENDING 'P'
+#define TAG_STOP 'S'
+
+#define ABSOLUTE 0xFF
+#define MAX_REGIONS 0xFF
+
+#define STACK_SIZE 0x10000
+#define HASH_CHUNK_SIZE (1024 * 1024)
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// Trap and resume flags are ours, not the child's
+#define FLAGS_MASK (~(uint64_t)0x10100)
+
+#define PAGE_START(a) ((a) & ~(mach_vm_address_t)(vm_page_size - 1))
+#define PAGE_END(a) PAGE_START((a) + vm_page_size - 1)
+
+typedef struct {
+	uint8_t region;
+	uint64_t value;
+} stored_value_t;
+
+typedef struct {
+	uint8_t reason;
+	uint8_t interrupted;
+	stored_value_t registers[REGISTERS];
+	uint64_t flags;
+	uint8_t region_count;
+	uint64_t hashes[MAX_REGIONS];
+} stop_t;
+
+// The hash of every page of a noted region as of the last stop. Only pages
+// that were written since are hashed again, the region is write-protected
+// while the child runs to find them.
+typedef struct {
+	mach_vm_address_t start;
+	mach_vm_address_t end;
+	// Pages from here on weren't hashed in full yet
+	mach_vm_address_t hashed_end;
+	uint64_t *page_hashes;
+	bool tracked;
+} region_cache_t;
+
+static FILE *record_file;
+
+static region_cache_t caches[MAX_REGIONS];
+static size_t cache_count;
+
+static unsigned char *replay_data;
+static size_t replay_len;
+static size_t replay_offset;
+static size_t replay_lines;
+static size_t replay_stops;
+static char *last_line;
+
+// Addresses differ between sessions, so values pointing into a region we
+// mapped are stored as the index of the region and the offset into it. The
+// regions are mapped in the same order in every session of the same input.
+static stored_value_t normalize(uint64_t value) {
+	size_t count;
+	const map_note_t *notes = maps_notes(&count);
+	for(size_t i = 0; i < count && i < MAX_REGIONS; i++) {
+		if(notes[i].start <= value && value < notes[i].end) {
+			return (stored_value_t){i, value - notes[i].start};
+		}
+	}
+
+	return (stored_value_t){ABSOLUTE, value};
+}
+
+static const char *register_name(size_t index) {
+	size_t i = 0;
+#define X(r) if(i++ == index) return #r
+	FOREACH_REGISTER(X)
+#undef X
+	return "?";
+}
+
+static uint64_t fnv(uint64_t hash, uint64_t value) {
+	for(int i = 0; i < 8; i++) {
+		hash = (hash ^ (value & 0xFF)) * FNV_PRIME;
+		value >>= 8;
+	}
+	return hash;
+}
+
+// Which word looks like a pointer depends on the regions, so the hashes are
+// started over whenever one is mapped or forgotten
+static void sync_caches(const map_note_t *notes, size_t count) {
+	bool same = count == cache_count;
+	for(size_t i = 0; same && i < count; i++) {
+		same = caches[i].start == notes[i].start && caches[i].end == notes[i].end;
+	}
+	if(same) {
+		return;
+	}
+
+	for(size_t i = 0; i < cache_count; i++) {
+		free(caches[i].page_hashes);
+	}
+	watch_untrack();
+
+	for(size_t i = 0; i < count; i++) {
+		caches[i] = (region_cache_t){
+			.start = notes[i].start,
+			.end = notes[i].end,
+			.hashed_end = notes[i].start,
+			.page_hashes = malloc((PAGE_END(notes[i].end) - notes[i].start) / vm_page_size * sizeof(uint64_t)),
+			.tracked = watch_track(notes[i].start, notes[i].end),
+		};
+	}
+	cache_count = count;
+}
+
+// Hashes the pages from start to end word by word, normalizing every word
+// that looks like a pointer into one of our regions
+static void hash_pages(task_t task, region_cache_t *cache, mach_vm_address_t start, mach_vm_address_t end, mach_vm_address_t low, mach_vm_address_t high) {
+	vm_offset_t data;
+	mach_msg_type_number_t data_len;
+	if(mach_vm_read(task, start, end - start, &data, &data_len) != KERN_SUCCESS) {
+		if(end - start > vm_page_size) {
+			for(mach_vm_address_t page = start; page < end; page += vm_page_size) {
+				hash_pages(task, cache, page, MIN(page + vm_page_size, end), low, high);
+			}
+		} else {
+			// Unmapped by the child, which is part of the state as well
+			cache->page_hashes[(start - cache->start) / vm_page_size] = fnv(FNV_OFFSET, start - cache->start);
+		}
+		return;
+	}
+
+	const gpr_register_t *words = (const gpr_register_t *)data;
+	size_t words_per_page = vm_page_size / sizeof(*words);
+	size_t word_count = (end - start) / sizeof(*words);
+	for(size_t first = 0; first < word_count; first += words_per_page) {
+		uint64_t hash = FNV_OFFSET;
+		for(size_t i = first; i < MIN(first + words_per_page, word_count); i++) {
+			if(words[i] < low || words[i] >= high) {
+				hash = fnv(hash, words[i]);
+			} else {
+				stored_value_t v = normalize(words[i]);
+				hash = fnv(fnv(hash, v.region), v.value);
+			}
+		}
+		cache->page_hashes[(start - cache->start) / vm_page_size + first / words_per_page] = hash;
+	}
+
+	mach_vm_deallocate(mach_task_self(), data, data_len);
+}
+
+// Pages past the part hashed last time have no hash, and the page it ended in
+// was only hashed in part
+static bool needs_hash(const region_cache_t *cache, mach_vm_address_t page) {
+	return page >= PAGE_START(cache->hashed_end) || !cache->tracked || watch_dirty(page);
+}
+
+// Hashes the used part of a region from the hashes of its pages, which are
+// read again in runs of up to HASH_CHUNK_SIZE where they may have changed.
+// Called before watch_print_changes() clears which pages are dirty.
+static uint64_t hash_region(task_t task, const map_note_t *note, region_cache_t *cache, mach_vm_address_t low, mach_vm_address_t high) {
+	// The page a smaller used part ends in is hashed again in part
+	cache->hashed_end = MIN(cache->hashed_end, note->used_end);
+
+	for(mach_vm_address_t page = note->start; page < note->used_end;) {
+		if(!needs_hash(cache, page)) {
+			page += vm_page_size;
+			continue;
+		}
+
+		mach_vm_address_t end = page + vm_page_size;
+		while(end < note->used_end && end - page < HASH_CHUNK_SIZE && needs_hash(cache, end)) {
+			end += vm_page_size;
+		}
+		hash_pages(task, cache, page, MIN(end, note->used_end), low, high);
+		page = end;
+	}
+	cache->hashed_end = note->used_end;
+
+	uint64_t hash = FNV_OFFSET;
+	for(mach_vm_address_t page = note->start; page < note->used_end; page += vm_page_size) {
+		hash = fnv(hash, cache->page_hashes[(page - note->start) / vm_page_size]);
+	}
+	return hash;
+}
+
+static void capture(task_t task, x86_thread_state_t *state, int reason, bool interrupted, stop_t *stop) {
+	stop->reason = reason;
+	stop->interrupted = interrupted;
+
+	size_t i = 0;
+#define X(r) stop->registers[i++] = normalize(state->uts.ts.__##r)
+	FOREACH_REGISTER(X)
+#undef X
+
+	stop->flags = state->uts.ts.flags_register & FLAGS_MASK;
+
+	size_t count;
+	const map_note_t *notes = maps_notes(&count);
+	stop->region_count = count < MAX_REGIONS? count: MAX_REGIONS;
+
+	mach_vm_address_t low = UINT64_MAX;
+	mach_vm_address_t high = 0;
+	for(size_t j = 0; j < stop->region_count; j++) {
+		low = notes[j].start < low? notes[j].start: low;
+		high = notes[j].end > high? notes[j].end: high;
+	}
+
+	sync_caches(notes, stop->region_count);
+	for(size_t j = 0; j < stop->region_count; j++) {
+		stop->hashes[j] = hash_region(task, &notes[j], &caches[j], low, high);
+	}
+}
+
+bool record_open(const char *path) {
+	record_file = fopen(path, "wb");
+	if(!record_file) {
+		perror("fopen()");
+		return false;
+	}
+
+	uint8_t bits = BITS;
+	fwrite(MAGIC, 1, strlen(MAGIC), record_file);
+	fputc(VERSION, record_file);
+	fwrite(&bits, sizeof(bits), 1, record_file);
+	return true;
+}
+
+// The whole recording is read up front so the replay never waits for it
+bool replay_open(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if(!f) {
+		perror("fopen()");
+		return false;
+	}
+
+	fseek(f, 0, SEEK_END);
+	replay_len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	replay_data = malloc(replay_len);
+	bool ok = fread(replay_data, 1, replay_len, f) == replay_len;
+	fclose(f);
+
+	size_t header_len = strlen(MAGIC) + 2;
+	if(!ok || replay_len < header_len || memcmp(replay_data, MAGIC, strlen(MAGIC)) != 0 || replay_data[strlen(MAGIC)] != VERSION) {
+		printf("%s isn't a recording.\n", path);
+		return false;
+	}
+
+	if(replay_data[strlen(MAGIC) + 1] != BITS) {
+		printf("%s was recorded with %d bits, run the %d bit version to replay it.\n", path, replay_data[strlen(MAGIC) + 1], replay_data[strlen(MAGIC) + 1]);
+		return false;
+	}
+
+	replay_offset = header_len;
+	return true;
+}
+
+// Gives a recorded session the same start every time. The registers still
+// hold whatever the forked child had in them, so they are cleared and the
+// stack is moved to a region of our own.
+void record_prepare(task_t task, thread_act_t thread) {
+	mach_vm_address_t stack = 0;
+	KERN_FAIL("mach_vm_allocate", mach_vm_allocate(task, &stack, STACK_SIZE, VM_FLAGS_ANYWHERE));
+	maps_note(stack, STACK_SIZE, "stack");
+
+	x86_thread_state_t state;
+	mach_msg_type_number_t count = x86_THREAD_STATE_COUNT;
+	KERN_FAIL("thread_get_state", thread_get_state(thread, x86_THREAD_STATE, (thread_state_t)&state, &count));
+
+	gpr_register_t pc = state.uts.ts.pc_register;
+#define X(r) state.uts.ts.__##r = 0
+	FOREACH_REGISTER(X)
+#undef X
+	state.uts.ts.pc_register = pc;
+	state.uts.ts.IF32(__esp, __rsp) = stack + STACK_SIZE;
+
+	KERN_FAIL("thread_set_state", thread_set_state(thread, x86_THREAD_STATE, (thread_state_t)&state, count));
+}
+
+static void write_stop(const stop_t *stop) {
+	fputc(TAG_STOP, record_file);
+	fwrite(&stop->reason, sizeof(stop->reason), 1, record_file);
+	fwrite(&stop->interrupted, sizeof(stop->interrupted), 1, record_file);
+	for(size_t i = 0; i < REGISTERS; i++) {
+		fwrite(&stop->registers[i].region, sizeof(stop->registers[i].region), 1, record_file);
+		fwrite(&stop->registers[i].value, sizeof(stop->registers[i].value), 1, record_file);
+	}
+	fwrite(&stop->flags, sizeof(stop->flags), 1, record_file);
+	fwrite(&stop->region_count, sizeof(stop->region_count), 1, record_file);
+	fwrite(stop->hashes, sizeof(*stop->hashes), stop->region_count, record_file);
+}
+
+void record_line(const char *line) {
+	uint32_t len = strlen(line);
+	fputc(TAG_LINE, record_file);
+	fwrite(&len, sizeof(len), 1, record_file);
+	fwrite(line, 1, len, record_file);
+}
+
+void record_pending(void) {
+	fputc(TAG_PENDING, record_file);
+}
+
+void record_stop(task_t task, x86_thread_state_t *state, int reason, bool interrupted) {
+	stop_t stop;
+	capture(task, state, reason, interrupted, &stop);
+	write_stop(&stop);
+	// A session that ends with a crash should still be replayable
+	fflush(record_file);
+}
+
+static bool take(void *out, size_t len) {
+	if(replay_len - replay_offset < len) {
+		return false;
+	}
+
+	memcpy(out, replay_data + replay_offset, len);
+	replay_offset += len;
+	return true;
+}
+
+static int peek_tag(void) {
+	return replay_offset < replay_len? replay_data[replay_offset]: EOF;
+}
+
+static bool read_stop(stop_t *stop) {
+	bool ok = take(&stop->reason, sizeof(stop->reason)) && take(&stop->interrupted, sizeof(stop->interrupted));
+	for(size_t i = 0; ok && i < REGISTERS; i++) {
+		ok = take(&stop->registers[i].region, sizeof(stop->registers[i].region)) && take(&stop->registers[i].value, sizeof(stop->registers[i].value));
+	}
+	return ok && take(&stop->flags, sizeof(stop->flags)) && take(&stop->region_count, sizeof(stop->region_count)) && take(stop->hashes, stop->region_count * sizeof(*stop->hashes));
+}
+
+static void finish(void) {
+	fprintf(stderr, "Replayed %zu lines and %zu stops without a divergence.\n", replay_lines, replay_stops);
+	exit(0);
+}
+
+static void print_value(const char *name, stored_value_t v) {
+	size_t count;
+	const map_note_t *notes = maps_notes(&count);
+	if(v.region == ABSOLUTE) {
+		fprintf(stderr, "%s0x%" PRIx64, name, v.value);
+	} else {
+		fprintf(stderr, "%s%s+0x%" PRIx64, name, v.region < count? notes[v.region].label: "?", v.value);
+	}
+}
+
+__attribute__((noreturn)) static void diverged(const char *what) {
+	if(last_line) {
+		fprintf(stderr, "Diverged after line %zu (%s): %s\n", replay_lines, last_line, what);
+	} else {
+		fprintf(stderr, "Diverged at the start: %s\n", what);
+	}
+	exit(1);
+}
+
+// Returns the next recorded line, the replay ends once there are none left
+char *replay_line(void) {
+	int tag = peek_tag();
+	if(tag == EOF) {
+		finish();
+	}
+	if(tag == TAG_STOP) {
+		diverged("the recorded child was resumed, but the line didn't resume it");
+	}
+
+	replay_offset++;
+	uint32_t len;
+	if(!take(&len, sizeof(len)) || replay_len - replay_offset < len) {
+		diverged("the recording is truncated");
+	}
+
+	char *line = strndup((char *)replay_data + replay_offset, len);
+	replay_offset += len;
+
+	free(last_line);
+	last_line = strdup(line);
+	replay_lines++;
+	return line;
+}
+
+bool replay_pending(void) {
+	if(peek_tag() != TAG_PENDING) {
+		return false;
+	}
+
+	replay_offset++;
+	return true;
+}
+
+// Compares a stop with the recorded one and reports the first difference
+void replay_stop(task_t task, x86_thread_state_t *state, int reason) {
+	if(peek_tag() != TAG_STOP) {
+		diverged("the child stopped, but the recorded child didn't");
+	}
+	replay_offset++;
+
+	stop_t recorded;
+	if(!read_stop(&recorded)) {
+		diverged("the recording is truncated");
+	}
+	replay_stops++;
+
+	stop_t stop;
+	capture(task, state, reason, false, &stop);
+
+	char what[256];
+	if(stop.reason != recorded.reason) {
+		snprintf(what, sizeof(what), "the child stopped for another reason (%d instead of %d)", stop.reason, recorded.reason);
+		diverged(what);
+	}
+
+	for(size_t i = 0; i < REGISTERS; i++) {
+		if(stop.registers[i].region != recorded.registers[i].region || stop.registers[i].value != recorded.registers[i].value) {
+			fprintf(stderr, "%s: ", register_name(i));
+			print_value("recorded ", recorded.registers[i]);
+			print_value(", replayed ", stop.registers[i]);
+			fprintf(stderr, "\n");
+			snprintf(what, sizeof(what), "%s differs", register_name(i));
+			diverged(what);
+		}
+	}
+
+	if(stop.flags != recorded.flags) {
+		snprintf(what, sizeof(what), "flags differ (recorded 0x%" PRIx64 ", replayed 0x%" PRIx64 ")", recorded.flags, stop.flags);
+		diverged(what);
+	}
+
+	if(stop.region_count != recorded.region_count) {
+		snprintf(what, sizeof(what), "%d regions were mapped instead of %d", stop.region_count, recorded.region_count);
+		diverged(what);
+	}
+
+	size_t count;
+	const map_note_t *notes = maps_notes(&count);
+	for(size_t i = 0; i < stop.region_count; i++) {
+		if(stop.hashes[i] != recorded.hashes[i]) {
+			snprintf(what, sizeof(what), "the memory of %s@0x%llx differs", notes[i].label, notes[i].start);
+			diverged(what);
+		}
+	}
+}
+
+// Called before the child is resumed. A recorded child that had to be
+// interrupted would run forever, so the replay ends there.
+void replay_resume(void) {
+	if(peek_tag() != TAG_STOP) {
+		return;
+	}
+
+	size_t offset = replay_offset++;
+	stop_t next;
+	if(read_stop(&next) && next.interrupted) {
+		fprintf(stderr, "The recorded child was interrupted after line %zu, which can't be replayed.\n", replay_lines);
+		finish();
+	}
+	replay_offset = offset;
+}
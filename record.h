@@ -0,0 +1,10 @@
+bool record_open(const char *path);
+bool replay_open(const char *path);
+void record_prepare(task_t task, thread_act_t thread);
+void record_line(const char *line);
+void record_pending(void);
+void record_stop(task_t task, x86_thread_state_t *state, int reason, bool interrupted);
+char *replay_line(void);
+bool replay_pending(void);
+void replay_stop(task_t task, x86_thread_state_t *state, int reason);
+void replay_resume(void);
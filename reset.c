@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+
+#include "arch.h"
+#include "macros.h"
+#include "maps.h"
+#include "reset.h"
+#include "watch.h"
+
+// A private region of the child and, if it could be copied, its copy in our
+// own address space
+typedef struct {
+	mach_vm_address_t start;
+	mach_vm_address_t end;
+	vm_prot_t protection;
+	mach_vm_address_t copy;
+} saved_region_t;
+
+static saved_region_t *saved;
+static size_t saved_count;
+static size_t saved_notes;
+static bool have_snapshot = false;
+
+static x86_thread_state_t saved_state;
+static x86_float_state_t saved_float_state;
+
+// Takes a copy-on-write snapshot of the child, so neither side pays for the
+// pages until one of them writes to them
+bool reset_save(task_t task, thread_act_t thread) {
+	mach_msg_type_number_t count = x86_THREAD_STATE_COUNT;
+	KERN_TRY("thread_get_state", thread_get_state(thread, x86_THREAD_STATE, (thread_state_t)&saved_state, &count), {
+		return false;
+	});
+	count = x86_FLOAT_STATE_COUNT;
+	KERN_TRY("thread_get_state", thread_get_state(thread, x86_FLOAT_STATE, (thread_state_t)&saved_float_state, &count), {
+		return false;
+	});
+
+	size_t region_count;
+	maps_invalidate();
+	const map_region_t *regions = maps_regions(task, &region_count);
+
+	saved = realloc(saved, region_count * sizeof(*saved));
+	saved_count = 0;
+	for(size_t i = 0; i < region_count; i++) {
+		const map_region_t *r = &regions[i];
+		// The shared cache and the commpage are the same for every process
+		if(r->shared) {
+			continue;
+		}
+
+		saved_region_t *s = &saved[saved_count++];
+		*s = (saved_region_t){
+			.start = r->start,
+			.end = r->end,
+			.protection = r->protection,
+			.copy = 0,
+		};
+
+		// Guard pages can't be copied, they are only protected again
+		vm_prot_t cur;
+		vm_prot_t max;
+		if(KERN_CALL("mach_vm_remap", mach_vm_remap(mach_task_self(), &s->copy, s->end - s->start, 0, VM_FLAGS_ANYWHERE, task, s->start, true, &cur, &max, VM_INHERIT_NONE)) != KERN_SUCCESS) {
+			s->copy = 0;
+		}
+	}
+
+	maps_notes(&saved_notes);
+	have_snapshot = true;
+	return true;
+}
+
+static bool was_saved(mach_vm_address_t start, mach_vm_address_t end) {
+	for(size_t i = 0; i < saved_count; i++) {
+		if(saved[i].start <= start && end <= saved[i].end) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Puts the memory and the registers of the child back to the snapshot. Only
+// the pages either side wrote since are copied.
+bool reset_restore(task_t task, thread_act_t thread) {
+	if(!have_snapshot) {
+		return false;
+	}
+
+	// Whatever was mapped since the snapshot goes away
+	size_t region_count;
+	maps_invalidate();
+	const map_region_t *regions = maps_regions(task, &region_count);
+	for(size_t i = 0; i < region_count; i++) {
+		const map_region_t *r = &regions[i];
+		if(!r->shared && !was_saved(r->start, r->end)) {
+			KERN_CALL("mach_vm_deallocate", mach_vm_deallocate(task, r->start, r->end - r->start));
+		}
+	}
+
+	bool ok = true;
+	for(size_t i = 0; i < saved_count; i++) {
+		saved_region_t *s = &saved[i];
+		mach_vm_size_t size = s->end - s->start;
+		if(s->copy) {
+			mach_vm_address_t address = s->start;
+			vm_prot_t cur;
+			vm_prot_t max;
+			KERN_TRY("mach_vm_remap", mach_vm_remap(task, &address, size, 0, VM_FLAGS_FIXED | VM_FLAGS_OVERWRITE, mach_task_self(), s->copy, true, &cur, &max, VM_INHERIT_DEFAULT), {
+				ok = false;
+				continue;
+			});
+		}
+		KERN_CALL("mach_vm_protect", mach_vm_protect(task, s->start, size, false, s->protection));
+	}
+	maps_invalidate();
+	maps_forget(saved_notes);
+	watch_touch_all();
+
+	KERN_TRY("thread_set_state", thread_set_state(thread, x86_THREAD_STATE, (thread_state_t)&saved_state, x86_THREAD_STATE_COUNT), {
+		return false;
+	});
+	KERN_TRY("thread_set_state", thread_set_state(thread, x86_FLOAT_STATE, (thread_state_t)&saved_float_state, x86_FLOAT_STATE_COUNT), {
+		return false;
+	});
+
+	return ok;
+}
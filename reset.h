@@ -0,0 +1,2 @@
+bool reset_save(task_t task, thread_act_t thread);
+bool reset_restore(task_t task, thread_act_t thread);
@@ -0,0 +1,420 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+
+#include "arch.h"
+#include "alloc.h"
+#include "float_registers.h"
+#include "macros.h"
+#include "registers.h"
+#include "state.h"
+#include "watch.h"
+
+#define STATE_MAGIC "ASMS"
+#define STATE_VERSION 1
+#define STATE_NAME_SIZE 64
+
+// Everything is at a fixed offset, so a loaded state is used straight from
+// the mapping of its file
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t bits;
+	// x86_AVX_STATE, or x86_FLOAT_STATE on a CPU without AVX
+	uint32_t vector_flavor;
+	uint32_t alloc_count;
+	uint32_t reserved;
+	x86_thread_state_t thread;
+	x86_avx_state_t vector;
+} state_header_t;
+
+// Followed by the contents of every named allocation, each page aligned
+typedef struct {
+	char name[STATE_NAME_SIZE];
+	uint64_t address;
+	uint64_t size;
+	uint64_t offset;
+} state_alloc_t;
+
+typedef struct {
+	const unsigned char *data;
+	size_t size;
+	const state_header_t *header;
+	const state_alloc_t *allocs;
+} state_file_t;
+
+static bool valid_name(const char *name) {
+	if(!name[0] || name[0] == '.' || strlen(name) >= STATE_NAME_SIZE) {
+		return false;
+	}
+
+	return strchr(name, '/') == NULL;
+}
+
+static char *state_path(const char *name, bool create_dir) {
+	char *dir;
+	asprintf(&dir, "%s/%s", getenv("HOME"), ".asm_repl_states");
+	if(create_dir) {
+		mkdir(dir, 0700);
+	}
+
+	char *path;
+	asprintf(&path, "%s/%s.state", dir, name);
+	free(dir);
+	return path;
+}
+
+static uint64_t page_align(uint64_t x) {
+	return (x + vm_page_size - 1) & ~((uint64_t)vm_page_size - 1);
+}
+
+static bool map_state(const char *name, state_file_t *file) {
+	if(!valid_name(name)) {
+		printf("Invalid state name: %s\n", name);
+		return false;
+	}
+
+	char *path = state_path(name, false);
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if(fd == -1) {
+		printf("No state named %s\n", name);
+		return false;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(state_header_t)) {
+		printf("The state %s is corrupt.\n", name);
+		close(fd);
+		return false;
+	}
+
+	file->size = st.st_size;
+	file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(file->data == MAP_FAILED) {
+		perror("mmap()");
+		return false;
+	}
+
+	file->header = (const state_header_t *)file->data;
+	file->allocs = (const state_alloc_t *)(file->header + 1);
+
+	const state_header_t *h = file->header;
+	bool valid = memcmp(h->magic, STATE_MAGIC, sizeof(h->magic)) == 0 && h->version == STATE_VERSION;
+	valid = valid && sizeof(*h) + h->alloc_count * sizeof(state_alloc_t) <= file->size;
+	for(uint32_t i = 0; valid && i < h->alloc_count; i++) {
+		const state_alloc_t *a = &file->allocs[i];
+		valid = a->offset <= file->size && a->size <= file->size - a->offset && memchr(a->name, '\0', sizeof(a->name));
+	}
+
+	if(!valid) {
+		printf("The state %s is corrupt.\n", name);
+		munmap((void *)file->data, file->size);
+		return false;
+	}
+
+	return true;
+}
+
+static void unmap_state(state_file_t *file) {
+	munmap((void *)file->data, file->size);
+}
+
+// Fills the mapping of a new state file
+static bool fill_state(task_t task, thread_act_t thread, unsigned char *data, const named_alloc_t *names, size_t count) {
+	state_header_t *header = (state_header_t *)data;
+	memcpy(header->magic, STATE_MAGIC, sizeof(header->magic));
+	header->version = STATE_VERSION;
+	header->bits = BITS;
+	header->alloc_count = count;
+
+	mach_msg_type_number_t state_count = x86_THREAD_STATE_COUNT;
+	KERN_TRY("thread_get_state", thread_get_state(thread, x86_THREAD_STATE, (thread_state_t)&header->thread, &state_count), {
+		return false;
+	});
+
+	header->vector_flavor = x86_AVX_STATE;
+	state_count = x86_AVX_STATE_COUNT;
+	if(KERN_CALL("thread_get_state", thread_get_state(thread, x86_AVX_STATE, (thread_state_t)&header->vector, &state_count)) != KERN_SUCCESS) {
+		// The float state is a prefix of the AVX state
+		header->vector_flavor = x86_FLOAT_STATE;
+		state_count = x86_FLOAT_STATE_COUNT;
+		KERN_TRY("thread_get_state", thread_get_state(thread, x86_FLOAT_STATE, (thread_state_t)&header->vector, &state_count), {
+			return false;
+		});
+	}
+
+	state_alloc_t *allocs = (state_alloc_t *)(header + 1);
+	uint64_t offset = page_align(sizeof(state_header_t) + count * sizeof(state_alloc_t));
+	for(size_t i = 0; i < count; i++) {
+		state_alloc_t *a = &allocs[i];
+		snprintf(a->name, sizeof(a->name), "%s", names[i].name);
+		a->address = names[i].address;
+		a->size = names[i].size;
+		a->offset = offset;
+		offset += page_align(a->size);
+
+		mach_vm_size_t read;
+		KERN_TRY("mach_vm_read_overwrite", mach_vm_read_overwrite(task, a->address, a->size, (mach_vm_address_t)(data + a->offset), &read), {
+			return false;
+		});
+	}
+
+	return true;
+}
+
+// Writes the registers and every named allocation to a file. It's written
+// next to the old one and renamed, so a state is never half written.
+bool state_save(task_t task, thread_act_t thread, const char *name) {
+	if(!valid_name(name)) {
+		printf("Invalid state name: %s\n", name);
+		return false;
+	}
+
+	size_t count;
+	const named_alloc_t *names = alloc_names(&count);
+
+	uint64_t size = page_align(sizeof(state_header_t) + count * sizeof(state_alloc_t));
+	for(size_t i = 0; i < count; i++) {
+		size += page_align(names[i].size);
+	}
+
+	char *path = state_path(name, true);
+	char *tmp_path;
+	asprintf(&tmp_path, "%s.tmp", path);
+
+	bool ok = false;
+	int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if(fd == -1 || ftruncate(fd, size) != 0) {
+		perror("open()");
+	} else {
+		unsigned char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(data == MAP_FAILED) {
+			perror("mmap()");
+		} else {
+			ok = fill_state(task, thread, data, names, count);
+			munmap(data, size);
+		}
+	}
+
+	if(fd != -1) {
+		close(fd);
+	}
+
+	if(ok && rename(tmp_path, path) != 0) {
+		perror("rename()");
+		ok = false;
+	}
+
+	if(ok) {
+		printf("Saved the registers and %zu allocations to %s\n", count, path);
+	} else {
+		unlink(tmp_path);
+	}
+
+	free(tmp_path);
+	free(path);
+	return ok;
+}
+
+// Writes the allocations straight from the mapping and the registers with
+// one call per register set. Allocations that are missing are made, and
+// registers that pointed into an allocation that moved are moved with it.
+bool state_load(task_t task, thread_act_t thread, const char *name) {
+	state_file_t file;
+	if(!map_state(name, &file)) {
+		return false;
+	}
+
+	const state_header_t *header = file.header;
+	if(header->bits != BITS) {
+		printf("The state %s is from the %d bit asm_repl, use .bits %d first.\n", name, header->bits, header->bits);
+		unmap_state(&file);
+		return false;
+	}
+
+	x86_thread_state_t thread_state = header->thread;
+
+	bool ok = true;
+	for(uint32_t i = 0; i < header->alloc_count; i++) {
+		const state_alloc_t *a = &file.allocs[i];
+
+		mach_vm_address_t address;
+		mach_vm_size_t size = a->size;
+		if(alloc_lookup(a->name, strlen(a->name), &address)) {
+			size_t count;
+			const named_alloc_t *names = alloc_names(&count);
+			for(size_t j = 0; j < count; j++) {
+				if(strcmp(names[j].name, a->name) == 0 && names[j].size < size) {
+					printf("$%s is smaller than in the state, only %llu bytes are loaded.\n", a->name, names[j].size);
+					size = names[j].size;
+				}
+			}
+		} else if(!alloc_named(task, a->name, a->size, 0, &address)) {
+			ok = false;
+			continue;
+		}
+
+		KERN_TRY("mach_vm_write", mach_vm_write(task, address, (vm_offset_t)(file.data + a->offset), size), {
+			ok = false;
+			continue;
+		});
+		watch_touch(address, size);
+
+		if(address != a->address) {
+#define X(r) \
+			if(a->address <= thread_state.uts.ts.__##r && thread_state.uts.ts.__##r < a->address + a->size) { \
+				thread_state.uts.ts.__##r += address - a->address; \
+			}
+			FOREACH_REGISTER(X)
+#undef X
+		}
+	}
+
+	KERN_TRY("thread_set_state", thread_set_state(thread, x86_THREAD_STATE, (thread_state_t)&thread_state, x86_THREAD_STATE_COUNT), {
+		ok = false;
+	});
+
+	mach_msg_type_number_t vector_count = header->vector_flavor == x86_AVX_STATE? x86_AVX_STATE_COUNT: x86_FLOAT_STATE_COUNT;
+	KERN_TRY("thread_set_state", thread_set_state(thread, header->vector_flavor, (thread_state_t)&header->vector, vector_count), {
+		ok = false;
+	});
+
+	unmap_state(&file);
+	return ok;
+}
+
+static void print_vector(const _STRUCT_XMM_REG *low, const _STRUCT_XMM_REG *high) {
+	uint64_t parts[4];
+	memcpy(parts, low, sizeof(*low));
+	if(high) {
+		memcpy(parts + 2, high, sizeof(*high));
+		printf(" 0x%016" PRIx64 "%016" PRIx64 "%016" PRIx64 "%016" PRIx64, parts[3], parts[2], parts[1], parts[0]);
+	} else {
+		printf(" 0x%016" PRIx64 "%016" PRIx64, parts[1], parts[0]);
+	}
+}
+
+static const state_alloc_t *find_alloc(const state_file_t *file, const char *name) {
+	for(uint32_t i = 0; i < file->header->alloc_count; i++) {
+		if(strcmp(file->allocs[i].name, name) == 0) {
+			return &file->allocs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void diff_allocs(const state_file_t *a, const state_file_t *b, const char *a_name, const char *b_name) {
+	for(uint32_t i = 0; i < a->header->alloc_count; i++) {
+		const state_alloc_t *x = &a->allocs[i];
+		const state_alloc_t *y = find_alloc(b, x->name);
+		if(!y) {
+			printf("$%s: only in %s\n", x->name, a_name);
+			continue;
+		}
+
+		uint64_t size = x->size < y->size? x->size: y->size;
+		const unsigned char *p = a->data + x->offset;
+		const unsigned char *q = b->data + y->offset;
+		uint64_t differing = 0;
+		uint64_t first = 0;
+		for(uint64_t j = 0; j < size; j++) {
+			if(p[j] != q[j]) {
+				if(differing++ == 0) {
+					first = j;
+				}
+			}
+		}
+
+		if(x->size != y->size) {
+			printf("$%s: %llu bytes in %s, %llu bytes in %s\n", x->name, (unsigned long long)x->size, a_name, (unsigned long long)y->size, b_name);
+		}
+		if(differing) {
+			printf("$%s: %llu bytes differ, the first at +0x%llx\n", x->name, (unsigned long long)differing, (unsigned long long)first);
+		}
+	}
+
+	for(uint32_t i = 0; i < b->header->alloc_count; i++) {
+		if(!find_alloc(a, b->allocs[i].name)) {
+			printf("$%s: only in %s\n", b->allocs[i].name, b_name);
+		}
+	}
+}
+
+// Prints every register and allocation that differs between two states
+bool state_diff(const char *a_name, const char *b_name) {
+	state_file_t a;
+	state_file_t b;
+	if(!map_state(a_name, &a)) {
+		return false;
+	}
+	if(!map_state(b_name, &b)) {
+		unmap_state(&a);
+		return false;
+	}
+
+	const state_header_t *x = a.header;
+	const state_header_t *y = b.header;
+	if(x->bits != y->bits) {
+		printf("%s is a %d bit state, %s a %d bit state.\n", a_name, x->bits, b_name, y->bits);
+		unmap_state(&a);
+		unmap_state(&b);
+		return false;
+	}
+
+	size_t differences = 0;
+#define X(r) \
+	if(x->thread.uts.ts.__##r != y->thread.uts.ts.__##r) { \
+		printf("%-7s 0x" REGISTER_FORMAT_HEX " 0x" REGISTER_FORMAT_HEX "\n", #r, x->thread.uts.ts.__##r, y->thread.uts.ts.__##r); \
+		differences++; \
+	}
+	FOREACH_REGISTER(X)
+#undef X
+
+	if(x->thread.uts.ts.flags_register != y->thread.uts.ts.flags_register) {
+		printf("%-7s 0x" REGISTER_FORMAT_HEX " 0x" REGISTER_FORMAT_HEX "\n", IF32("eflags", "rflags"), x->thread.uts.ts.flags_register, y->thread.uts.ts.flags_register);
+		differences++;
+	}
+
+	// The vector registers are consecutive in both flavors
+	bool ymm = x->vector_flavor == x86_AVX_STATE && y->vector_flavor == x86_AVX_STATE;
+	const _STRUCT_XMM_REG *x_low = &x->vector.ufs.IF32(as32, as64).__fpu_xmm0;
+	const _STRUCT_XMM_REG *y_low = &y->vector.ufs.IF32(as32, as64).__fpu_xmm0;
+	const _STRUCT_XMM_REG *x_high = &x->vector.ufs.IF32(as32, as64).__fpu_ymmh0;
+	const _STRUCT_XMM_REG *y_high = &y->vector.ufs.IF32(as32, as64).__fpu_ymmh0;
+	for(int i = 0; i < FLOAT_REGISTERS; i++) {
+		bool low_differs = memcmp(&x_low[i], &y_low[i], sizeof(x_low[i])) != 0;
+		bool high_differs = ymm && memcmp(&x_high[i], &y_high[i], sizeof(x_high[i])) != 0;
+		if(!low_differs && !high_differs) {
+			continue;
+		}
+
+		printf("%s%-4d", ymm? "ymm": "xmm", i);
+		print_vector(&x_low[i], ymm? &x_high[i]: NULL);
+		print_vector(&y_low[i], ymm? &y_high[i]: NULL);
+		puts("");
+		differences++;
+	}
+
+	diff_allocs(&a, &b, a_name, b_name);
+
+	if(differences == 0) {
+		puts("The registers are the same.");
+	}
+
+	unmap_state(&a);
+	unmap_state(&b);
+	return true;
+}
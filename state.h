@@ -0,0 +1,3 @@
+bool state_save(task_t task, thread_act_t thread, const char *name);
+bool state_load(task_t task, thread_act_t thread, const char *name);
+bool state_diff(const char *a_name, const char *b_name);
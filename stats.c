@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <mach/mach_time.h>
+
+#include "stats.h"
+
+// Every power of two is split into this many buckets, so a percentile is
+// off by at most a quarter
+#define SUB_BUCKETS 4
+#define BUCKETS (64 * SUB_BUCKETS)
+
+// Kernel calls are counted per call site name, which is a string literal
+#define KERNEL_CALL_SLOTS 256
+
+typedef struct {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t buckets[BUCKETS];
+} histogram_t;
+
+typedef struct {
+	const char *name;
+	uint64_t count;
+} kernel_call_t;
+
+static histogram_t histograms[PHASES];
+static kernel_call_t kernel_calls[KERNEL_CALL_SLOTS];
+
+static const char *phase_names[] = {
+	FOREACH_PHASE(PHASE_STR_LIST)
+};
+
+static size_t bucket(uint64_t ticks) {
+	if(ticks < SUB_BUCKETS) {
+		return ticks;
+	}
+
+	int log = 63 - __builtin_clzll(ticks);
+	uint64_t top = ticks >> (log - 2);
+	return (log - 1) * SUB_BUCKETS + (top - SUB_BUCKETS);
+}
+
+// The largest value that falls into a bucket
+static uint64_t bucket_limit(size_t b) {
+	if(b < SUB_BUCKETS) {
+		return b;
+	}
+
+	int log = b / SUB_BUCKETS + 1;
+	uint64_t top = b % SUB_BUCKETS + SUB_BUCKETS;
+	return ((top + 1) << (log - 2)) - 1;
+}
+
+uint64_t stats_now(void) {
+	return mach_absolute_time();
+}
+
+// Adds the time since start to a phase and returns the current time, so
+// consecutive phases can be chained
+uint64_t stats_add(stats_phase_t phase, uint64_t start) {
+	uint64_t now = mach_absolute_time();
+	uint64_t ticks = now - start;
+
+	histogram_t *h = &histograms[phase];
+	h->count++;
+	h->total += ticks;
+	if(ticks > h->max) {
+		h->max = ticks;
+	}
+	h->buckets[bucket(ticks)]++;
+
+	return now;
+}
+
+// The exception handler runs on the event loop as well, so every call is
+// counted from the main thread
+void stats_kernel_call(const char *name) {
+	size_t slot = ((uintptr_t)name >> 3) % KERNEL_CALL_SLOTS;
+	for(size_t i = 0; i < KERNEL_CALL_SLOTS; i++) {
+		kernel_call_t *c = &kernel_calls[(slot + i) % KERNEL_CALL_SLOTS];
+		if(!c->name) {
+			c->name = name;
+		}
+
+		if(c->name == name) {
+			c->count++;
+			return;
+		}
+	}
+}
+
+static uint64_t percentile(const histogram_t *h, unsigned int p) {
+	uint64_t target = (h->count * p + 99) / 100;
+	uint64_t seen = 0;
+	for(size_t b = 0; b < BUCKETS; b++) {
+		seen += h->buckets[b];
+		if(seen >= target) {
+			uint64_t limit = bucket_limit(b);
+			return limit < h->max? limit: h->max;
+		}
+	}
+
+	return h->max;
+}
+
+static void print_time(uint64_t ticks, double ns_per_tick) {
+	double ns = ticks * ns_per_tick;
+	if(ns < 10000) {
+		printf(" %8.0fns", ns);
+	} else if(ns < 10000000) {
+		printf(" %8.1fus", ns / 1e3);
+	} else {
+		printf(" %8.1fms", ns / 1e6);
+	}
+}
+
+static int compare_calls(const void *a, const void *b) {
+	const kernel_call_t *x = a;
+	const kernel_call_t *y = b;
+	return x->count < y->count? 1: x->count > y->count? -1: strcmp(x->name, y->name);
+}
+
+void stats_print(void) {
+	mach_timebase_info_data_t timebase;
+	mach_timebase_info(&timebase);
+	double ns_per_tick = (double)timebase.numer / timebase.denom;
+
+	printf("%-10s %8s %10s %10s %10s %10s\n", "phase", "count", "p50", "p99", "max", "total");
+	for(size_t i = 0; i < PHASES; i++) {
+		const histogram_t *h = &histograms[i];
+		printf("%-10s %8" PRIu64, phase_names[i], h->count);
+		if(h->count) {
+			print_time(percentile(h, 50), ns_per_tick);
+			print_time(percentile(h, 99), ns_per_tick);
+			print_time(h->max, ns_per_tick);
+			print_time(h->total, ns_per_tick);
+		}
+		puts("");
+	}
+
+	// The same name used in several files has several slots
+	kernel_call_t calls[KERNEL_CALL_SLOTS];
+	size_t count = 0;
+	for(size_t i = 0; i < KERNEL_CALL_SLOTS; i++) {
+		const char *name = kernel_calls[i].name;
+		if(!name) {
+			continue;
+		}
+
+		size_t j;
+		for(j = 0; j < count && strcmp(calls[j].name, name) != 0; j++);
+		if(j == count) {
+			calls[count++] = (kernel_call_t){name, 0};
+		}
+		calls[j].count += kernel_calls[i].count;
+	}
+
+	qsort(calls, count, sizeof(*calls), compare_calls);
+
+	puts("\nKernel calls:");
+	for(size_t i = 0; i < count; i++) {
+		printf("  %-24s %10" PRIu64 "\n", calls[i].name, calls[i].count);
+	}
+}
+
+void stats_reset(void) {
+	memset(histograms, 0, sizeof(histograms));
+	for(size_t i = 0; i < KERNEL_CALL_SLOTS; i++) {
+		kernel_calls[i].count = 0;
+	}
+}
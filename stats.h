@@ -0,0 +1,21 @@
+// The phases of a step, in the order they happen
+#define FOREACH_PHASE(X) \
+	X(assemble) \
+	X(write) \
+	X(run) \
+	X(state) \
+	X(render)
+
+#define PHASE_LIST(x) PHASE_##x,
+#define PHASE_STR_LIST(x) #x,
+
+typedef enum {
+	FOREACH_PHASE(PHASE_LIST)
+	PHASES
+} stats_phase_t;
+
+uint64_t stats_now(void);
+uint64_t stats_add(stats_phase_t phase, uint64_t start);
+void stats_kernel_call(const char *name);
+void stats_print(void);
+void stats_reset(void);
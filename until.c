@@ -0,0 +1,549 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <mach/mach.h>
+
+#include "arch.h"
+#include "assemble.h"
+#include "block.h"
+#include "expr.h"
+#include "registers.h"
+#include "until.h"
+
+// The checks run on the stack of the child below the red zone
+#define RED_ZONE 128
+#define WORD ((int)sizeof(gpr_register_t))
+
+#define REG_A  IF32("eax", "rax")
+#define REG_C  IF32("ecx", "rcx")
+#define REG_D  IF32("edx", "rdx")
+#define REG_SP IF32("esp", "rsp")
+#define REG_PC IF32("eip", "rip")
+
+// Slots of the registers saved by the prologue, counted from the top of the
+// saved area
+typedef enum {
+	SAVED_D,
+	SAVED_C,
+	SAVED_A,
+	SAVED_FLAGS,
+	SAVED_COUNT,
+} saved_slot;
+
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t capacity;
+	bool att;
+	// Values pushed on top of the saved registers while evaluating
+	int depth;
+	const char *error;
+} stub_t;
+
+// The condition waiting for the next snippet with an insertion point
+static expr_t *pending_condition;
+static mach_vm_address_t pending_counter;
+static char *pending_label;
+static bool pending;
+
+// The snippet the checks were last inserted into
+static mach_vm_address_t placed_start;
+static mach_vm_address_t placed_end;
+static char *placed_description;
+static char *instrumented_description;
+
+static unsigned int stub_id;
+
+static void append(stub_t *s, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	char *str;
+	int len = vasprintf(&str, fmt, ap);
+	va_end(ap);
+
+	if(s->len + len + 1 > s->capacity) {
+		s->capacity = 2 * (s->len + len + 1);
+		s->buf = realloc(s->buf, s->capacity);
+	}
+
+	memcpy(s->buf + s->len, str, len + 1);
+	s->len += len;
+	free(str);
+}
+
+#define OPERAND_BUFFERS 16
+#define OPERAND_SIZE 48
+
+// Operands are formatted into a ring of buffers so a few instructions can
+// be emitted from the same operands
+static char *operand_buffer(void) {
+	static char buffers[OPERAND_BUFFERS][OPERAND_SIZE];
+	static int next;
+	next = (next + 1) % OPERAND_BUFFERS;
+	return buffers[next];
+}
+
+static const char *reg(stub_t *s, const char *name) {
+	char *buf = operand_buffer();
+	snprintf(buf, OPERAND_SIZE, "%s%s", s->att? "%": "", name);
+	return buf;
+}
+
+static const char *mem(stub_t *s, const char *base, int disp) {
+	char *buf = operand_buffer();
+	if(s->att) {
+		snprintf(buf, OPERAND_SIZE, "%d(%%%s)", disp, base);
+	} else {
+		snprintf(buf, OPERAND_SIZE, "[%s%+d]", base, disp);
+	}
+	return buf;
+}
+
+static const char *imm(stub_t *s, uint64_t value) {
+	char *buf = operand_buffer();
+	snprintf(buf, OPERAND_SIZE, "%s0x%" PRIx64, s->att? "$": "", value);
+	return buf;
+}
+
+static void op0(stub_t *s, const char *mnemonic) {
+	append(s, "%s; ", mnemonic);
+}
+
+static void op1(stub_t *s, const char *mnemonic, const char *operand) {
+	append(s, "%s %s; ", mnemonic, operand);
+}
+
+static void op2(stub_t *s, const char *mnemonic, const char *dst, const char *src) {
+	if(s->att) {
+		append(s, "%s %s, %s; ", mnemonic, src, dst);
+	} else {
+		append(s, "%s %s, %s; ", mnemonic, dst, src);
+	}
+}
+
+// Zero extends the boolean in al to the whole register
+static void setcc(stub_t *s, const char *cc) {
+	append(s, "set%s %s; ", cc, reg(s, "al"));
+	if(s->att) {
+		append(s, "movzbl %%al, %%eax; ");
+	} else {
+		append(s, "movzx eax, al; ");
+	}
+}
+
+static void push(stub_t *s, const char *name) {
+	op1(s, "push", reg(s, name));
+	s->depth++;
+}
+
+static void pop(stub_t *s, const char *name) {
+	op1(s, "pop", reg(s, name));
+	s->depth--;
+}
+
+static const char *saved(stub_t *s, saved_slot slot) {
+	return mem(s, REG_SP, WORD * (s->depth + slot));
+}
+
+static const char *register_name(uint64_t offset) {
+#define X(r) do { \
+	if(offset == offsetof(x86_thread_state_t, uts.ts.__ ## r)) { \
+		return #r; \
+	} \
+} while(false)
+	FOREACH_REGISTER(X)
+#undef X
+
+	return NULL;
+}
+
+static void emit_register(stub_t *s, uint64_t offset) {
+	const char *name = register_name(offset);
+
+	if(strcmp(name, REG_PC) == 0) {
+		s->error = "the pc can't be used in a check";
+	} else if(strcmp(name, REG_A) == 0) {
+		op2(s, "mov", reg(s, REG_A), saved(s, SAVED_A));
+	} else if(strcmp(name, REG_C) == 0) {
+		op2(s, "mov", reg(s, REG_A), saved(s, SAVED_C));
+	} else if(strcmp(name, REG_D) == 0) {
+		op2(s, "mov", reg(s, REG_A), saved(s, SAVED_D));
+	} else if(strcmp(name, REG_SP) == 0) {
+		op2(s, "lea", reg(s, REG_A), mem(s, REG_SP, WORD * (s->depth + SAVED_COUNT) + RED_ZONE));
+	} else {
+		op2(s, "mov", reg(s, REG_A), reg(s, name));
+	}
+
+	push(s, REG_A);
+}
+
+static void emit_binary(stub_t *s, expr_op op) {
+	static const char *arithmetic[] = {
+		[OP_ADD] = "add",
+		[OP_SUB] = "sub",
+		[OP_MUL] = "imul",
+		[OP_AND] = "and",
+		[OP_OR] = "or",
+		[OP_XOR] = "xor",
+	};
+	static const char *conditions[] = {
+		[OP_EQ] = "e",
+		[OP_NE] = "ne",
+		[OP_LT] = "b",
+		[OP_LE] = "be",
+		[OP_GT] = "a",
+		[OP_GE] = "ae",
+	};
+
+	pop(s, REG_C);
+	pop(s, REG_A);
+
+	const char *a = reg(s, REG_A);
+	const char *c = reg(s, REG_C);
+
+	switch(op) {
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL:
+		case OP_AND:
+		case OP_OR:
+		case OP_XOR:
+			op2(s, arithmetic[op], a, c);
+			break;
+		case OP_SHL:
+		case OP_SHR:
+			// x86 masks the count, expressions shift everything out instead
+			op2(s, op == OP_SHL? "shl": "shr", a, reg(s, "cl"));
+			op2(s, "xor", reg(s, "edx"), reg(s, "edx"));
+			op2(s, "cmp", c, imm(s, 8 * WORD));
+			op2(s, "cmovae", a, reg(s, REG_D));
+			break;
+		case OP_EQ:
+		case OP_NE:
+		case OP_LT:
+		case OP_LE:
+		case OP_GT:
+		case OP_GE:
+			op2(s, "cmp", a, c);
+			setcc(s, conditions[op]);
+			break;
+		case OP_LAND:
+		case OP_LOR:
+			op2(s, "test", a, a);
+			op1(s, "setne", reg(s, "al"));
+			op2(s, "test", c, c);
+			op1(s, "setne", reg(s, "cl"));
+			op2(s, op == OP_LAND? "and": "or", reg(s, "al"), reg(s, "cl"));
+			setcc(s, "ne");
+			break;
+		default:
+			// A division by zero would crash the child
+			s->error = "division can't be used in a check";
+			break;
+	}
+
+	push(s, REG_A);
+}
+
+static void emit_condition(stub_t *s, const expr_t *expr) {
+	for(const expr_insn_t *insn = expr->code; insn != expr->code + expr->len && !s->error; insn++) {
+		switch(insn->op) {
+			case OP_CONST:
+				op2(s, "mov", reg(s, REG_A), imm(s, insn->arg));
+				push(s, REG_A);
+				break;
+			case OP_REG:
+				emit_register(s, insn->arg);
+				break;
+			case OP_FLAG:
+				op2(s, "mov", reg(s, REG_A), saved(s, SAVED_FLAGS));
+				op2(s, "shr", reg(s, REG_A), imm(s, __builtin_ctzll(insn->arg)));
+				op2(s, "and", reg(s, REG_A), imm(s, 1));
+				push(s, REG_A);
+				break;
+			case OP_DEREF:
+				pop(s, REG_A);
+				op2(s, "mov", reg(s, REG_A), mem(s, REG_A, 0));
+				push(s, REG_A);
+				break;
+			case OP_NEG:
+			case OP_NOT:
+				pop(s, REG_A);
+				op1(s, insn->op == OP_NEG? "neg": "not", reg(s, REG_A));
+				push(s, REG_A);
+				break;
+			case OP_LNOT:
+				pop(s, REG_A);
+				op2(s, "test", reg(s, REG_A), reg(s, REG_A));
+				setcc(s, "e");
+				push(s, REG_A);
+				break;
+			default:
+				emit_binary(s, insn->op);
+				break;
+		}
+	}
+}
+
+// Generates a check that leaves every register and flag untouched and only
+// traps when the condition is true, or when the counter reaches zero
+static char *generate_check(const expr_t *condition, mach_vm_address_t counter, bool att, const char **error) {
+	stub_t s = {
+		.att = att,
+	};
+
+	char label[32];
+	snprintf(label, sizeof(label), BLOCK_INTERNAL_LABEL "until_%u", stub_id++);
+
+	op2(&s, "lea", reg(&s, REG_SP), mem(&s, REG_SP, -RED_ZONE));
+	op0(&s, "pushf");
+	op1(&s, "push", reg(&s, REG_A));
+	op1(&s, "push", reg(&s, REG_C));
+	op1(&s, "push", reg(&s, REG_D));
+
+	const char *skip;
+	if(condition) {
+		emit_condition(&s, condition);
+		pop(&s, REG_A);
+		op2(&s, "test", reg(&s, REG_A), reg(&s, REG_A));
+		skip = "jz";
+	} else {
+		op2(&s, "mov", reg(&s, REG_A), imm(&s, counter));
+		if(att) {
+			append(&s, "dec%s (%%%s); ", IF32("l", "q"), REG_A);
+		} else {
+			append(&s, "dec %s [%s]; ", IF32("dword", "qword"), REG_A);
+		}
+		skip = "jnz";
+	}
+
+	// pop and lea don't change the flags of the test
+	pop(&s, REG_D);
+	pop(&s, REG_C);
+	pop(&s, REG_A);
+	op1(&s, skip, label);
+	op0(&s, "popf");
+	op2(&s, "lea", reg(&s, REG_SP), mem(&s, REG_SP, RED_ZONE));
+	op0(&s, "int3");
+	append(&s, "%s: ", label);
+	op0(&s, "popf");
+	op2(&s, "lea", reg(&s, REG_SP), mem(&s, REG_SP, RED_ZONE));
+
+	if(s.error) {
+		*error = s.error;
+		free(s.buf);
+		return NULL;
+	}
+
+	return s.buf;
+}
+
+static void forget_placed(void) {
+	placed_start = 0;
+	placed_end = 0;
+	free(placed_description);
+	placed_description = NULL;
+}
+
+static void clear_pending(void) {
+	expr_free(pending_condition);
+	pending_condition = NULL;
+	free(pending_label);
+	pending_label = NULL;
+	pending = false;
+}
+
+// Also forgets the last instrumented snippet, as its code may be recycled
+void until_clear(void) {
+	clear_pending();
+	forget_placed();
+}
+
+bool until_arm(expr_t *condition, mach_vm_address_t counter, const char *label, const char **error) {
+	// Checks are only validated once here, they are generated per insertion
+	char *check = generate_check(condition, counter, false, error);
+	if(!check) {
+		return false;
+	}
+	free(check);
+
+	clear_pending();
+	pending_condition = condition;
+	pending_counter = counter;
+	pending_label = label? strdup(label): NULL;
+	pending = true;
+	return true;
+}
+
+void until_print(void) {
+	if(!pending) {
+		return;
+	}
+
+	if(pending_condition) {
+		printf("Until: %s", pending_condition->source);
+	} else {
+		printf("Run: counter at 0x%llx", pending_counter);
+	}
+
+	if(pending_label) {
+		printf(" at %s", pending_label);
+	}
+	puts("");
+}
+
+static bool label_defined(char **labels, size_t count, const char *name, size_t len) {
+	for(size_t i = 0; i < count; i++) {
+		if(strlen(labels[i]) == len && strncmp(labels[i], name, len) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Whether a statement branches to a label defined earlier in the snippet
+static bool is_back_edge(const char *p, char **labels, size_t count) {
+	while(isspace(*p)) {
+		p++;
+	}
+
+	size_t len = 0;
+	while(isalpha(p[len])) {
+		len++;
+	}
+
+	if(len == 0 || (tolower(p[0]) != 'j' && strncasecmp(p, "loop", 4) != 0)) {
+		return false;
+	}
+
+	p += len;
+	while(isspace(*p)) {
+		p++;
+	}
+
+	size_t target_len = 0;
+	while(is_label_char(p[target_len])) {
+		target_len++;
+	}
+
+	return target_len > 0 && label_defined(labels, count, p, target_len);
+}
+
+// Inserts the pending check before every branch to an earlier label of the
+// snippet, or after the definition of the requested label
+bool until_instrument(char **code, bool att) {
+	if(!pending) {
+		return false;
+	}
+
+	stub_t out = {0};
+	char **labels = NULL;
+	size_t label_count = 0;
+	size_t inserted = 0;
+
+	const char *p = *code;
+	while(*p) {
+		const char *end = strchr(p, ';');
+		if(!end) {
+			end = p + strlen(p);
+		}
+
+		char *statement = strndup(p, end - p);
+		const char *rest = statement;
+		const char *label;
+		size_t label_len;
+		bool at_label = false;
+
+		while(take_label(&rest, &label, &label_len)) {
+			append(&out, "%.*s: ", (int)label_len, label);
+			labels = realloc(labels, (label_count + 1) * sizeof(*labels));
+			labels[label_count++] = strndup(label, label_len);
+
+			if(pending_label && strlen(pending_label) == label_len && strncmp(pending_label, label, label_len) == 0) {
+				at_label = true;
+			}
+		}
+
+		bool insert = pending_label? at_label: is_back_edge(rest, labels, label_count);
+		if(insert) {
+			const char *error;
+			char *check = generate_check(pending_condition, pending_counter, att, &error);
+			append(&out, "%s", check);
+			free(check);
+			inserted++;
+		}
+
+		while(isspace(*rest)) {
+			rest++;
+		}
+		if(*rest) {
+			append(&out, "%s; ", rest);
+		}
+		free(statement);
+
+		p = *end? end + 1: end;
+	}
+
+	for(size_t i = 0; i < label_count; i++) {
+		free(labels[i]);
+	}
+	free(labels);
+
+	if(inserted == 0) {
+		free(out.buf);
+		if(pending_label) {
+			printf("Label %s isn't defined in this snippet, no check was inserted.\n", pending_label);
+		} else {
+			puts("No branch back to an earlier label in this snippet, no check was inserted.");
+		}
+		return false;
+	}
+
+	free(instrumented_description);
+	if(pending_condition) {
+		asprintf(&instrumented_description, "Stopped because %s is true", pending_condition->source);
+	} else {
+		asprintf(&instrumented_description, "Stopped after the requested iterations");
+	}
+
+	free(*code);
+	*code = out.buf;
+	return true;
+}
+
+// Records where the instrumented snippet was written, end is its final int3.
+// The pending condition is only used up once the snippet is in the arena.
+void until_placed(mach_vm_address_t start, mach_vm_address_t end) {
+	until_clear();
+
+	placed_start = start;
+	placed_end = end;
+	placed_description = instrumented_description;
+	instrumented_description = NULL;
+}
+
+// Checks whether the child stopped on the int3 of a check. If so the rest of
+// the snippet is skipped by resuming at its end. Either way the snippet is
+// done with once the child stopped in it or at its end.
+bool until_hit(mach_vm_address_t pc, mach_vm_address_t *resume) {
+	if(!placed_description || pc < placed_start || pc > placed_end) {
+		return false;
+	}
+
+	bool hit = pc != placed_end;
+	if(hit) {
+		puts(placed_description);
+		*resume = placed_end;
+	}
+
+	forget_placed();
+	return hit;
+}
@@ -0,0 +1,6 @@
+bool until_arm(expr_t *condition, mach_vm_address_t counter, const char *label, const char **error);
+void until_clear(void);
+void until_print(void);
+bool until_instrument(char **code, bool att);
+void until_placed(mach_vm_address_t start, mach_vm_address_t end);
+bool until_hit(mach_vm_address_t pc, mach_vm_address_t *resume);
@@ -1,6 +1,14 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
+
+#include "colors.h"
+
+#define ISGRAPH(c) (((unsigned char)c) <= 127 && isgraph(c))
 
 int hex2int(char c) {
 	if('0' <= c && c <= '9') {
@@ -52,3 +60,34 @@ unsigned char *hex2bytes(char *hex, size_t *size, bool allow_odd) {
 
 	return buf;
 }
+
+// Prints a hexdump of data. If old is given only the rows that differ from it
+// are printed and the changed bytes are highlighted.
+void print_hexdump(uint64_t address, const unsigned char *data, size_t count, const unsigned char *old) {
+	const size_t row_bytes = 8;
+	for(size_t i = 0; i < count; i += row_bytes) {
+		size_t n = count - i < row_bytes? count - i: row_bytes;
+		if(old && memcmp(data + i, old + i, n) == 0) {
+			continue;
+		}
+
+		printf("%" PRIX64 ": ", address + i);
+		for(size_t j = 0; j < row_bytes; j++) {
+			if(j < n) {
+				unsigned char c = data[i + j];
+				bool changed = old && c != old[i + j];
+				printf("%s%c%c%s ", changed? KRED: "", int2hex(c >> 4), int2hex(c & 0x0f), changed? RESET: "");
+			} else {
+				printf("   ");
+			}
+		}
+
+		printf(" ");
+		for(size_t j = 0; j < n; j++) {
+			unsigned char c = data[i + j];
+			bool changed = old && c != old[i + j];
+			printf("%s%c%s", changed? KRED: "", ISGRAPH(c)? c: '.', changed? RESET: "");
+		}
+		puts("");
+	}
+}
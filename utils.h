@@ -1,3 +1,4 @@
 int hex2int(char c);
 char int2hex(int i);
 unsigned char *hex2bytes(char *hex, size_t *size, bool allow_odd);
+void print_hexdump(uint64_t address, const unsigned char *data, size_t count, const unsigned char *old);
@@ -0,0 +1,403 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/param.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+#include <emmintrin.h>
+
+#include "watch.h"
+#include "macros.h"
+#include "maps.h"
+#include "utils.h"
+
+#define MAX_WATCHES 16
+#define MAX_SEGMENTS 64
+
+// Pages of a watch that were writable when it was added, or a region
+// tracked for --record
+typedef struct {
+	mach_vm_address_t start;
+	mach_vm_address_t end;
+	// The protection of every page when it was last armed, the child may
+	// change it with mprotect
+	vm_prot_t *protections;
+	bool *dirty;
+	bool write_protected;
+	bool tracked;
+} watch_segment_t;
+
+typedef struct {
+	mach_vm_address_t address;
+	mach_vm_size_t len;
+	unsigned char *snapshot;
+	unsigned char *current;
+} watch_t;
+
+static watch_t watches[MAX_WATCHES];
+static size_t watch_count;
+
+static watch_segment_t segments[MAX_SEGMENTS];
+static size_t segment_count;
+
+static bool armed = false;
+// Set for a step that may enter the kernel, which fails instead of faulting
+// on a write-protected page
+static bool compare_only = false;
+
+#define PAGE_START(a) ((a) & ~(mach_vm_address_t)(vm_page_size - 1))
+#define PAGE_END(a) PAGE_START((a) + vm_page_size - 1)
+
+static bool add_segments(task_t task, mach_vm_address_t start, mach_vm_address_t end) {
+	size_t first = segment_count;
+
+	for(mach_vm_address_t a = start; a < end;) {
+		const map_region_t *region = maps_lookup(task, a);
+		if(!region || !(region->protection & VM_PROT_READ) || segment_count == MAX_SEGMENTS) {
+			segment_count = first;
+			return false;
+		}
+
+		mach_vm_address_t segment_end = MIN(region->end, end);
+
+		// Pages that can't be written can't change
+		if(region->protection & VM_PROT_WRITE) {
+			watch_segment_t *s = &segments[segment_count++];
+			s->start = a;
+			s->end = segment_end;
+			s->protections = calloc((segment_end - a) / vm_page_size, sizeof(*s->protections));
+			s->dirty = calloc((segment_end - a) / vm_page_size, sizeof(*s->dirty));
+			s->tracked = false;
+		}
+
+		a = segment_end;
+	}
+
+	return true;
+}
+
+bool watch_add(task_t task, mach_vm_address_t address, mach_vm_size_t len) {
+	if(len == 0 || watch_count == MAX_WATCHES) {
+		return false;
+	}
+
+	unsigned char *snapshot = malloc(len);
+	mach_vm_size_t count;
+	if(KERN_CALL("mach_vm_read_overwrite", mach_vm_read_overwrite(task, address, len, (mach_vm_address_t)snapshot, &count)) != KERN_SUCCESS || count != len) {
+		free(snapshot);
+		return false;
+	}
+
+	if(!add_segments(task, PAGE_START(address), PAGE_END(address + len))) {
+		free(snapshot);
+		return false;
+	}
+
+	watches[watch_count++] = (watch_t){
+		.address = address,
+		.len = len,
+		.snapshot = snapshot,
+		.current = malloc(len),
+	};
+
+	return true;
+}
+
+static void remove_segments(bool tracked) {
+	size_t kept = 0;
+	for(size_t i = 0; i < segment_count; i++) {
+		if(segments[i].tracked == tracked) {
+			free(segments[i].protections);
+			free(segments[i].dirty);
+		} else {
+			segments[kept++] = segments[i];
+		}
+	}
+	segment_count = kept;
+}
+
+void watch_clear(void) {
+	for(size_t i = 0; i < watch_count; i++) {
+		free(watches[i].snapshot);
+		free(watches[i].current);
+	}
+	watch_count = 0;
+
+	remove_segments(false);
+}
+
+// Tracks which pages of a region are written between stops, as for a watch
+// but without a snapshot. Every page starts out dirty.
+bool watch_track(mach_vm_address_t start, mach_vm_address_t end) {
+	if(segment_count == MAX_SEGMENTS) {
+		return false;
+	}
+
+	size_t pages = (PAGE_END(end) - PAGE_START(start)) / vm_page_size;
+	watch_segment_t *s = &segments[segment_count++];
+	*s = (watch_segment_t){
+		.start = PAGE_START(start),
+		.end = PAGE_END(end),
+		.protections = calloc(pages, sizeof(*s->protections)),
+		.dirty = malloc(pages * sizeof(*s->dirty)),
+		.tracked = true,
+	};
+	memset(s->dirty, true, pages * sizeof(*s->dirty));
+	return true;
+}
+
+void watch_untrack(void) {
+	remove_segments(true);
+}
+
+void watch_list(void) {
+	for(size_t i = 0; i < watch_count; i++) {
+		printf("%zu: 0x%llx-0x%llx (%llu bytes)\n", i, watches[i].address, watches[i].address + watches[i].len, watches[i].len);
+	}
+}
+
+// The next step may make a system call. A read(2) into a write-protected
+// buffer would fail with EFAULT instead of faulting, so its pages are
+// compared instead of protected.
+void watch_compare_next(void) {
+	compare_only = true;
+}
+
+static size_t page_index(const watch_segment_t *s, mach_vm_address_t page) {
+	return (page - s->start) / vm_page_size;
+}
+
+// Reads the current protection of every page of a segment
+static bool query_protections(task_t task, const watch_segment_t *s, vm_prot_t *protections) {
+	for(mach_vm_address_t a = s->start; a < s->end;) {
+		mach_vm_address_t address = a;
+		mach_vm_size_t size;
+		vm_region_basic_info_data_64_t info;
+		mach_msg_type_number_t info_count = VM_REGION_BASIC_INFO_COUNT_64;
+		mach_port_t object_name;
+		if(KERN_CALL("mach_vm_region", mach_vm_region(task, &address, &size, VM_REGION_BASIC_INFO_64, (vm_region_info_t)&info, &info_count, &object_name)) != KERN_SUCCESS || address > a) {
+			// Unmapped by the child
+			return false;
+		}
+
+		mach_vm_address_t end = MIN(address + size, s->end);
+		for(; a < end; a += vm_page_size) {
+			protections[page_index(s, a)] = info.protection;
+		}
+	}
+
+	return true;
+}
+
+// Applies the protection of every page of a segment, without write access
+// while armed, with one call per run of pages that share a protection
+static bool protect_segment(task_t task, watch_segment_t *s, bool write_protect) {
+	bool ok = true;
+	for(mach_vm_address_t a = s->start; a < s->end;) {
+		vm_prot_t protection = s->protections[page_index(s, a)];
+		mach_vm_address_t end = a + vm_page_size;
+		while(end < s->end && s->protections[page_index(s, end)] == protection) {
+			end += vm_page_size;
+		}
+
+		// Pages that can't be written can't change
+		if(protection & VM_PROT_WRITE) {
+			vm_prot_t applied = write_protect? protection & ~VM_PROT_WRITE: protection;
+			ok &= KERN_CALL("mach_vm_protect", mach_vm_protect(task, a, end - a, false, applied)) == KERN_SUCCESS;
+		}
+		a = end;
+	}
+
+	return ok;
+}
+
+// Write-protects the watched pages so the first write to each of them while
+// the child runs is reported to watch_fault. The protections are read again
+// every time, so what the child set with mprotect is restored afterwards.
+// Segments may overlap, so every protection is read before any is changed.
+void watch_arm(task_t task) {
+	armed = false;
+	for(size_t i = 0; i < segment_count; i++) {
+		watch_segment_t *s = &segments[i];
+		s->write_protected = !compare_only && query_protections(task, s, s->protections);
+	}
+
+	for(size_t i = 0; i < segment_count; i++) {
+		watch_segment_t *s = &segments[i];
+		if(!s->write_protected || !protect_segment(task, s, true)) {
+			// We can't track this segment so treat all of it as dirty
+			s->write_protected = false;
+			memset(s->dirty, true, (s->end - s->start) / vm_page_size);
+		}
+		armed |= s->write_protected;
+	}
+
+	compare_only = false;
+}
+
+void watch_disarm(task_t task) {
+	if(!armed) {
+		return;
+	}
+
+	for(size_t i = 0; i < segment_count; i++) {
+		watch_segment_t *s = &segments[i];
+		if(!s->write_protected) {
+			continue;
+		}
+
+		// A page the child protected itself while it ran keeps that
+		// protection, and may have been written
+		size_t pages = (s->end - s->start) / vm_page_size;
+		vm_prot_t *current = malloc(pages * sizeof(*current));
+		if(query_protections(task, s, current)) {
+			for(size_t page = 0; page < pages; page++) {
+				if(current[page] != (s->protections[page] & ~VM_PROT_WRITE)) {
+					s->protections[page] = current[page];
+					s->dirty[page] = true;
+				}
+			}
+		}
+		free(current);
+	}
+
+	for(size_t i = 0; i < segment_count; i++) {
+		if(segments[i].write_protected) {
+			protect_segment(task, &segments[i], false);
+		}
+	}
+
+	armed = false;
+}
+
+// Called from the exception handler on a protection fault. Returns true if
+// the fault was caused by a watched page, which is then made writable again.
+// A page of a superpage can't be protected on its own, so the whole segment
+// is given back and counted as dirty instead.
+bool watch_fault(task_t task, mach_vm_address_t address) {
+	if(!armed) {
+		return false;
+	}
+
+	bool handled = false;
+	for(size_t i = 0; i < segment_count; i++) {
+		watch_segment_t *s = &segments[i];
+		if(!s->write_protected || address < s->start || address >= s->end) {
+			continue;
+		}
+
+		mach_vm_address_t page = PAGE_START(address);
+		vm_prot_t protection = s->protections[page_index(s, page)];
+		s->dirty[page_index(s, page)] = true;
+		if(!(protection & VM_PROT_WRITE)) {
+			continue;
+		}
+
+		if(KERN_CALL("mach_vm_protect", mach_vm_protect(task, page, vm_page_size, false, protection)) != KERN_SUCCESS) {
+			protect_segment(task, s, false);
+			s->write_protected = false;
+			memset(s->dirty, true, (s->end - s->start) / vm_page_size);
+		}
+		handled = true;
+	}
+
+	return handled;
+}
+
+void watch_touch(mach_vm_address_t address, mach_vm_size_t len) {
+	for(size_t i = 0; i < segment_count; i++) {
+		watch_segment_t *s = &segments[i];
+		mach_vm_address_t start = MAX(PAGE_START(address), s->start);
+		mach_vm_address_t end = MIN(PAGE_END(address + len), s->end);
+		for(mach_vm_address_t page = start; page < end; page += vm_page_size) {
+			s->dirty[(page - s->start) / vm_page_size] = true;
+		}
+	}
+}
+
+// Marks everything as dirty, after the memory of the child was replaced
+void watch_touch_all(void) {
+	for(size_t i = 0; i < segment_count; i++) {
+		memset(segments[i].dirty, true, (segments[i].end - segments[i].start) / vm_page_size);
+	}
+}
+
+// Whether a page may have been written since the last stop. A page that no
+// segment covers wasn't tracked, so it is reported as dirty.
+bool watch_dirty(mach_vm_address_t page) {
+	bool covered = false;
+	for(size_t i = 0; i < segment_count; i++) {
+		watch_segment_t *s = &segments[i];
+		if(s->start <= page && page < s->end) {
+			if(s->dirty[page_index(s, page)]) {
+				return true;
+			}
+			covered = true;
+		}
+	}
+
+	return !covered;
+}
+
+static bool page_dirty(mach_vm_address_t page) {
+	for(size_t i = 0; i < segment_count; i++) {
+		watch_segment_t *s = &segments[i];
+		if(s->start <= page && page < s->end && s->dirty[(page - s->start) / vm_page_size]) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool equal_sse2(const unsigned char *a, const unsigned char *b, size_t len) {
+	size_t i = 0;
+	for(; i + sizeof(__m128i) <= len; i += sizeof(__m128i)) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) {
+			return false;
+		}
+	}
+
+	return memcmp(a + i, b + i, len - i) == 0;
+}
+
+// Fetches the dirty pages of each watch, prints the bytes that changed since
+// the last step and clears the dirty state
+void watch_print_changes(task_t task) {
+	for(size_t i = 0; i < watch_count; i++) {
+		watch_t *w = &watches[i];
+
+		for(mach_vm_address_t page = PAGE_START(w->address); page < w->address + w->len; page += vm_page_size) {
+			if(!page_dirty(page)) {
+				continue;
+			}
+
+			mach_vm_address_t start = MAX(page, w->address);
+			mach_vm_address_t end = MIN(page + vm_page_size, w->address + w->len);
+			size_t offset = start - w->address;
+
+			mach_vm_size_t count;
+			if(KERN_CALL("mach_vm_read_overwrite", mach_vm_read_overwrite(task, start, end - start, (mach_vm_address_t)(w->current + offset), &count)) != KERN_SUCCESS) {
+				continue;
+			}
+
+			if(equal_sse2(w->current + offset, w->snapshot + offset, count)) {
+				continue;
+			}
+
+			// Keep the hexdump rows aligned to the start of the watch
+			size_t row_offset = offset & ~(size_t)7;
+			memcpy(w->current + row_offset, w->snapshot + row_offset, offset - row_offset);
+			print_hexdump(w->address + row_offset, w->current + row_offset, offset + count - row_offset, w->snapshot + row_offset);
+			memcpy(w->snapshot + offset, w->current + offset, count);
+		}
+	}
+
+	for(size_t i = 0; i < segment_count; i++) {
+		memset(segments[i].dirty, false, (segments[i].end - segments[i].start) / vm_page_size);
+	}
+}
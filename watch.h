@@ -0,0 +1,13 @@
+bool watch_add(task_t task, mach_vm_address_t address, mach_vm_size_t len);
+void watch_clear(void);
+bool watch_track(mach_vm_address_t start, mach_vm_address_t end);
+void watch_untrack(void);
+void watch_list(void);
+void watch_compare_next(void);
+void watch_arm(task_t task);
+void watch_disarm(task_t task);
+bool watch_fault(task_t task, mach_vm_address_t address);
+void watch_touch(mach_vm_address_t address, mach_vm_size_t len);
+void watch_touch_all(void);
+bool watch_dirty(mach_vm_address_t page);
+void watch_print_changes(task_t task);